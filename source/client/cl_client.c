@@ -16,12 +16,36 @@ struct client_t {
   vk_rend_t *rend;
 
   input_t input;
+
+  // Title of the window before the loading screen was pushed
+  char *title;
+
+  // Frame stats are printed every `CL_STATS_INTERVAL_MS`, if asked for
+  bool stats;
+  Uint32 stats_time;
+  unsigned stats_frames;
 };
 
+#define CL_STATS_INTERVAL_MS 1000
+
 void *CL_GetWindow(client_t *client) { return client->window; }
 
 input_t *CL_GetInput(client_t *client) { return &client->input; }
 
+/// @brief Parse the value of a boolean argument, either 'true' or 'false'.
+/// @return false if it's neither, in which case `value` is left untouched.
+static bool CL_ParseBool(const char *name, const char *arg, bool *value) {
+  if (!strcmp(arg, "true")) {
+    *value = true;
+  } else if (!strcmp(arg, "false")) {
+    *value = false;
+  } else {
+    printf("%s is either 'true' or 'false'.\n", name);
+    return false;
+  }
+  return true;
+}
+
 bool CL_ParseClientDesc(client_desc_t *desc, int argc, char *argv[]) {
   // Arbitrary decision: in debug mode, a badly formed argument is fatal
   //                     in release mode, it's not
@@ -61,14 +85,25 @@ bool CL_ParseClientDesc(client_desc_t *desc, int argc, char *argv[]) {
         is_error = true;
         break;
       }
-      char *fullscreen = argv[i + 1];
-
-      if (!strcmp(fullscreen, "true")) {
-        desc->fullscreen = true;
-      } else if (!strcmp(fullscreen, "false")) {
-        desc->fullscreen = false;
-      } else {
-        printf("Fullscreen is either 'true' or 'false'.\n");
+      if (!CL_ParseBool("Fullscreen", argv[i + 1], &desc->fullscreen)) {
+        is_error = true;
+      }
+    } else if (!strcmp(arg, "--cpu-culling")) {
+      if (i + 1 >= argc) {
+        printf("Missing 'true' or 'false' after '--cpu-culling'.\n");
+        is_error = true;
+        break;
+      }
+      if (!CL_ParseBool("CPU culling", argv[i + 1], &desc->cpu_culling)) {
+        is_error = true;
+      }
+    } else if (!strcmp(arg, "--stats")) {
+      if (i + 1 >= argc) {
+        printf("Missing 'true' or 'false' after '--stats'.\n");
+        is_error = true;
+        break;
+      }
+      if (!CL_ParseBool("Stats", argv[i + 1], &desc->stats)) {
         is_error = true;
       }
     } else if (!strcmp(arg, "--physical_device") || !strcmp(arg, "-gpu")) {
@@ -122,9 +157,12 @@ client_t *CL_CreateClient(const char *title, client_desc_t *desc) {
 
   client->state = CLIENT_CREATING;
   client->window = window;
+  client->stats = desc->stats;
+  client->stats_time = SDL_GetTicks();
 
   // TODO: the referenced GPU in the description should be passed
-  client->rend = VK_CreateRend(client, desc->width, desc->height);
+  client->rend =
+      VK_CreateRend(client, desc->width, desc->height, desc->cpu_culling);
 
   if (client->rend == NULL) {
     printf("Failed to create a VK renderer. `%s`\n", VK_GetError());
@@ -212,16 +250,56 @@ void CL_UpdateClient(client_t *client) {
 
 void CL_DrawClient(client_t *client, game_state_t *game) {
   VK_Draw(client->rend, game);
+
+  if (!client->stats) {
+    return;
+  }
+
+  client->stats_frames++;
+  Uint32 elapsed = SDL_GetTicks() - client->stats_time;
+  if (elapsed >= CL_STATS_INTERVAL_MS) {
+    vk_frame_stats_t stats = VK_GetFrameStats(client->rend);
+    printf("%.1f fps, %u/%u draws visible, culled on the %s.\n",
+           client->stats_frames * 1000.0f / elapsed, stats.visible_draw_count,
+           stats.draw_count, stats.gpu_culling ? "GPU" : "CPU");
+
+    client->stats_time += elapsed;
+    client->stats_frames = 0;
+  }
+}
+
+void CL_PushLoadingScreen(client_t *client) {
+  if (client->title) {
+    return;
+  }
+
+  // Nothing is drawn on top of the scene yet, the title tells it's loading
+  const char *title = SDL_GetWindowTitle(client->window);
+  client->title = malloc(strlen(title) + 1);
+  strcpy(client->title, title);
+
+  size_t loading_title_len = strlen(title) + 14;
+  char *loading_title = malloc(loading_title_len);
+  snprintf(loading_title, loading_title_len, "%s (loading...)", title);
+  SDL_SetWindowTitle(client->window, loading_title);
+  free(loading_title);
 }
 
-void CL_PushLoadingScreen(client_t *client) {}
+void CL_PopLoadingScreen(client_t *client) {
+  if (!client->title) {
+    return;
+  }
 
-void CL_PopLoadingScreen(client_t *client) {}
+  SDL_SetWindowTitle(client->window, client->title);
+  free(client->title);
+  client->title = NULL;
+}
 
 void CL_DestroyClient(client_t *client) {
   VK_DestroyRend(client->rend);
   SDL_DestroyWindow(client->window);
   SDL_Quit();
 
+  free(client->title);
   free(client);
 }
@@ -12,6 +12,10 @@ typedef struct client_desc_t {
   char *desired_gpu;
   char *game;
   bool fullscreen;
+  // Cull draws on the CPU, even if the GPU could
+  bool cpu_culling;
+  // Print frame stats every second
+  bool stats;
 } client_desc_t;
 
 typedef enum client_state_t {
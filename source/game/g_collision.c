@@ -1,15 +1,44 @@
+#include "g_collision.h"
+
 #include "cglm/cglm.h"
+#include "g_file.h"
 #include "g_game.h"
+#include "g_jobs.h"
 #include "vk/vk.h"
 
+#include <float.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-typedef struct intersection_t {
-  float t;
-  vec3 n;
-} intersection_t;
+#if defined(__x86_64__) || defined(__i386__)
+#define COLLISION_X86
+#include <immintrin.h>
+#endif
+
+// Triangles of a leaf are tested together, a packet at a time
+#define COLLISION_PACKET_WIDTH 8
+// Leaves holding more triangles than that are split, even if the SAH says it's
+// not worth it
+#define BVH_MAX_LEAF_SIZE COLLISION_PACKET_WIDTH
+// Past this depth, nodes become leaves no matter what. Keeps the traversal
+// stack bounded on degenerate inputs
+#define BVH_MAX_DEPTH 48
+#define BVH_BIN_COUNT 16
+// Cost of visiting a node, relative to testing one packet of triangles
+#define BVH_TRAVERSAL_COST 1.0f
+// Rays of a batch traverse the BVH together, by chunks of that many
+#define COLLISION_BATCH_SIZE 64
+// Triangles handled by each job when loading
+#define COLLISION_JOB_SIZE 16384
+// Subtrees are built in parallel once they hold fewer triangles than that
+#define BVH_MIN_TASK_SIZE 4096
+
+// Bump whenever the layout of the cache, or the way it's built, changes
+#define COLLISION_CACHE_VERSION 1
 
 typedef struct triangle_t {
   vec3 a;
@@ -18,63 +47,603 @@ typedef struct triangle_t {
   vec3 n;
 } triangle_t;
 
-typedef struct collision_mesh_t {
+/// @brief COLLISION_PACKET_WIDTH triangles, stored as structure of arrays so a
+/// whole packet is tested with a few SIMD instructions. Edges are precomputed.
+/// Unused lanes are zeroed, which makes them degenerate and never hit.
+typedef struct triangle_packet_t {
+  _Alignas(32) float a[3][COLLISION_PACKET_WIDTH];
+  float edge1[3][COLLISION_PACKET_WIDTH];
+  float edge2[3][COLLISION_PACKET_WIDTH];
+} triangle_packet_t;
+
+typedef struct bvh_node_t {
+  vec3 min;
+  // Inner node: index of the left child, the right one comes right after.
+  // Leaf: index of its first triangle, always at the start of a packet.
+  unsigned first;
+  vec3 max;
+  // Number of triangles of a leaf, 0 for inner nodes
+  unsigned count;
+} bvh_node_t;
+
+struct collision_mesh_t {
+  // Sorted so that each BVH leaf references a contiguous range, padded with
+  // degenerate triangles up to the packet width. `triangle_count` includes
+  // the padding.
   triangle_t *triangles;
   unsigned triangle_count;
-} collision_mesh_t;
 
-collision_mesh_t *G_LoadCollisionMap(primitive_t *primitives,
-                                     size_t primitive_count) {
-  // We don't know the number of triangles in advance
-  triangle_t *triangles = calloc(1, sizeof(triangle_t) * 1024);
-  unsigned triangle_capacity = 1024;
-  unsigned triangle_count = 0;
-  // TODO: this is SUPER naive
-  for (size_t i = 0; i < primitive_count; i++) {
-    primitive_t *primitive = &primitives[i];
+  // Same triangles, packed. Triangle `t` is lane `t % COLLISION_PACKET_WIDTH`
+  // of packet `t / COLLISION_PACKET_WIDTH`
+  triangle_packet_t *packets;
+  unsigned packet_count;
+
+  bvh_node_t *nodes;
+  unsigned node_count;
+
+  // When loaded from a cache, everything above points into that file
+  mapped_file_t file;
+};
+
+/// @brief Header of a cooked collision mesh. The sections follow, in the
+/// native layout of the structures.
+typedef struct collision_cache_header_t {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_hash;
+
+  // Catches caches written by another build, with other structure layouts
+  uint32_t triangle_size;
+  uint32_t packet_size;
+  uint32_t node_size;
+
+  uint32_t triangle_count;
+  uint32_t packet_count;
+  uint32_t node_count;
+
+  uint64_t triangles_offset;
+  uint64_t packets_offset;
+  uint64_t nodes_offset;
+} collision_cache_header_t;
+
+/// @brief Node to visit by a batch of rays, and where to find the indices of
+/// the rays reaching it.
+typedef struct batch_entry_t {
+  unsigned node;
+  unsigned first;
+  unsigned count;
+} batch_entry_t;
+
+/// @brief Rays cast by `G_CollisionRayQueryBatch`, one job per chunk.
+typedef struct ray_batch_t {
+  collision_mesh_t *mesh;
+  collision_ray_t *rays;
+  collision_hit_t *hits;
+  unsigned ray_count;
+} ray_batch_t;
+
+/// @brief Subtree deferred to a job, built in its own node array, then
+/// merged back.
+typedef struct bvh_task_t {
+  unsigned node;
+  unsigned first;
+  unsigned count;
+  unsigned depth;
+
+  bvh_node_t *nodes;
+  unsigned node_count;
+} bvh_task_t;
+
+typedef struct bvh_bounds_t {
+  vec3 min;
+  vec3 max;
+} bvh_bounds_t;
+
+typedef struct bvh_build_t {
+  triangle_t *triangles;
+  // Computed once, as the build goes over them again and again
+  bvh_bounds_t *bounds;
+  vec3 *centroids;
+  unsigned *indices;
+  unsigned triangle_count;
+
+  bvh_node_t *nodes;
+  unsigned node_count;
+
+  // Nodes holding at most that many triangles become tasks, 0 to build
+  // everything right away
+  unsigned task_size;
+  bvh_task_t *tasks;
+  unsigned task_count;
+  unsigned task_capacity;
+} bvh_build_t;
 
-    for (size_t j = 0; j < primitive->index_count / 3; j++) {
-      triangle_t new_triangle;
-      unsigned i_a = primitive->indices[j * 3 + 0];
-      unsigned i_b = primitive->indices[j * 3 + 1];
-      unsigned i_c = primitive->indices[j * 3 + 2];
-      {
-        new_triangle.a[0] = primitive->vertices[i_a].pos[0];
-        new_triangle.a[1] = primitive->vertices[i_a].pos[1];
-        new_triangle.a[2] = primitive->vertices[i_a].pos[2];
+/// @brief Leaf of the BVH, and where its triangles go once packed.
+typedef struct bvh_leaf_t {
+  unsigned node;
+  unsigned first;
+  unsigned slot;
+} bvh_leaf_t;
+
+typedef struct bvh_bin_t {
+  vec3 min;
+  vec3 max;
+  unsigned count;
+} bvh_bin_t;
+
+static float G_BoxArea(vec3 min, vec3 max) {
+  vec3 d;
+  glm_vec3_sub(max, min, d);
+  if (d[0] < 0.0f || d[1] < 0.0f || d[2] < 0.0f) {
+    return 0.0f;
+  }
+  return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static void G_GrowBox(vec3 min, vec3 max, bvh_bounds_t *bounds) {
+  glm_vec3_minv(min, bounds->min, min);
+  glm_vec3_maxv(max, bounds->max, max);
+}
+
+static float G_PacketCount(unsigned count) {
+  return (float)((count + COLLISION_PACKET_WIDTH - 1) / COLLISION_PACKET_WIDTH);
+}
+
+static void G_BuildBVHNode(bvh_build_t *build, unsigned node_index,
+                           unsigned first, unsigned count, unsigned depth) {
+  if (count <= build->task_size) {
+    if (build->task_count == build->task_capacity) {
+      build->task_capacity = build->task_capacity * 2 + 16;
+      build->tasks =
+          realloc(build->tasks, sizeof(bvh_task_t) * build->task_capacity);
+    }
+    build->tasks[build->task_count++] = (bvh_task_t){
+        .node = node_index,
+        .first = first,
+        .count = count,
+        .depth = depth,
+    };
+    return;
+  }
+
+  bvh_node_t *node = &build->nodes[node_index];
+
+  // Bounds of the triangles, and bounds of their centroids to place the bins
+  vec3 centroid_min = {FLT_MAX, FLT_MAX, FLT_MAX};
+  vec3 centroid_max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  glm_vec3_copy(centroid_min, node->min);
+  glm_vec3_copy(centroid_max, node->max);
+
+  for (unsigned i = first; i < first + count; i++) {
+    unsigned t = build->indices[i];
+    G_GrowBox(node->min, node->max, &build->bounds[t]);
+    glm_vec3_minv(centroid_min, build->centroids[t], centroid_min);
+    glm_vec3_maxv(centroid_max, build->centroids[t], centroid_max);
+  }
+
+  node->first = first;
+  node->count = count;
+
+  // Splitting a single packet never pays off
+  if (count <= COLLISION_PACKET_WIDTH || depth >= BVH_MAX_DEPTH) {
+    return;
+  }
+
+  // Binned SAH, on each axis
+  float best_cost = FLT_MAX;
+  int best_axis = -1;
+  unsigned best_split = 0;
+
+  // All the axes are binned in a single pass over the triangles
+  bvh_bin_t axis_bins[3][BVH_BIN_COUNT];
+  float scales[3];
+  for (int axis = 0; axis < 3; axis++) {
+    float extent = centroid_max[axis] - centroid_min[axis];
+    scales[axis] = extent <= 1e-6f ? 0.0f : BVH_BIN_COUNT / extent;
+
+    for (unsigned b = 0; b < BVH_BIN_COUNT; b++) {
+      bvh_bin_t *bin = &axis_bins[axis][b];
+      glm_vec3_copy((vec3){FLT_MAX, FLT_MAX, FLT_MAX}, bin->min);
+      glm_vec3_copy((vec3){-FLT_MAX, -FLT_MAX, -FLT_MAX}, bin->max);
+      bin->count = 0;
+    }
+  }
+
+  for (unsigned i = first; i < first + count; i++) {
+    unsigned t = build->indices[i];
+    for (int axis = 0; axis < 3; axis++) {
+      unsigned b =
+          (unsigned)((build->centroids[t][axis] - centroid_min[axis]) *
+                     scales[axis]);
+      if (b >= BVH_BIN_COUNT) {
+        b = BVH_BIN_COUNT - 1;
       }
-      {
-        new_triangle.b[0] = primitive->vertices[i_b].pos[0];
-        new_triangle.b[1] = primitive->vertices[i_b].pos[1];
-        new_triangle.b[2] = primitive->vertices[i_b].pos[2];
+      axis_bins[axis][b].count++;
+      G_GrowBox(axis_bins[axis][b].min, axis_bins[axis][b].max,
+                &build->bounds[t]);
+    }
+  }
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (scales[axis] == 0.0f) {
+      continue;
+    }
+
+    bvh_bin_t *bins = axis_bins[axis];
+
+    // Sweep from the right to get the cost of every right side, then from
+    // the left to evaluate each split plane
+    float right_areas[BVH_BIN_COUNT];
+    unsigned right_counts[BVH_BIN_COUNT];
+    vec3 right_min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    vec3 right_max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    unsigned right_count = 0;
+    for (unsigned b = BVH_BIN_COUNT - 1; b > 0; b--) {
+      glm_vec3_minv(right_min, bins[b].min, right_min);
+      glm_vec3_maxv(right_max, bins[b].max, right_max);
+      right_count += bins[b].count;
+      right_areas[b] = G_BoxArea(right_min, right_max);
+      right_counts[b] = right_count;
+    }
+
+    vec3 left_min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    vec3 left_max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    unsigned left_count = 0;
+    for (unsigned b = 1; b < BVH_BIN_COUNT; b++) {
+      glm_vec3_minv(left_min, bins[b - 1].min, left_min);
+      glm_vec3_maxv(left_max, bins[b - 1].max, left_max);
+      left_count += bins[b - 1].count;
+
+      if (left_count == 0 || right_counts[b] == 0) {
+        continue;
       }
-      {
-        new_triangle.c[0] = primitive->vertices[i_c].pos[0];
-        new_triangle.c[1] = primitive->vertices[i_c].pos[1];
-        new_triangle.c[2] = primitive->vertices[i_c].pos[2];
+
+      float cost = G_PacketCount(left_count) * G_BoxArea(left_min, left_max) +
+                   G_PacketCount(right_counts[b]) * right_areas[b];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
       }
+    }
+  }
+
+  float area = G_BoxArea(node->min, node->max);
+  float leaf_cost = G_PacketCount(count);
+  float split_cost =
+      best_axis < 0 || area <= 0.0f
+          ? FLT_MAX
+          : BVH_TRAVERSAL_COST + best_cost / area;
+
+  if (split_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE) {
+    return;
+  }
+
+  unsigned mid = first;
+  if (best_axis >= 0) {
+    float extent = centroid_max[best_axis] - centroid_min[best_axis];
+    float scale = BVH_BIN_COUNT / extent;
+
+    unsigned *left = &build->indices[first];
+    unsigned *right = &build->indices[first + count - 1];
+    while (left <= right) {
+      unsigned b = (unsigned)((build->centroids[*left][best_axis] -
+                               centroid_min[best_axis]) *
+                              scale);
+      if (b >= BVH_BIN_COUNT) {
+        b = BVH_BIN_COUNT - 1;
+      }
+
+      if (b < best_split) {
+        left++;
+      } else {
+        unsigned tmp = *left;
+        *left = *right;
+        *right = tmp;
+        right--;
+      }
+    }
+
+    mid = (unsigned)(left - build->indices);
+  }
+
+  // All the centroids are at the same place, or the binning didn't separate
+  // anything: split in the middle of the range
+  if (mid == first || mid == first + count) {
+    mid = first + count / 2;
+  }
+
+  unsigned left_index = build->node_count;
+  build->node_count += 2;
 
-      {
-        vec3 b_a, c_a;
-        glm_vec3_sub(new_triangle.b, new_triangle.a, b_a);
-        glm_vec3_sub(new_triangle.c, new_triangle.a, c_a);
-        glm_vec3_cross(b_a, c_a, new_triangle.n);
-        glm_normalize(new_triangle.n);
+  node->first = left_index;
+  node->count = 0;
+
+  G_BuildBVHNode(build, left_index, first, mid - first, depth + 1);
+  G_BuildBVHNode(build, left_index + 1, mid, first + count - mid, depth + 1);
+}
+
+static void G_BuildBVHTask(void *data, unsigned index) {
+  bvh_build_t *build = data;
+  bvh_task_t *task = &build->tasks[index];
+
+  // Only touches its own range of indices, and its own nodes
+  bvh_build_t local = {
+      .triangles = build->triangles,
+      .bounds = build->bounds,
+      .centroids = build->centroids,
+      .indices = build->indices,
+      .triangle_count = build->triangle_count,
+      .nodes = malloc(sizeof(bvh_node_t) * (task->count * 2 + 1)),
+      .node_count = 1,
+  };
+
+  G_BuildBVHNode(&local, 0, task->first, task->count, task->depth);
+
+  task->nodes = local.nodes;
+  task->node_count = local.node_count;
+}
+
+static void G_ComputeCentroids(void *data, unsigned index) {
+  bvh_build_t *build = data;
+
+  unsigned first = index * COLLISION_JOB_SIZE;
+  unsigned last = first + COLLISION_JOB_SIZE;
+  if (last > build->triangle_count) {
+    last = build->triangle_count;
+  }
+
+  for (unsigned t = first; t < last; t++) {
+    triangle_t *triangle = &build->triangles[t];
+    bvh_bounds_t *bounds = &build->bounds[t];
+    glm_vec3_minv(triangle->a, triangle->b, bounds->min);
+    glm_vec3_minv(bounds->min, triangle->c, bounds->min);
+    glm_vec3_maxv(triangle->a, triangle->b, bounds->max);
+    glm_vec3_maxv(bounds->max, triangle->c, bounds->max);
+
+    glm_vec3_add(triangle->a, triangle->b, build->centroids[t]);
+    glm_vec3_add(build->centroids[t], triangle->c, build->centroids[t]);
+    glm_vec3_scale(build->centroids[t], 1.0f / 3.0f, build->centroids[t]);
+    build->indices[t] = t;
+  }
+}
+
+typedef struct bvh_pack_t {
+  triangle_t *unsorted;
+  unsigned *indices;
+
+  triangle_t *triangles;
+  triangle_packet_t *packets;
+
+  bvh_node_t *nodes;
+  bvh_leaf_t *leaves;
+  unsigned leaf_count;
+} bvh_pack_t;
+
+static void G_PackLeaves(void *data, unsigned index) {
+  bvh_pack_t *pack = data;
+
+  // Leaves hold at most a few packets, so that's a lot less than
+  // COLLISION_JOB_SIZE triangles
+  unsigned first = index * (COLLISION_JOB_SIZE / COLLISION_PACKET_WIDTH);
+  unsigned last = first + COLLISION_JOB_SIZE / COLLISION_PACKET_WIDTH;
+  if (last > pack->leaf_count) {
+    last = pack->leaf_count;
+  }
+
+  for (unsigned l = first; l < last; l++) {
+    bvh_leaf_t *leaf = &pack->leaves[l];
+    unsigned count = pack->nodes[leaf->node].count;
+
+    for (unsigned i = 0; i < count; i++) {
+      unsigned slot = leaf->slot + i;
+      triangle_t *triangle = &pack->triangles[slot];
+      *triangle = pack->unsorted[pack->indices[leaf->first + i]];
+
+      triangle_packet_t *packet = &pack->packets[slot / COLLISION_PACKET_WIDTH];
+      unsigned lane = slot % COLLISION_PACKET_WIDTH;
+      for (int axis = 0; axis < 3; axis++) {
+        packet->a[axis][lane] = triangle->a[axis];
+        packet->edge1[axis][lane] = triangle->b[axis] - triangle->a[axis];
+        packet->edge2[axis][lane] = triangle->c[axis] - triangle->a[axis];
       }
+    }
+  }
+}
+
+static void G_BuildBVH(collision_mesh_t *mesh) {
+  unsigned triangle_count = mesh->triangle_count;
+
+  // An empty map has an empty tree, every query bails out before reaching it
+  if (triangle_count == 0) {
+    mesh->packets = NULL;
+    mesh->packet_count = 0;
+    mesh->nodes = NULL;
+    mesh->node_count = 0;
+    return;
+  }
+
+  unsigned job_count =
+      (triangle_count + COLLISION_JOB_SIZE - 1) / COLLISION_JOB_SIZE;
+
+  bvh_build_t build = {
+      .triangles = mesh->triangles,
+      .bounds = malloc(sizeof(bvh_bounds_t) * (triangle_count + 1)),
+      .centroids = malloc(sizeof(vec3) * (triangle_count + 1)),
+      .indices = malloc(sizeof(unsigned) * (triangle_count + 1)),
+      // A binary tree with N leaves has 2N - 1 nodes, at most
+      .triangle_count = triangle_count,
+      .nodes = malloc(sizeof(bvh_node_t) * (triangle_count * 2 + 1)),
+      .node_count = 1,
+  };
 
-      if (triangle_count == triangle_capacity) {
-        triangle_capacity *= 2;
-        triangles = realloc(triangles, triangle_capacity * sizeof(triangle_t));
+  G_ParallelFor(job_count, G_ComputeCentroids, &build);
+
+  // The top of the tree is built right away, until there are enough
+  // subtrees to keep all the threads busy
+  build.task_size = triangle_count / (G_GetJobThreadCount() * 8);
+  if (build.task_size < BVH_MIN_TASK_SIZE) {
+    build.task_size = BVH_MIN_TASK_SIZE;
+  }
+
+  G_BuildBVHNode(&build, 0, 0, triangle_count, 0);
+  G_ParallelFor(build.task_count, G_BuildBVHTask, &build);
+
+  // Merge the subtrees. The root of a task takes the place of the node it
+  // was deferred from, the other nodes go at the end, with their children
+  // indices shifted accordingly.
+  for (unsigned i = 0; i < build.task_count; i++) {
+    bvh_task_t *task = &build.tasks[i];
+    unsigned base = build.node_count - 1;
+
+    for (unsigned n = 0; n < task->node_count; n++) {
+      bvh_node_t *node = &task->nodes[n];
+      if (node->count == 0) {
+        node->first += base;
       }
+    }
 
-      triangles[triangle_count] = new_triangle;
-      triangle_count++;
+    build.nodes[task->node] = task->nodes[0];
+    memcpy(&build.nodes[build.node_count], &task->nodes[1],
+           sizeof(bvh_node_t) * (task->node_count - 1));
+    build.node_count += task->node_count - 1;
+
+    free(task->nodes);
+  }
+  free(build.tasks);
+
+  // Each leaf starts on a new packet
+  bvh_leaf_t *leaves = malloc(sizeof(bvh_leaf_t) * (build.node_count + 1));
+  unsigned leaf_count = 0;
+  unsigned slot_count = 0;
+  for (unsigned n = 0; n < build.node_count; n++) {
+    bvh_node_t *node = &build.nodes[n];
+    if (node->count == 0) {
+      continue;
     }
+
+    leaves[leaf_count++] = (bvh_leaf_t){n, node->first, slot_count};
+    node->first = slot_count;
+    slot_count += (unsigned)G_PacketCount(node->count) * COLLISION_PACKET_WIDTH;
   }
 
-  collision_mesh_t *mesh = malloc(sizeof(collision_mesh_t));
+  // Reorder the triangles to match the leaves, and pack them
+  unsigned packet_count = slot_count / COLLISION_PACKET_WIDTH;
+  triangle_packet_t *packets =
+      aligned_alloc(_Alignof(triangle_packet_t),
+                    sizeof(triangle_packet_t) * (packet_count + 1));
+  memset(packets, 0, sizeof(triangle_packet_t) * (packet_count + 1));
+
+  bvh_pack_t pack = {
+      .unsorted = mesh->triangles,
+      .indices = build.indices,
+      .triangles = calloc(slot_count + 1, sizeof(triangle_t)),
+      .packets = packets,
+      .nodes = build.nodes,
+      .leaves = leaves,
+      .leaf_count = leaf_count,
+  };
+
+  unsigned leaves_per_job = COLLISION_JOB_SIZE / COLLISION_PACKET_WIDTH;
+  G_ParallelFor((leaf_count + leaves_per_job - 1) / leaves_per_job,
+                G_PackLeaves, &pack);
+
+  free(mesh->triangles);
+  free(build.bounds);
+  free(build.centroids);
+  free(build.indices);
+  free(leaves);
+
+  mesh->triangles = pack.triangles;
+  mesh->triangle_count = slot_count;
+  mesh->packets = packets;
+  mesh->packet_count = packet_count;
+  mesh->nodes = realloc(build.nodes, sizeof(bvh_node_t) * build.node_count);
+  mesh->node_count = build.node_count;
+}
+
+typedef struct collision_extract_t {
+  primitive_t *primitives;
+  size_t primitive_count;
+  // First triangle of each primitive, and the total at the end
+  unsigned *offsets;
+  triangle_t *triangles;
+} collision_extract_t;
+
+static void G_ExtractTriangles(void *data, unsigned index) {
+  collision_extract_t *extract = data;
+
+  unsigned first = index * COLLISION_JOB_SIZE;
+  unsigned last = first + COLLISION_JOB_SIZE;
+  if (last > extract->offsets[extract->primitive_count]) {
+    last = extract->offsets[extract->primitive_count];
+  }
+
+  // Primitive holding the first triangle of the range
+  size_t p = 0;
+  size_t end = extract->primitive_count;
+  while (p + 1 < end) {
+    size_t mid = (p + end) / 2;
+    if (extract->offsets[mid] <= first) {
+      p = mid;
+    } else {
+      end = mid;
+    }
+  }
+
+  for (unsigned t = first; t < last; t++) {
+    while (t >= extract->offsets[p + 1]) {
+      p++;
+    }
+
+    primitive_t *primitive = &extract->primitives[p];
+    unsigned j = t - extract->offsets[p];
+    triangle_t *triangle = &extract->triangles[t];
+
+    unsigned i_a = VK_GetIndex(primitive, j * 3 + 0);
+    unsigned i_b = VK_GetIndex(primitive, j * 3 + 1);
+    unsigned i_c = VK_GetIndex(primitive, j * 3 + 2);
+    memcpy(triangle->a, VK_GetVertexPosition(primitive, i_a), sizeof(vec3));
+    memcpy(triangle->b, VK_GetVertexPosition(primitive, i_b), sizeof(vec3));
+    memcpy(triangle->c, VK_GetVertexPosition(primitive, i_c), sizeof(vec3));
+
+    vec3 b_a, c_a;
+    glm_vec3_sub(triangle->b, triangle->a, b_a);
+    glm_vec3_sub(triangle->c, triangle->a, c_a);
+    glm_vec3_cross(b_a, c_a, triangle->n);
+    glm_normalize(triangle->n);
+  }
+}
+
+collision_mesh_t *G_LoadCollisionMap(primitive_t *primitives,
+                                     size_t primitive_count) {
+  // Every primitive knows its number of triangles, so they can be extracted
+  // in parallel, straight to their final place
+  unsigned *offsets = malloc(sizeof(unsigned) * (primitive_count + 1));
+  unsigned triangle_count = 0;
+  for (size_t i = 0; i < primitive_count; i++) {
+    offsets[i] = triangle_count;
+    triangle_count += primitives[i].index_count / 3;
+  }
+  offsets[primitive_count] = triangle_count;
+
+  collision_extract_t extract = {
+      .primitives = primitives,
+      .primitive_count = primitive_count,
+      .offsets = offsets,
+      .triangles = malloc(sizeof(triangle_t) * (triangle_count + 1)),
+  };
+
+  G_ParallelFor((triangle_count + COLLISION_JOB_SIZE - 1) / COLLISION_JOB_SIZE,
+                G_ExtractTriangles, &extract);
+
+  free(offsets);
+
+  collision_mesh_t *mesh = calloc(1, sizeof(collision_mesh_t));
   mesh->triangle_count = triangle_count;
-  mesh->triangles = triangles;
+  mesh->triangles = extract.triangles;
+
+  G_BuildBVH(mesh);
 
   return mesh;
 }
@@ -92,17 +661,17 @@ bool G_TestTriangle(triangle_t *triangle, vec3 orig, vec3 dir, float distance,
 
   float det = glm_vec3_dot(edge1, pvec);
 
-  if (det > -0.000001 && det < 0.000001) {
+  if (det > -0.000001f && det < 0.000001f) {
     return false;
   }
 
-  float inv_det = 1.0 / det;
+  float inv_det = 1.0f / det;
 
   vec3 tvec;
   glm_vec3_sub(orig, triangle->a, tvec);
 
   float u = glm_vec3_dot(tvec, pvec) * inv_det;
-  if (u < 0.0 || u > 1.0) {
+  if (u < 0.0f || u > 1.0f) {
     return false;
   }
 
@@ -110,12 +679,12 @@ bool G_TestTriangle(triangle_t *triangle, vec3 orig, vec3 dir, float distance,
   glm_vec3_cross(tvec, edge1, qvec);
 
   float v = glm_vec3_dot(dir, qvec) * inv_det;
-  if (v < 0.0 || u + v > 1.0) {
+  if (v < 0.0f || u + v > 1.0f) {
     return false;
   }
 
   float t = glm_vec3_dot(edge2, qvec) * inv_det;
-  if (t < 0.0 || t >= distance) {
+  if (t < 0.0f || t >= distance) {
     return false;
   }
 
@@ -126,55 +695,936 @@ bool G_TestTriangle(triangle_t *triangle, vec3 orig, vec3 dir, float distance,
   return true;
 }
 
-bool G_CollisionRayQuery(collision_mesh_t *mesh, vec3 orig, vec3 dir,
-                         float distance, bool movement, float *corr) {
-  // A shame, really
-  intersection_t intersections[10];
-  unsigned intersection_count = 0;
+/// @brief Test the triangles of a packet, and return the lane of the closest
+/// hit nearer than `*closest`, or -1. `*closest` is updated on hit.
+typedef int (*packet_test_t)(collision_mesh_t *mesh, unsigned packet,
+                             vec3 orig, vec3 dir, float *closest);
+
+static int G_TestPacketScalar(collision_mesh_t *mesh, unsigned packet,
+                              vec3 orig, vec3 dir, float *closest) {
+  int hit = -1;
+  triangle_t *triangles = &mesh->triangles[packet * COLLISION_PACKET_WIDTH];
+  for (int lane = 0; lane < COLLISION_PACKET_WIDTH; lane++) {
+    vec3 tuv;
+    if (G_TestTriangle(&triangles[lane], orig, dir, *closest, tuv)) {
+      *closest = tuv[0];
+      hit = lane;
+    }
+  }
+  return hit;
+}
+
+static int G_ClosestLane(float *t, int mask, float *closest) {
+  int hit = -1;
+  for (int lane = 0; lane < COLLISION_PACKET_WIDTH; lane++) {
+    if ((mask & (1 << lane)) && t[lane] < *closest) {
+      *closest = t[lane];
+      hit = lane;
+    }
+  }
+  return hit;
+}
+
+#ifdef COLLISION_X86
+static int G_TestPacketSSE(collision_mesh_t *mesh, unsigned packet,
+                           vec3 orig, vec3 dir, float *closest) {
+  triangle_packet_t *p = &mesh->packets[packet];
+
+  __m128 ox = _mm_set1_ps(orig[0]);
+  __m128 oy = _mm_set1_ps(orig[1]);
+  __m128 oz = _mm_set1_ps(orig[2]);
+  __m128 dx = _mm_set1_ps(dir[0]);
+  __m128 dy = _mm_set1_ps(dir[1]);
+  __m128 dz = _mm_set1_ps(dir[2]);
+  __m128 max_t = _mm_set1_ps(*closest);
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 epsilon = _mm_set1_ps(0.000001f);
+  __m128 minus_epsilon = _mm_set1_ps(-0.000001f);
+
+  _Alignas(16) float ts[COLLISION_PACKET_WIDTH];
+  int bits = 0;
+
+  // Two halves of 4 lanes
+  for (int l = 0; l < COLLISION_PACKET_WIDTH; l += 4) {
+    __m128 e1x = _mm_load_ps(&p->edge1[0][l]);
+    __m128 e1y = _mm_load_ps(&p->edge1[1][l]);
+    __m128 e1z = _mm_load_ps(&p->edge1[2][l]);
+    __m128 e2x = _mm_load_ps(&p->edge2[0][l]);
+    __m128 e2y = _mm_load_ps(&p->edge2[1][l]);
+    __m128 e2z = _mm_load_ps(&p->edge2[2][l]);
+
+    // pvec = dir x edge2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+    __m128 det = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+        _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(one, det);
+
+    // tvec = orig - a
+    __m128 tx = _mm_sub_ps(ox, _mm_load_ps(&p->a[0][l]));
+    __m128 ty = _mm_sub_ps(oy, _mm_load_ps(&p->a[1][l]));
+    __m128 tz = _mm_sub_ps(oz, _mm_load_ps(&p->a[2][l]));
+
+    __m128 u = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+                   _mm_mul_ps(tz, pz)),
+        inv_det);
+
+    // qvec = tvec x edge1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+    __m128 v = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                   _mm_mul_ps(dz, qz)),
+        inv_det);
+    __m128 t = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                   _mm_mul_ps(e2z, qz)),
+        inv_det);
+
+    __m128 mask = _mm_or_ps(_mm_cmple_ps(det, minus_epsilon),
+                            _mm_cmpge_ps(det, epsilon));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(u, one));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(t, max_t));
+
+    _mm_store_ps(&ts[l], t);
+    bits |= _mm_movemask_ps(mask) << l;
+  }
+
+  if (bits == 0) {
+    return -1;
+  }
+  return G_ClosestLane(ts, bits, closest);
+}
+
+__attribute__((target("avx2"))) static int
+G_TestPacketAVX2(collision_mesh_t *mesh, unsigned packet, vec3 orig, vec3 dir,
+                 float *closest) {
+  triangle_packet_t *p = &mesh->packets[packet];
+
+  __m256 dx = _mm256_set1_ps(dir[0]);
+  __m256 dy = _mm256_set1_ps(dir[1]);
+  __m256 dz = _mm256_set1_ps(dir[2]);
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 zero = _mm256_setzero_ps();
+
+  __m256 e1x = _mm256_load_ps(p->edge1[0]);
+  __m256 e1y = _mm256_load_ps(p->edge1[1]);
+  __m256 e1z = _mm256_load_ps(p->edge1[2]);
+  __m256 e2x = _mm256_load_ps(p->edge2[0]);
+  __m256 e2y = _mm256_load_ps(p->edge2[1]);
+  __m256 e2z = _mm256_load_ps(p->edge2[2]);
+
+  // pvec = dir x edge2. No FMA, to stay bit exact with the scalar path
+  __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+  __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+  __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+
+  __m256 det = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+      _mm256_mul_ps(e1z, pz));
+  __m256 inv_det = _mm256_div_ps(one, det);
+
+  // tvec = orig - a
+  __m256 tx = _mm256_sub_ps(_mm256_set1_ps(orig[0]), _mm256_load_ps(p->a[0]));
+  __m256 ty = _mm256_sub_ps(_mm256_set1_ps(orig[1]), _mm256_load_ps(p->a[1]));
+  __m256 tz = _mm256_sub_ps(_mm256_set1_ps(orig[2]), _mm256_load_ps(p->a[2]));
+
+  __m256 u = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+                    _mm256_mul_ps(tz, pz)),
+      inv_det);
+
+  // qvec = tvec x edge1
+  __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+  __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+  __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+  __m256 v = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                    _mm256_mul_ps(dz, qz)),
+      inv_det);
+  __m256 t = _mm256_mul_ps(
+      _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+          _mm256_mul_ps(e2z, qz)),
+      inv_det);
+
+  __m256 mask =
+      _mm256_or_ps(_mm256_cmp_ps(det, _mm256_set1_ps(-0.000001f), _CMP_LE_OQ),
+                   _mm256_cmp_ps(det, _mm256_set1_ps(0.000001f), _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask,
+                       _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(
+      mask, _mm256_cmp_ps(t, _mm256_set1_ps(*closest), _CMP_LT_OQ));
+
+  int bits = _mm256_movemask_ps(mask);
+  if (bits == 0) {
+    return -1;
+  }
+
+  _Alignas(32) float ts[COLLISION_PACKET_WIDTH];
+  _mm256_store_ps(ts, t);
+  return G_ClosestLane(ts, bits, closest);
+}
+#endif
+
+static collision_kernel_t collision_kernel = COLLISION_KERNEL_COUNT;
+
+static bool G_SupportsCollisionKernel(collision_kernel_t kernel) {
+  switch (kernel) {
+  case COLLISION_KERNEL_SCALAR:
+    return true;
+#ifdef COLLISION_X86
+  case COLLISION_KERNEL_SSE:
+    return __builtin_cpu_supports("sse2");
+  case COLLISION_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+collision_kernel_t G_GetCollisionKernel() {
+  if (collision_kernel == COLLISION_KERNEL_COUNT) {
+    collision_kernel = COLLISION_KERNEL_SCALAR;
+    for (int k = COLLISION_KERNEL_COUNT - 1; k >= 0; k--) {
+      if (G_SupportsCollisionKernel(k)) {
+        collision_kernel = k;
+        break;
+      }
+    }
+  }
+  return collision_kernel;
+}
+
+bool G_SetCollisionKernel(collision_kernel_t kernel) {
+  if (!G_SupportsCollisionKernel(kernel)) {
+    printf("Collision kernel %d isn't supported by this CPU.\n", kernel);
+    return false;
+  }
+  collision_kernel = kernel;
+  return true;
+}
+
+static packet_test_t G_PacketTest() {
+  switch (G_GetCollisionKernel()) {
+#ifdef COLLISION_X86
+  case COLLISION_KERNEL_SSE:
+    return G_TestPacketSSE;
+  case COLLISION_KERNEL_AVX2:
+    return G_TestPacketAVX2;
+#endif
+  default:
+    return G_TestPacketScalar;
+  }
+}
+
+/// @brief Project the horizontal movement `dir` along a wall of normal `n`.
+static void G_SlideDirection(vec3 n, vec3 dir) {
+  vec3 new_n = {-n[2], 0.0, n[0]};
+  float d = glm_vec3_dot(new_n, dir);
+  dir[0] = new_n[0] * d;
+  dir[1] = 0.0;
+  dir[2] = new_n[2] * d;
+}
+
+bool G_CollisionRayQueryBruteForce(collision_mesh_t *mesh, vec3 orig,
+                                   vec3 dir, float distance, bool movement,
+                                   float *corr) {
+  // Only the nearest hit is kept, and the ray shrinks to it, so farther
+  // triangles are rejected before computing their distance
+  float closest = distance;
+  triangle_t *closest_triangle = NULL;
   for (unsigned t = 0; t < mesh->triangle_count; t++) {
     triangle_t *triangle = &mesh->triangles[t];
     vec3 tuv;
 
-    if (G_TestTriangle(triangle, orig, dir, distance, tuv)) {
-      intersections[intersection_count].n[0] = triangle->n[0];
-      intersections[intersection_count].n[1] = triangle->n[1];
-      intersections[intersection_count].n[2] = triangle->n[2];
-      intersections[intersection_count].t = tuv[0];
-      intersection_count++;
+    if (G_TestTriangle(triangle, orig, dir, closest, tuv)) {
+      closest = tuv[0];
+      closest_triangle = triangle;
     }
   }
 
-  if (intersection_count == 0) {
+  if (!closest_triangle) {
     return false;
   }
 
-  // Find closest intersection;
-  unsigned idx = 0;
-  float min_dis = 100.0;
-  for (unsigned i = 0; i < intersection_count; i++) {
-    if (min_dis > intersections[i].t) {
-      idx = i;
-      min_dis = intersections[i].t;
+  if (corr != NULL) {
+    *corr = closest;
+  }
+
+  if (movement) {
+    G_SlideDirection(closest_triangle->n, dir);
+  }
+
+  return true;
+}
+
+/// @brief Slab test of the box of `node`, grown by `radius` on every side.
+static bool G_IntersectSweptBox(bvh_node_t *node, vec3 orig, vec3 inv_dir,
+                                float distance, float radius, float *t_near) {
+  // fminf/fmaxf drop the NaNs coming from 0 * inf, when the ray is parallel
+  // to a slab and starts on it
+  float t_min = 0.0f;
+  float t_max = distance;
+  for (int axis = 0; axis < 3; axis++) {
+    float t1 = (node->min[axis] - radius - orig[axis]) * inv_dir[axis];
+    float t2 = (node->max[axis] + radius - orig[axis]) * inv_dir[axis];
+    t_min = fmaxf(t_min, fminf(t1, t2));
+    t_max = fminf(t_max, fmaxf(t1, t2));
+  }
+
+  *t_near = t_min;
+  return t_min <= t_max;
+}
+
+static bool G_IntersectBox(bvh_node_t *node, vec3 orig, vec3 inv_dir,
+                           float distance, float *t_near) {
+  return G_IntersectSweptBox(node, orig, inv_dir, distance, 0.0f, t_near);
+}
+
+bool G_CollisionRayQuery(collision_mesh_t *mesh, vec3 orig, vec3 dir,
+                         float distance, bool movement, float *corr) {
+  if (mesh->triangle_count == 0) {
+    return false;
+  }
+
+  vec3 inv_dir = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  // Every triangle test shrinks the ray to the closest hit so far, culling
+  // the farther nodes
+  float closest = distance;
+  triangle_t *closest_triangle = NULL;
+
+  packet_test_t test_packet = G_PacketTest();
+
+  unsigned stack[BVH_MAX_DEPTH + 2];
+  unsigned stack_size = 0;
+  stack[stack_size++] = 0;
+
+  float t_near;
+  if (!G_IntersectBox(&mesh->nodes[0], orig, inv_dir, closest, &t_near)) {
+    return false;
+  }
+
+  while (stack_size != 0) {
+    bvh_node_t *node = &mesh->nodes[stack[--stack_size]];
+
+    if (node->count != 0) {
+      unsigned first = node->first / COLLISION_PACKET_WIDTH;
+      unsigned last = first + (unsigned)G_PacketCount(node->count);
+      for (unsigned p = first; p < last; p++) {
+        int lane = test_packet(mesh, p, orig, dir, &closest);
+        if (lane >= 0) {
+          closest_triangle =
+              &mesh->triangles[p * COLLISION_PACKET_WIDTH + lane];
+        }
+      }
+      continue;
     }
+
+    unsigned left = node->first;
+    unsigned right = node->first + 1;
+    float t_left, t_right;
+    bool hit_left =
+        G_IntersectBox(&mesh->nodes[left], orig, inv_dir, closest, &t_left);
+    bool hit_right =
+        G_IntersectBox(&mesh->nodes[right], orig, inv_dir, closest, &t_right);
+
+    // Push the farthest first, so the nearest is visited first
+    if (hit_left && hit_right) {
+      if (t_left < t_right) {
+        stack[stack_size++] = right;
+        stack[stack_size++] = left;
+      } else {
+        stack[stack_size++] = left;
+        stack[stack_size++] = right;
+      }
+    } else if (hit_left) {
+      stack[stack_size++] = left;
+    } else if (hit_right) {
+      stack[stack_size++] = right;
+    }
+  }
+
+  if (!closest_triangle) {
+    return false;
   }
 
-  float t = intersections[idx].t;
   if (corr != NULL) {
-    *corr = t;
+    *corr = closest;
   }
 
   if (movement) {
-    vec3 new_n = {-intersections[idx].n[2], 0.0, intersections[idx].n[0]};
-    float d = glm_vec3_dot(new_n, dir);
-    dir[0] = new_n[0] * d;
-    dir[1] = 0.0;
-    dir[2] = new_n[2] * d;
+    G_SlideDirection(closest_triangle->n, dir);
+  }
+
+  return true;
+}
+
+static void G_CastRayChunk(void *data, unsigned index) {
+  ray_batch_t *batch = data;
+  collision_mesh_t *mesh = batch->mesh;
+  unsigned chunk = index * COLLISION_BATCH_SIZE;
+  collision_ray_t *chunk_rays = &batch->rays[chunk];
+  collision_hit_t *chunk_hits = &batch->hits[chunk];
+  unsigned chunk_size = batch->ray_count - chunk < COLLISION_BATCH_SIZE
+                            ? batch->ray_count - chunk
+                            : COLLISION_BATCH_SIZE;
+  packet_test_t test_packet = G_PacketTest();
+
+  // The rays of the chunk go through the BVH all together. Each stack entry
+  // carries the rays that reached the node, filtered from its parent's.
+  batch_entry_t stack[BVH_MAX_DEPTH + 2];
+  unsigned char active[COLLISION_BATCH_SIZE * 2 * (BVH_MAX_DEPTH + 2)];
+  vec3 inv_dirs[COLLISION_BATCH_SIZE];
+  triangle_t *closest_triangles[COLLISION_BATCH_SIZE];
+
+  unsigned active_size = 0;
+  for (unsigned r = 0; r < chunk_size; r++) {
+    for (int axis = 0; axis < 3; axis++) {
+      inv_dirs[r][axis] = 1.0f / chunk_rays[r].dir[axis];
+    }
+    closest_triangles[r] = NULL;
+
+    float t_near;
+    if (G_IntersectBox(&mesh->nodes[0], chunk_rays[r].orig, inv_dirs[r],
+                       chunk_hits[r].t, &t_near)) {
+      active[active_size++] = r;
+    }
+  }
+
+  unsigned stack_size = 0;
+  if (active_size != 0) {
+    stack[stack_size++] = (batch_entry_t){0, 0, active_size};
+  }
+
+  while (stack_size != 0) {
+    batch_entry_t entry = stack[--stack_size];
+    bvh_node_t *node = &mesh->nodes[entry.node];
+    unsigned char *entry_rays = &active[entry.first];
+
+    if (node->count != 0) {
+      // The packets stay in cache while all the rays go through them
+      unsigned first = node->first / COLLISION_PACKET_WIDTH;
+      unsigned last = first + (unsigned)G_PacketCount(node->count);
+      for (unsigned p = first; p < last; p++) {
+        for (unsigned i = 0; i < entry.count; i++) {
+          unsigned r = entry_rays[i];
+          int lane = test_packet(mesh, p, chunk_rays[r].orig, chunk_rays[r].dir,
+                                 &chunk_hits[r].t);
+          if (lane >= 0) {
+            closest_triangles[r] =
+                &mesh->triangles[p * COLLISION_PACKET_WIDTH + lane];
+          }
+        }
+      }
+
+      // Entries are popped in reverse order, reclaim the space
+      active_size = entry.first;
+      continue;
+    }
+
+    // Split the rays between the two children, right after the current entry.
+    // The entry itself is consumed, so it can be overwritten by the left list.
+    unsigned children[2] = {node->first, node->first + 1};
+    unsigned char lists[2][COLLISION_BATCH_SIZE];
+    unsigned counts[2] = {0, 0};
+    float nearest[2] = {FLT_MAX, FLT_MAX};
+
+    for (unsigned i = 0; i < entry.count; i++) {
+      unsigned r = entry_rays[i];
+      for (int c = 0; c < 2; c++) {
+        float t_near;
+        if (G_IntersectBox(&mesh->nodes[children[c]], chunk_rays[r].orig,
+                           inv_dirs[r], chunk_hits[r].t, &t_near)) {
+          lists[c][counts[c]++] = r;
+          nearest[c] = fminf(nearest[c], t_near);
+        }
+      }
+    }
+
+    // Push the farthest first, so the nearest is visited first
+    int order[2] = {1, 0};
+    if (nearest[1] < nearest[0]) {
+      order[0] = 0;
+      order[1] = 1;
+    }
+
+    active_size = entry.first;
+    for (int o = 0; o < 2; o++) {
+      int c = order[o];
+      if (counts[c] == 0) {
+        continue;
+      }
+      memcpy(&active[active_size], lists[c], counts[c]);
+      stack[stack_size++] =
+          (batch_entry_t){children[c], active_size, counts[c]};
+      active_size += counts[c];
+    }
+  }
+
+  for (unsigned r = 0; r < chunk_size; r++) {
+    triangle_t *triangle = closest_triangles[r];
+    if (!triangle) {
+      continue;
+    }
+
+    chunk_hits[r].hit = true;
+    glm_vec3_copy(triangle->n, chunk_hits[r].n);
+    if (chunk_rays[r].flags & COLLISION_RAY_MOVEMENT) {
+      G_SlideDirection(triangle->n, chunk_rays[r].dir);
+    }
+  }
+}
+
+void G_CollisionRayQueryBatch(collision_mesh_t *mesh, collision_ray_t *rays,
+                              collision_hit_t *hits, unsigned ray_count) {
+  for (unsigned r = 0; r < ray_count; r++) {
+    hits[r].hit = false;
+    hits[r].t = rays[r].distance;
+  }
+
+  if (mesh->triangle_count == 0) {
+    return;
+  }
+
+  // Chunks are independent, they're spread over the job threads
+  ray_batch_t batch = {mesh, rays, hits, ray_count};
+  unsigned chunk_count =
+      (ray_count + COLLISION_BATCH_SIZE - 1) / COLLISION_BATCH_SIZE;
+  G_ParallelFor(chunk_count, G_CastRayChunk, &batch);
+}
+
+bool G_CollisionRayOccluded(collision_mesh_t *mesh, vec3 orig, vec3 dir,
+                            float distance) {
+  if (mesh->triangle_count == 0) {
+    return false;
+  }
+
+  vec3 inv_dir = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+  packet_test_t test_packet = G_PacketTest();
+
+  unsigned stack[BVH_MAX_DEPTH + 2];
+  unsigned stack_size = 0;
+  stack[stack_size++] = 0;
+
+  // No ordering of the children, any hit will do
+  while (stack_size != 0) {
+    bvh_node_t *node = &mesh->nodes[stack[--stack_size]];
+
+    float t_near;
+    if (!G_IntersectBox(node, orig, inv_dir, distance, &t_near)) {
+      continue;
+    }
+
+    if (node->count != 0) {
+      unsigned first = node->first / COLLISION_PACKET_WIDTH;
+      unsigned last = first + (unsigned)G_PacketCount(node->count);
+      for (unsigned p = first; p < last; p++) {
+        float closest = distance;
+        if (test_packet(mesh, p, orig, dir, &closest) >= 0) {
+          return true;
+        }
+      }
+      continue;
+    }
+
+    stack[stack_size++] = node->first + 1;
+    stack[stack_size++] = node->first;
+  }
+
+  return false;
+}
+
+/// @brief Smallest root of `a t^2 + b t + c` in [0, max_t], `c <= 0` meaning
+/// the sphere already touches the feature.
+static bool G_LowestRoot(float a, float b, float c, float max_t, float *root) {
+  // Already touching, only a contact if moving toward the feature. Otherwise
+  // anything resting against a wall couldn't leave it.
+  if (c <= 0.0f) {
+    *root = 0.0f;
+    return b < 0.0f;
+  }
+
+  // Moving parallel to the feature, or not moving at all
+  if (a < 1e-12f) {
+    return false;
+  }
+
+  float discriminant = b * b - 4.0f * a * c;
+  if (discriminant < 0.0f) {
+    return false;
   }
-  
+
+  // Both roots have the same sign as c > 0, the lowest one tells if the
+  // feature is ahead
+  float t = (-b - sqrtf(discriminant)) / (2.0f * a);
+  if (t < 0.0f || t > max_t) {
+    return false;
+  }
+
+  *root = t;
   return true;
 }
 
+static bool G_PointInTriangle(triangle_t *triangle, vec3 p) {
+  vec3 ab, bc, ca, ap, bp, cp, c1, c2, c3;
+  glm_vec3_sub(triangle->b, triangle->a, ab);
+  glm_vec3_sub(triangle->c, triangle->b, bc);
+  glm_vec3_sub(triangle->a, triangle->c, ca);
+  glm_vec3_sub(p, triangle->a, ap);
+  glm_vec3_sub(p, triangle->b, bp);
+  glm_vec3_sub(p, triangle->c, cp);
+  glm_vec3_cross(ab, ap, c1);
+  glm_vec3_cross(bc, bp, c2);
+  glm_vec3_cross(ca, cp, c3);
+
+  return glm_vec3_dot(c1, triangle->n) >= 0.0f &&
+         glm_vec3_dot(c2, triangle->n) >= 0.0f &&
+         glm_vec3_dot(c3, triangle->n) >= 0.0f;
+}
+
+/// @brief Sweep a sphere against a triangle, first the face, then the edges
+/// and vertices. Triangles are double sided, like for the rays.
+/// @param t Time of impact, the search stops past its initial value.
+/// @param n Contact normal, pointing toward the sphere.
+static bool G_SweepSphereTriangle(triangle_t *triangle, vec3 center,
+                                  float radius, vec3 dir, float *t, vec3 n) {
+  // Degenerate triangles have no normal
+  if (glm_vec3_norm2(triangle->n) < 0.5f) {
+    return false;
+  }
+
+  vec3 plane_n;
+  vec3 to_center;
+  glm_vec3_copy(triangle->n, plane_n);
+  glm_vec3_sub(center, triangle->a, to_center);
+  float dist = glm_vec3_dot(plane_n, to_center);
+  if (dist < 0.0f) {
+    glm_vec3_negate(plane_n);
+    dist = -dist;
+  }
+
+  float max_t = *t;
+
+  // When the sphere meets the plane inside the triangle, it's the first
+  // contact. Otherwise, an edge or a vertex is hit first, if anything.
+  float speed = glm_vec3_dot(plane_n, dir);
+  float plane_t = 0.0f;
+  if (dist > radius) {
+    if (speed >= 0.0f) {
+      return false;
+    }
+    plane_t = (dist - radius) / -speed;
+    if (plane_t > max_t) {
+      return false;
+    }
+  }
+
+  // Moving into the plane, the face is touched at `plane_t` if the contact
+  // point is inside the triangle. Not moving into it, the face can't stop the
+  // sphere, which slides along it
+  if (speed < 0.0f) {
+    vec3 contact;
+    glm_vec3_copy(center, contact);
+    glm_vec3_muladds(dir, plane_t, contact);
+    glm_vec3_muladds(plane_n, -(dist > radius ? radius : dist), contact);
+    if (G_PointInTriangle(triangle, contact)) {
+      *t = plane_t;
+      glm_vec3_copy(plane_n, n);
+      return true;
+    }
+  }
+
+  // Edges and vertices are never reached before the plane, so their roots are
+  // clamped to it. Rounding could say otherwise, and as the plane rejects
+  // triangles early, the first contact would depend on the testing order
+  bool hit = false;
+  float closest = max_t;
+  vec3 closest_point = {0.0f, 0.0f, 0.0f};
+  float speed2 = glm_vec3_norm2(dir);
+
+  float *vertices[3] = {triangle->a, triangle->b, triangle->c};
+  for (int v = 0; v < 3; v++) {
+    vec3 base;
+    glm_vec3_sub(center, vertices[v], base);
+    float root;
+    if (G_LowestRoot(speed2, 2.0f * glm_vec3_dot(dir, base),
+                     glm_vec3_norm2(base) - radius * radius, closest,
+                     &root)) {
+      closest = fmaxf(root, plane_t);
+      glm_vec3_copy(vertices[v], closest_point);
+      hit = true;
+    }
+  }
+
+  for (int e = 0; e < 3; e++) {
+    float *p0 = vertices[e];
+    float *p1 = vertices[(e + 1) % 3];
+
+    // Distance from the center to the line of the edge, expanded
+    vec3 edge, base;
+    glm_vec3_sub(p1, p0, edge);
+    glm_vec3_sub(center, p0, base);
+    float edge2 = glm_vec3_norm2(edge);
+    float edge_dir = glm_vec3_dot(edge, dir);
+    float edge_base = glm_vec3_dot(edge, base);
+
+    float a = edge2 * speed2 - edge_dir * edge_dir;
+    float b = 2.0f * (edge2 * glm_vec3_dot(dir, base) - edge_dir * edge_base);
+    float c = edge2 * (glm_vec3_norm2(base) - radius * radius) -
+              edge_base * edge_base;
+
+    float root;
+    if (!G_LowestRoot(a, b, c, closest, &root)) {
+      continue;
+    }
+
+    // Only the segment counts, the vertices are handled above
+    float f = (edge_base + edge_dir * root) / edge2;
+    if (f < 0.0f || f > 1.0f) {
+      continue;
+    }
+
+    closest = fmaxf(root, plane_t);
+    glm_vec3_copy(p0, closest_point);
+    glm_vec3_muladds(edge, f, closest_point);
+    hit = true;
+  }
+
+  if (!hit) {
+    return false;
+  }
+
+  vec3 moved;
+  glm_vec3_copy(center, moved);
+  glm_vec3_muladds(dir, closest, moved);
+  glm_vec3_sub(moved, closest_point, n);
+  glm_vec3_normalize(n);
+  *t = closest;
+
+  return true;
+}
+
+bool G_CollisionSphereSweep(collision_mesh_t *mesh, vec3 center, float radius,
+                            vec3 dir, float distance, float *t, vec3 n) {
+  if (mesh->triangle_count == 0) {
+    return false;
+  }
+
+  vec3 inv_dir = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  // Same traversal as the rays, on the boxes grown by the radius
+  float closest = distance;
+  bool hit = false;
+
+  unsigned stack[BVH_MAX_DEPTH + 2];
+  unsigned stack_size = 0;
+  stack[stack_size++] = 0;
+
+  float t_near;
+  if (!G_IntersectSweptBox(&mesh->nodes[0], center, inv_dir, closest, radius,
+                           &t_near)) {
+    return false;
+  }
+
+  while (stack_size != 0) {
+    bvh_node_t *node = &mesh->nodes[stack[--stack_size]];
+
+    if (node->count != 0) {
+      // The padding is skipped, only the actual triangles of the leaf
+      for (unsigned i = node->first; i < node->first + node->count; i++) {
+        if (G_SweepSphereTriangle(&mesh->triangles[i], center, radius, dir,
+                                  &closest, n)) {
+          hit = true;
+        }
+      }
+      continue;
+    }
+
+    unsigned left = node->first;
+    unsigned right = node->first + 1;
+    float t_left, t_right;
+    bool hit_left = G_IntersectSweptBox(&mesh->nodes[left], center, inv_dir,
+                                        closest, radius, &t_left);
+    bool hit_right = G_IntersectSweptBox(&mesh->nodes[right], center, inv_dir,
+                                         closest, radius, &t_right);
+
+    if (hit_left && hit_right) {
+      if (t_left < t_right) {
+        stack[stack_size++] = right;
+        stack[stack_size++] = left;
+      } else {
+        stack[stack_size++] = left;
+        stack[stack_size++] = right;
+      }
+    } else if (hit_left) {
+      stack[stack_size++] = left;
+    } else if (hit_right) {
+      stack[stack_size++] = right;
+    }
+  }
+
+  if (hit && t != NULL) {
+    *t = closest;
+  }
+
+  return hit;
+}
+
+bool G_CollisionSphereSweepBruteForce(collision_mesh_t *mesh, vec3 center,
+                                      float radius, vec3 dir, float distance,
+                                      float *t, vec3 n) {
+  // The padding of the leaves is degenerate, and skipped by the triangle test
+  float closest = distance;
+  bool hit = false;
+  for (unsigned i = 0; i < mesh->triangle_count; i++) {
+    if (G_SweepSphereTriangle(&mesh->triangles[i], center, radius, dir,
+                              &closest, n)) {
+      hit = true;
+    }
+  }
+
+  if (hit && t != NULL) {
+    *t = closest;
+  }
+
+  return hit;
+}
+
+static void G_InitCacheHeader(collision_cache_header_t *header,
+                              uint64_t source_hash) {
+  memset(header, 0, sizeof(collision_cache_header_t));
+  memcpy(header->magic, "MCOL", 4);
+  header->version = COLLISION_CACHE_VERSION;
+  header->source_hash = source_hash;
+  header->triangle_size = sizeof(triangle_t);
+  header->packet_size = sizeof(triangle_packet_t);
+  header->node_size = sizeof(bvh_node_t);
+}
+
+typedef struct collision_cache_write_t {
+  collision_cache_header_t *header;
+  collision_mesh_t *mesh;
+} collision_cache_write_t;
+
+static bool G_WriteCollisionCache(FILE *f, void *data) {
+  collision_cache_write_t *write = data;
+  collision_cache_header_t *header = write->header;
+  collision_mesh_t *mesh = write->mesh;
+
+  return fwrite(header, sizeof(collision_cache_header_t), 1, f) == 1 &&
+         G_WriteFileSection(f, header->triangles_offset, mesh->triangles,
+                            sizeof(triangle_t) * mesh->triangle_count) &&
+         G_WriteFileSection(f, header->packets_offset, mesh->packets,
+                            sizeof(triangle_packet_t) * mesh->packet_count) &&
+         G_WriteFileSection(f, header->nodes_offset, mesh->nodes,
+                            sizeof(bvh_node_t) * mesh->node_count);
+}
+
+bool G_SaveCollisionCache(collision_mesh_t *mesh, const char *path,
+                          uint64_t source_hash) {
+  collision_cache_header_t header;
+  G_InitCacheHeader(&header, source_hash);
+  header.triangle_count = mesh->triangle_count;
+  header.packet_count = mesh->packet_count;
+  header.node_count = mesh->node_count;
+
+  header.triangles_offset = G_AlignFileOffset(sizeof(header));
+  header.packets_offset = G_AlignFileOffset(
+      header.triangles_offset + sizeof(triangle_t) * mesh->triangle_count);
+  header.nodes_offset = G_AlignFileOffset(
+      header.packets_offset + sizeof(triangle_packet_t) * mesh->packet_count);
+
+  collision_cache_write_t write = {.header = &header, .mesh = mesh};
+  return G_WriteFileAtomic(path, G_WriteCollisionCache, &write);
+}
+
+collision_mesh_t *G_LoadCollisionCache(const char *path,
+                                       uint64_t source_hash) {
+  mapped_file_t file;
+  if (!G_MapFile(path, &file)) {
+    return NULL;
+  }
+
+  collision_cache_header_t expected;
+  G_InitCacheHeader(&expected, source_hash);
+
+  collision_cache_header_t *header = file.data;
+  if (file.size < sizeof(collision_cache_header_t) ||
+      memcmp(header->magic, expected.magic, 4) != 0 ||
+      header->version != expected.version ||
+      header->triangle_size != expected.triangle_size ||
+      header->packet_size != expected.packet_size ||
+      header->node_size != expected.node_size) {
+    printf("Collision cache `%s` is from another version, ignoring it.\n",
+           path);
+    G_UnmapFile(&file);
+    return NULL;
+  }
+
+  if (header->source_hash != source_hash) {
+    printf("Collision cache `%s` is out of date, ignoring it.\n", path);
+    G_UnmapFile(&file);
+    return NULL;
+  }
+
+  uint64_t triangles_end =
+      header->triangles_offset +
+      (uint64_t)sizeof(triangle_t) * header->triangle_count;
+  uint64_t packets_end = header->packets_offset +
+                         (uint64_t)sizeof(triangle_packet_t) *
+                             header->packet_count;
+  uint64_t nodes_end =
+      header->nodes_offset + (uint64_t)sizeof(bvh_node_t) * header->node_count;
+  if (triangles_end > file.size || packets_end > file.size ||
+      nodes_end > file.size ||
+      header->packets_offset % FILE_SECTION_ALIGN != 0 ||
+      header->triangle_count !=
+          header->packet_count * COLLISION_PACKET_WIDTH ||
+      (header->triangle_count != 0 && header->node_count == 0)) {
+    printf("Collision cache `%s` is corrupted, ignoring it.\n", path);
+    G_UnmapFile(&file);
+    return NULL;
+  }
+
+  char *base = file.data;
+  collision_mesh_t *mesh = calloc(1, sizeof(collision_mesh_t));
+  mesh->triangles = (triangle_t *)(base + header->triangles_offset);
+  mesh->triangle_count = header->triangle_count;
+  mesh->packets = (triangle_packet_t *)(base + header->packets_offset);
+  mesh->packet_count = header->packet_count;
+  mesh->nodes = (bvh_node_t *)(base + header->nodes_offset);
+  mesh->node_count = header->node_count;
+  mesh->file = file;
+
+  return mesh;
+}
+
 void G_DestroyCollisionMap(collision_mesh_t *mesh) {
-  free(mesh->triangles);
+  if (mesh->file.data) {
+    G_UnmapFile(&mesh->file);
+  } else {
+    free(mesh->triangles);
+    free(mesh->packets);
+    free(mesh->nodes);
+  }
   free(mesh);
 }
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cglm/types.h"
+#include "vk/vk.h"
+
+typedef struct collision_mesh_t collision_mesh_t;
+
+/// @brief Implementations of the ray/triangle test. The best one supported by
+/// the CPU is picked at runtime.
+typedef enum collision_kernel_t {
+  COLLISION_KERNEL_SCALAR,
+  COLLISION_KERNEL_SSE,
+  COLLISION_KERNEL_AVX2,
+  COLLISION_KERNEL_COUNT,
+} collision_kernel_t;
+
+/// @brief Kernel currently used by the ray queries.
+collision_kernel_t G_GetCollisionKernel();
+
+/// @brief Force the kernel used by the ray queries.
+/// @return false if the CPU doesn't support it, in which case nothing changes.
+bool G_SetCollisionKernel(collision_kernel_t kernel);
+
+/// @brief Build a collision mesh from the triangles of the given primitives,
+/// alongside the bounding volume hierarchy used to accelerate queries.
+/// @param primitives Primitives to extract triangles from. They are only read.
+/// @param primitive_count Number of primitives.
+/// @return
+collision_mesh_t *G_LoadCollisionMap(primitive_t *primitives,
+                                     size_t primitive_count);
+
+void G_DestroyCollisionMap(collision_mesh_t *mesh);
+
+/// @brief Write the triangles and the BVH of a collision mesh to a file, to
+/// be loaded back by `G_LoadCollisionCache` without building anything.
+/// @param path Path of the cache, usually the one of the map + `.col`.
+/// @param source_hash Hash of the asset the mesh was built from.
+/// @return
+bool G_SaveCollisionCache(collision_mesh_t *mesh, const char *path,
+                          uint64_t source_hash);
+
+/// @brief Memory-map a collision mesh written by `G_SaveCollisionCache`.
+/// @param path Path of the cache.
+/// @param source_hash Hash of the asset the mesh is expected to come from.
+/// @return NULL if the cache doesn't exist, or is outdated or invalid.
+collision_mesh_t *G_LoadCollisionCache(const char *path, uint64_t source_hash);
+
+/// @brief Cast a ray against the collision mesh, and report the closest hit.
+/// @param orig Origin of the ray.
+/// @param dir Normalized direction of the ray. Overwritten with the sliding
+/// direction along the hit surface when `movement` is set.
+/// @param distance Maximum distance of the ray.
+/// @param movement Project `dir` on the hit surface.
+/// @param t Distance to the closest hit. Can be NULL.
+/// @return Whether something was hit.
+bool G_CollisionRayQuery(collision_mesh_t *mesh, vec3 orig, vec3 dir,
+                         float distance, bool movement, float *t);
+
+/// @brief Whether anything lies on the ray, for callers that don't care
+/// where. Stops at the first hit found, instead of looking for the closest.
+/// @param orig Origin of the ray.
+/// @param dir Normalized direction of the ray.
+/// @param distance Maximum distance of the ray.
+bool G_CollisionRayOccluded(collision_mesh_t *mesh, vec3 orig, vec3 dir,
+                            float distance);
+
+typedef enum collision_ray_flags_t {
+  /// Project `dir` on the hit surface, see `G_CollisionRayQuery`.
+  COLLISION_RAY_MOVEMENT = 1 << 0,
+} collision_ray_flags_t;
+
+typedef struct collision_ray_t {
+  vec3 orig;
+  vec3 dir;
+  float distance;
+  unsigned flags;
+} collision_ray_t;
+
+typedef struct collision_hit_t {
+  bool hit;
+  /// Distance to the closest hit. `distance` of the ray if nothing was hit.
+  float t;
+  /// Normal of the hit triangle.
+  vec3 n;
+} collision_hit_t;
+
+/// @brief Cast many rays against the collision mesh, in a single traversal.
+/// Same results as calling `G_CollisionRayQuery` on each ray, but nodes and
+/// triangles are only fetched once for all the rays reaching them. Chunks of
+/// 64 rays are spread over the `G_ParallelFor` threads.
+/// @param rays Rays to cast. `dir` is overwritten when the ray has the
+/// `COLLISION_RAY_MOVEMENT` flag and hits something.
+/// @param hits One hit per ray.
+/// @param ray_count Number of rays.
+void G_CollisionRayQueryBatch(collision_mesh_t *mesh, collision_ray_t *rays,
+                              collision_hit_t *hits, unsigned ray_count);
+
+/// @brief Sweep a sphere against the collision mesh, and report the first
+/// contact. Unlike a ray, it can't slip through thin geometry or gaps smaller
+/// than the sphere.
+/// @param center Center of the sphere at the start of the sweep.
+/// @param radius Radius of the sphere.
+/// @param dir Normalized direction of the sweep.
+/// @param distance Maximum distance travelled by the center.
+/// @param t Time of impact, as a distance travelled by the center. Can be
+/// NULL. 0 if the sphere already touches something.
+/// @param n Contact normal, pointing toward the sphere. Only written on hit.
+/// @return Whether something was hit.
+bool G_CollisionSphereSweep(collision_mesh_t *mesh, vec3 center, float radius,
+                            vec3 dir, float distance, float *t, vec3 n);
+
+/// @brief Same as `G_CollisionSphereSweep`, but testing every single
+/// triangle. Reference path for validating the BVH traversal.
+bool G_CollisionSphereSweepBruteForce(collision_mesh_t *mesh, vec3 center,
+                                      float radius, vec3 dir, float distance,
+                                      float *t, vec3 n);
+
+/// @brief Same as `G_CollisionRayQuery`, but testing every single triangle.
+/// Reference path for validating and benchmarking the BVH.
+bool G_CollisionRayQueryBruteForce(collision_mesh_t *mesh, vec3 orig,
+                                   vec3 dir, float distance, bool movement,
+                                   float *t);
@@ -0,0 +1,143 @@
+#include "g_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define FILE_NO_MMAP
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool G_MapFile(const char *path, mapped_file_t *file) {
+  file->data = NULL;
+  file->size = 0;
+
+#ifdef FILE_NO_MMAP
+  // Just read it
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  // Sections are read in place with aligned loads, like from a mapping
+  void *data = size > 0 ? _aligned_malloc(size, FILE_SECTION_ALIGN) : NULL;
+  if (!data || fread(data, size, 1, f) != 1) {
+    _aligned_free(data);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  file->data = data;
+  file->size = (size_t)size;
+  return true;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid once the file is closed
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  file->data = data;
+  file->size = (size_t)st.st_size;
+  return true;
+#endif
+}
+
+void G_UnmapFile(mapped_file_t *file) {
+  if (!file->data) {
+    return;
+  }
+
+#ifdef FILE_NO_MMAP
+  _aligned_free(file->data);
+#else
+  munmap(file->data, file->size);
+#endif
+
+  file->data = NULL;
+  file->size = 0;
+}
+
+uint64_t G_AlignFileOffset(uint64_t offset) {
+  uint64_t mask = FILE_SECTION_ALIGN - 1;
+  return (offset + mask) & ~mask;
+}
+
+bool G_WriteFileSection(FILE *f, uint64_t offset, const void *data,
+                        size_t size) {
+  static const char zeros[FILE_SECTION_ALIGN] = {0};
+  long position = ftell(f);
+  if (position < 0 || (uint64_t)position > offset) {
+    return false;
+  }
+
+  for (uint64_t pad = offset - (uint64_t)position; pad > 0;) {
+    size_t chunk = pad < FILE_SECTION_ALIGN ? (size_t)pad : FILE_SECTION_ALIGN;
+    if (fwrite(zeros, 1, chunk, f) != chunk) {
+      return false;
+    }
+    pad -= chunk;
+  }
+
+  return size == 0 || fwrite(data, size, 1, f) == 1;
+}
+
+bool G_WriteFileAtomic(const char *path, file_writer_t writer, void *data) {
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp_path = malloc(tmp_len);
+  snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) {
+    printf("Couldn't write `%s`.\n", tmp_path);
+    free(tmp_path);
+    return false;
+  }
+
+  bool written = writer(f, data);
+  written = fclose(f) == 0 && written;
+
+  if (!written || rename(tmp_path, path) != 0) {
+    printf("Couldn't write `%s`.\n", path);
+    remove(tmp_path);
+    free(tmp_path);
+    return false;
+  }
+
+  free(tmp_path);
+  return true;
+}
+
+uint64_t G_HashBytes(const void *data, size_t size, uint64_t seed) {
+  const unsigned char *bytes = data;
+  uint64_t hash = seed;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
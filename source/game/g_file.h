@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/// @brief Read-only view on a whole file, memory-mapped when the platform
+/// allows it.
+typedef struct mapped_file_t {
+  void *data;
+  size_t size;
+} mapped_file_t;
+
+/// @brief Map a whole file in memory, read-only.
+/// @param path Path of the file.
+/// @param file Filled with the mapping.
+/// @return false if the file can't be opened or mapped, which isn't reported.
+bool G_MapFile(const char *path, mapped_file_t *file);
+
+void G_UnmapFile(mapped_file_t *file);
+
+// Sections of cooked files start on that boundary, so they can be used in
+// place once mapped, SIMD loads included
+#define FILE_SECTION_ALIGN 64
+
+/// @brief Round an offset up to the next FILE_SECTION_ALIGN boundary.
+uint64_t G_AlignFileOffset(uint64_t offset);
+
+/// @brief Pad the file with zeros up to `offset`, and write a section there.
+/// @param offset Start of the section, at or after the current position.
+/// @return
+bool G_WriteFileSection(FILE *f, uint64_t offset, const void *data,
+                        size_t size);
+
+typedef bool (*file_writer_t)(FILE *f, void *data);
+
+/// @brief Write a file aside, then move it in place. A crash or a failed write
+/// never leaves a truncated file behind.
+/// @param writer Writes the content of the file, returns false on failure.
+/// @param data Passed to `writer`.
+/// @return
+bool G_WriteFileAtomic(const char *path, file_writer_t writer, void *data);
+
+#define HASH_SEED 0xcbf29ce484222325ull
+
+/// @brief 64 bits FNV-1a hash. Can be chained, by passing the previous hash
+/// as the seed.
+uint64_t G_HashBytes(const void *data, size_t size, uint64_t seed);
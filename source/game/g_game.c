@@ -1,11 +1,17 @@
 #include "g_game.h"
-
-typedef struct collision_mesh_t collision_mesh_t;
-
+#include "g_collision.h"
+#include "g_file.h"
+#include "g_jobs.h"
+#include "g_mesh.h"
+#include "g_spatial.h"
+
+#include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "cglm/affine.h"
 #include "cglm/cglm.h"
@@ -17,11 +23,34 @@ typedef struct collision_mesh_t collision_mesh_t;
 #include "client/cl_input.h"
 #include "vk/vk.h"
 
+// Player collision body, a sphere around the feet
+#define PLAYER_RADIUS 0.3f
+#define PLAYER_SKIN 0.01f
+#define PLAYER_SLIDE_ITERATIONS 3
+// Actors the body can be pushed out of in a single tick
+#define PLAYER_MAX_CONTACTS 16
+
+// Actors don't know the bounds of their model yet, they are assumed to be
+// about a unit wide before scaling
+#define ACTOR_RADIUS 0.5f
+#define ACTOR_GRID_CELL_SIZE 2.0f
+// Actors stand on their origin. The ground is searched from a step above it,
+// they fall as fast as the player when there's none
+#define ACTOR_STEP_HEIGHT 0.3f
+#define ACTOR_FALL_SPEED 0.12f
+
 typedef struct scene_t {
   toml_table_t *def;
   bool loaded;
 } scene_t;
 
+typedef struct texture_entry_t {
+  uint64_t hash;
+  size_t size;
+} texture_entry_t;
+
+typedef struct scene_loader_t scene_loader_t;
+
 struct game_t {
   char *base;
 
@@ -31,22 +60,27 @@ struct game_t {
 
   scene_t *current_scene;
   collision_mesh_t *current_mesh;
+  // Set while the current scene is loading
+  scene_loader_t *loader;
 
   struct {
     vec4 position;
     vec4 rotation;
     vec4 scale;
+    unsigned model_id;
 
     bool dirty;
-  } actors[64];
+  } actors[GAME_MAX_ACTORS];
   unsigned actor_count;
-};
 
-collision_mesh_t *G_LoadCollisionMap(primitive_t *primitives,
-                                     unsigned primitive_count);
-void G_DestroyCollisionMap(collision_mesh_t *mesh);
-bool G_CollisionRayQuery(collision_mesh_t *mesh, vec3 orig, vec3 dir,
-                         float distance, bool movement, float *t);
+  // Broadphase of the actors, updated from their `dirty` flag
+  spatial_grid_t *actor_grid;
+
+  // Every texture uploaded so far, by content. The position of a texture is
+  // its bindless index, as the renderer appends them in the same order
+  texture_entry_t *textures;
+  unsigned texture_count;
+};
 
 char *G_GetCompletePath(char *base, char *path) {
   unsigned len = strlen(base) + strlen(path) + 2;
@@ -91,6 +125,9 @@ game_t *G_CreateGame(char *base) {
   game->current_scene->def = main_scene;
   game->current_scene->loaded = false;
 
+  game->actor_grid = G_CreateSpatialGrid(
+      ACTOR_GRID_CELL_SIZE, sizeof(game->actors) / sizeof(game->actors[0]));
+
   game->fps_pos[0] = 7.5f;
   game->fps_pos[1] = 10.505f;
   game->fps_pos[2] = -7.5f;
@@ -101,8 +138,164 @@ game_t *G_CreateGame(char *base) {
   return game;
 }
 
-bool G_LoadGLTF(game_t *game, primitive_t **p, unsigned *p_c, texture_t **t,
-                unsigned *t_c, char *map_path) {
+/// @brief Everything `G_LoadGLTF` loads from a glTF file, in parallel. The
+/// first job gets the geometry, the next ones decode a texture each.
+typedef struct gltf_load_t {
+  cgltf_data *data;
+  // Textures seen for the first time, decoded into `textures`
+  cgltf_texture **new_textures;
+  texture_t *textures;
+
+  const char *cooked_path;
+  uint64_t hash;
+  mesh_t *mesh;
+  bool cooked;
+  bool loaded;
+} gltf_load_t;
+
+static float G_SRGBToLinear(float c) {
+  return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float G_LinearToSRGB(float c) {
+  return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+/// @brief Append the mip chain of a decoded RGBA texture after its first
+/// level. Each texel is the average of 2x2 texels of the previous level,
+/// blended in linear space as textures are sampled as sRGB.
+static void G_GenerateMipmaps(texture_t *texture) {
+  unsigned width = (unsigned)texture->width;
+  unsigned height = (unsigned)texture->height;
+
+  size_t size = 0;
+  texture->mip_count = 0;
+  unsigned w = width, h = height;
+  for (;;) {
+    size += (size_t)w * h * 4;
+    texture->mip_count++;
+    if (w == 1 && h == 1) {
+      break;
+    }
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+  }
+  texture->data = realloc(texture->data, size);
+
+  float to_linear[256];
+  for (unsigned i = 0; i < 256; i++) {
+    to_linear[i] = G_SRGBToLinear((float)i / 255.0f);
+  }
+
+  unsigned char *src = texture->data;
+  unsigned src_w = width, src_h = height;
+  for (unsigned level = 1; level < texture->mip_count; level++) {
+    unsigned char *dst = src + (size_t)src_w * src_h * 4;
+    unsigned dst_w = src_w > 1 ? src_w / 2 : 1;
+    unsigned dst_h = src_h > 1 ? src_h / 2 : 1;
+
+    for (unsigned y = 0; y < dst_h; y++) {
+      // Odd sizes drop their last row or column, clamped for 1 texel sides
+      unsigned y0 = y * 2;
+      unsigned y1 = y0 + 1 < src_h ? y0 + 1 : y0;
+      for (unsigned x = 0; x < dst_w; x++) {
+        unsigned x0 = x * 2;
+        unsigned x1 = x0 + 1 < src_w ? x0 + 1 : x0;
+        unsigned char *texels[4] = {
+            &src[((size_t)y0 * src_w + x0) * 4],
+            &src[((size_t)y0 * src_w + x1) * 4],
+            &src[((size_t)y1 * src_w + x0) * 4],
+            &src[((size_t)y1 * src_w + x1) * 4],
+        };
+
+        unsigned char *texel = &dst[((size_t)y * dst_w + x) * 4];
+        for (unsigned c = 0; c < 3; c++) {
+          float linear = (to_linear[texels[0][c]] + to_linear[texels[1][c]] +
+                          to_linear[texels[2][c]] + to_linear[texels[3][c]]) *
+                         0.25f;
+          texel[c] = (unsigned char)(G_LinearToSRGB(linear) * 255.0f + 0.5f);
+        }
+        texel[3] = (unsigned char)((texels[0][3] + texels[1][3] +
+                                    texels[2][3] + texels[3][3] + 2) /
+                                   4);
+      }
+    }
+
+    src = dst;
+    src_w = dst_w;
+    src_h = dst_h;
+  }
+}
+
+static void G_LoadGLTFJob(void *data, unsigned index) {
+  gltf_load_t *load = data;
+
+  if (index == 0) {
+    load->cooked = G_LoadCookedMesh(load->cooked_path, load->hash, load->mesh);
+    // Left as they are in the glTF, but cut in meshlets for culling
+    load->loaded = load->cooked || (G_ExtractGLTFMesh(load->data, load->mesh) &&
+                                    G_BuildMeshlets(load->mesh));
+    return;
+  }
+
+  // Extracting base color texture
+  cgltf_texture *gltf_texture = load->new_textures[index - 1];
+  texture_t *texture = &load->textures[index - 1];
+
+  const uint8_t *texture_data = cgltf_buffer_view_data(
+      (const cgltf_buffer_view *)gltf_texture->image->buffer_view);
+
+  int w, h, n;
+  unsigned char *pixels = stbi_load_from_memory(
+      texture_data, gltf_texture->image->buffer_view->size, &w, &h, &n, 4);
+
+  texture->width = w;
+  texture->height = h;
+  texture->c = n;
+  texture->data = pixels;
+  texture->mip_count = 1;
+
+  // Distant surfaces sample small levels instead of the whole texture
+  if (pixels) {
+    G_GenerateMipmaps(texture);
+  }
+  if (gltf_texture->name && strlen(gltf_texture->name) != 0) {
+    texture->label =
+        memcpy(malloc(strlen(gltf_texture->name) + 1), gltf_texture->name,
+               strlen(gltf_texture->name) + 1);
+  } else {
+    texture->label = NULL;
+  }
+}
+
+/// @brief Bindless index of a texture, going by the content of its image.
+/// Unknown textures are added to the cache, and get the next index.
+/// @param added Set when the texture wasn't in the cache.
+static unsigned G_CacheTexture(game_t *game, cgltf_texture *texture,
+                               bool *added) {
+  cgltf_buffer_view *view = texture->image->buffer_view;
+  uint64_t hash =
+      G_HashBytes(cgltf_buffer_view_data(view), view->size, HASH_SEED);
+
+  for (unsigned t = 0; t < game->texture_count; t++) {
+    if (game->textures[t].hash == hash &&
+        game->textures[t].size == view->size) {
+      *added = false;
+      return t;
+    }
+  }
+
+  game->textures = realloc(game->textures, sizeof(texture_entry_t) *
+                                               (game->texture_count + 1));
+  game->textures[game->texture_count].hash = hash;
+  game->textures[game->texture_count].size = view->size;
+
+  *added = true;
+  return game->texture_count++;
+}
+
+bool G_LoadGLTF(game_t *game, mesh_t *mesh, texture_t **t, unsigned *t_c,
+                char *map_path, uint64_t *hash) {
   char *complete_map_path = G_GetCompletePath(game->base, map_path);
 
   FILE *f = fopen(complete_map_path, "rb");
@@ -120,6 +313,11 @@ bool G_LoadGLTF(game_t *game, primitive_t **p, unsigned *p_c, texture_t **t,
   fread(buff, size, 1, f);
   fclose(f);
 
+  uint64_t file_hash = G_HashBytes(buff, size, HASH_SEED);
+  if (hash) {
+    *hash = file_hash;
+  }
+
   cgltf_options options = {0};
   cgltf_data *data = NULL;
   cgltf_result result = cgltf_parse(&options, buff, size, &data);
@@ -199,158 +397,102 @@ bool G_LoadGLTF(game_t *game, primitive_t **p, unsigned *p_c, texture_t **t,
 
   // Here we load, so we don't return.
 
-  primitive_t *primitives = malloc(sizeof(primitive_t) * primitive_count);
-  texture_t *textures =
-      malloc(sizeof(texture_t) * primitive_count *
-             3); // Assuming each texture has a albedo+normal+rougness textures
+  // Primitives sharing a texture point to the same image, and models sharing
+  // one have images with the same content. Either way, it's only decoded and
+  // uploaded once
+  unsigned first_texture = game->texture_count;
+  unsigned *texture_ids = malloc(sizeof(unsigned) * primitive_count);
+  cgltf_image **images = malloc(sizeof(cgltf_image *) * primitive_count);
+  cgltf_texture **new_textures =
+      malloc(sizeof(cgltf_texture *) * primitive_count);
+  size_t new_texture_count = 0;
 
   size_t curr_primitive = 0;
-  size_t curr_texture = 0;
   for (cgltf_size m = 0; m < data->meshes_count; m++) {
-    cgltf_mesh *mesh = &data->meshes[m];
-
-    for (cgltf_size p = 0; p < mesh->primitives_count; p++) {
-      cgltf_primitive *primitive = &mesh->primitives[p];
-
-      size_t vertex_count = 0;
-      vertex_t *vertices = NULL;
-
-      size_t index_count = 0;
-      unsigned *indices = NULL;
-
-      // Extracting base color texture
-      {
-        cgltf_texture_view base_color =
-            primitive->material->pbr_metallic_roughness.base_color_texture;
-
-        const uint8_t *texture_data = cgltf_buffer_view_data(
-            (const cgltf_buffer_view *)base_color.texture->image->buffer_view);
-
-        int w, h, n;
-        unsigned char *data = stbi_load_from_memory(
-            texture_data, base_color.texture->image->buffer_view->size, &w, &h,
-            &n, 4);
-
-        textures[curr_texture].width = w;
-        textures[curr_texture].height = h;
-        textures[curr_texture].c = n;
-        textures[curr_texture].data = data;
-        if (base_color.texture->name && strlen(base_color.texture->name) != 0) {
-          textures[curr_texture].label = memcpy(
-              malloc(strlen(base_color.texture->name) + 1),
-              base_color.texture->name, strlen(base_color.texture->name));
-        } else {
-          textures[curr_texture].label = NULL;
+    for (cgltf_size p = 0; p < data->meshes[m].primitives_count; p++) {
+      cgltf_texture *texture =
+          data->meshes[m]
+              .primitives[p]
+              .material->pbr_metallic_roughness.base_color_texture.texture;
+      images[curr_primitive] = texture->image;
+
+      bool seen = false;
+      for (size_t q = 0; q < curr_primitive && !seen; q++) {
+        if (images[q] == texture->image) {
+          texture_ids[curr_primitive] = texture_ids[q];
+          seen = true;
         }
-        curr_texture++;
       }
 
-      switch (primitive->indices->component_type) {
-      case cgltf_component_type_r_16u: {
-        index_count = primitive->indices->buffer_view->size / sizeof(uint16_t);
-        uint16_t *data =
-            (uint16_t *)cgltf_buffer_view_data(primitive->indices->buffer_view);
-
-        indices = calloc(1, sizeof(unsigned) * index_count);
-
-        for (size_t y = 0; y < index_count; y++) {
-          indices[y] = (unsigned)data[y];
-
-          if (indices[y] > 3000) {
-            printf("mmmmmhh %d\n", indices[y]);
-          }
-        }
-
-        break;
-      }
-      default: {
-        printf("YO WTF???\n");
+      bool added = false;
+      if (!seen) {
+        texture_ids[curr_primitive] = G_CacheTexture(game, texture, &added);
       }
+      if (added) {
+        new_textures[new_texture_count++] = texture;
       }
 
-      for (cgltf_size a = 0; a < primitive->attributes_count; a++) {
-        if (strcmp(primitive->attributes[a].name, "TEXCOORD_0") == 0) {
-          switch (primitive->attributes[a].data->component_type) {
-          case cgltf_component_type_r_32f: {
-            float *data = (float *)cgltf_buffer_view_data(
-                primitive->attributes[a].data->buffer_view);
-            size_t n = primitive->attributes[a].data->buffer_view->size /
-                       sizeof(float) / 2;
-            if (vertices == NULL) {
-              vertices = malloc(sizeof(vertex_t) * n);
-              vertex_count = n;
-            }
-
-            for (size_t p = 0; p < n; p++) {
-              vertices[p].uv[0] = data[p * 2 + 0];
-              vertices[p].uv[1] = data[p * 2 + 1];
-            }
-            break;
-          }
-          default:
-            break;
-          }
-        } else if (strcmp(primitive->attributes[a].name, "POSITION") == 0) {
-          switch (primitive->attributes[a].data->component_type) {
-          case cgltf_component_type_r_32f: {
-            float *data = (float *)cgltf_buffer_view_data(
-                primitive->attributes[a].data->buffer_view);
-            size_t n = primitive->attributes[a].data->buffer_view->size /
-                       sizeof(float) / 3;
-            if (vertices == NULL) {
-              vertices = malloc(sizeof(vertex_t) * n);
-              vertex_count = n;
-            }
-
-            for (size_t p = 0; p < n; p++) {
-              vertices[p].pos[0] = data[p * 3 + 0];
-              vertices[p].pos[1] = data[p * 3 + 1];
-              vertices[p].pos[2] = data[p * 3 + 2];
-            }
-            break;
-          }
-          default:
-            break;
-          }
-        }
-        if (strcmp(primitive->attributes[a].name, "NORMAL") == 0) {
-          switch (primitive->attributes[a].data->component_type) {
-          case cgltf_component_type_r_32f: {
-            float *data = (float *)cgltf_buffer_view_data(
-                primitive->attributes[a].data->buffer_view);
-            size_t n = primitive->attributes[a].data->buffer_view->size /
-                       sizeof(float) / 3;
-            if (vertices == NULL) {
-              vertices = malloc(sizeof(vertex_t) * n);
-              vertex_count = n;
-            }
-
-            for (size_t p = 0; p < n; p++) {
-              vertices[p].norm[0] = data[p * 3 + 0];
-              vertices[p].norm[1] = data[p * 3 + 1];
-              vertices[p].norm[2] = data[p * 3 + 2];
-            }
-            break;
-          }
-          default:
-            break;
-          }
-        }
-      }
-
-      primitives[curr_primitive].indices = indices;
-      primitives[curr_primitive].vertices = vertices;
-      primitives[curr_primitive].vertex_count = vertex_count;
-      primitives[curr_primitive].index_count = index_count;
-
       curr_primitive++;
     }
   }
+  free(images);
+
+  texture_t *textures = malloc(sizeof(texture_t) * new_texture_count);
+
+  // Vertices and indices come ready to upload from the cooked mesh. Decoding
+  // them from the glTF is only a fallback, for models that weren't cooked
+  size_t cooked_path_len = strlen(complete_map_path) + 6;
+  char *cooked_path = malloc(cooked_path_len);
+  snprintf(cooked_path, cooked_path_len, "%s.mesh", complete_map_path);
+
+  // Geometry and every new texture are loaded at the same time
+  gltf_load_t load = {
+      .data = data,
+      .new_textures = new_textures,
+      .textures = textures,
+      .cooked_path = cooked_path,
+      .hash = file_hash,
+      .mesh = mesh,
+  };
+  G_ParallelFor((unsigned)new_texture_count + 1, G_LoadGLTFJob, &load);
+  free(new_textures);
+
+  if (!load.cooked) {
+    printf("No cooked mesh for `%s`, run `mesh_cook %s` to load it faster.\n",
+           map_path, complete_map_path);
+  }
+
+  if (!load.loaded || mesh->primitive_count != primitive_count) {
+    printf("Couldn't extract the primitives of `%s` (%s).\n", map_path,
+           complete_map_path);
+    if (load.loaded) {
+      G_DestroyMesh(mesh);
+    }
+    // Nothing is uploaded, forget about the new textures
+    game->texture_count = first_texture;
+    for (size_t i = 0; i < new_texture_count; i++) {
+      free(textures[i].data);
+      free(textures[i].label);
+    }
+    free(textures);
+    free(texture_ids);
+    free(cooked_path);
+    free(complete_map_path);
+    cgltf_free(data);
+    free(buff);
+    return false;
+  }
+
+  for (size_t p = 0; p < primitive_count; p++) {
+    mesh->primitives[p].texture = texture_ids[p];
+  }
+  free(texture_ids);
+
+  free(cooked_path);
+  free(complete_map_path);
 
-  *p = primitives;
-  *p_c = primitive_count;
   *t = textures;
-  *t_c = curr_texture;
+  *t_c = new_texture_count;
 
   cgltf_free(data);
 
@@ -359,156 +501,284 @@ bool G_LoadGLTF(game_t *game, primitive_t **p, unsigned *p_c, texture_t **t,
   return true;
 }
 
-bool G_LoadMap(client_t *client, game_t *game, char *map_path) {
-  primitive_t *primitives;
-  unsigned primitive_count;
+/// @brief Part of a scene, loaded by the loader thread and committed to the
+/// renderer by the main thread: the map, or an enemy.
+typedef struct scene_chunk_t {
+  mesh_t mesh;
   texture_t *textures;
   unsigned texture_count;
 
-  if (!G_LoadGLTF(game, &primitives, &primitive_count, &textures,
-                  &texture_count, map_path)) {
-    return false;
-  }
+  // Map only, replaces the current collision mesh once committed
+  bool is_map;
+  collision_mesh_t *collision;
+
+  // Enemies using the same mesh share the model of the first one, loaded by
+  // chunk `model_chunk`
+  char *mesh_path;
+  unsigned model_chunk;
+  unsigned model_id;
+
+  vec3 position;
+  vec3 rotation;
+  vec3 scale;
+} scene_chunk_t;
+
+/// @brief Scene loading in the background. The loader thread fills `chunks`
+/// in order, and publishes each of them by bumping `ready_count`. Until the
+/// loader is over, it's the only one touching the texture cache.
+struct scene_loader_t {
+  game_t *game;
+  job_t *job;
+
+  char *map_path;
+  toml_table_t *enemies;
+
+  scene_chunk_t *chunks;
+  unsigned chunk_count;
+  atomic_uint ready_count;
+  atomic_bool failed;
+
+  // Chunks already given to the renderer, by the main thread
+  unsigned committed_count;
+};
 
-  if (game->current_mesh) {
-    G_DestroyCollisionMap(game->current_mesh);
-  }
+static double G_Now() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
 
-  game->current_mesh = G_LoadCollisionMap(primitives, primitive_count);
+static void G_DestroyChunk(scene_chunk_t *chunk) {
+  G_DestroyMesh(&chunk->mesh);
+  for (unsigned t = 0; t < chunk->texture_count; t++) {
+    free(chunk->textures[t].data);
+    free(chunk->textures[t].label);
+  }
+  free(chunk->textures);
+  chunk->textures = NULL;
+  chunk->texture_count = 0;
+}
 
-  VK_PushMap(CL_GetRend(client), primitives, primitive_count, textures,
-             texture_count);
+static bool G_LoadMap(game_t *game, char *map_path, scene_chunk_t *chunk) {
+  uint64_t map_hash;
 
-  for (unsigned i = 0; i < primitive_count; i++) {
-    free(primitives[i].indices);
-    free(primitives[i].vertices);
+  if (!G_LoadGLTF(game, &chunk->mesh, &chunk->textures, &chunk->texture_count,
+                  map_path, &map_hash)) {
+    return false;
   }
-  for (unsigned i = 0; i < primitive_count; i++) {
-    free(textures[i].data);
+
+  // The collision mesh is cooked next to the map, and only rebuilt when the
+  // map changes
+  char *complete_map_path = G_GetCompletePath(game->base, map_path);
+  size_t cache_path_len = strlen(complete_map_path) + 5;
+  char *cache_path = malloc(cache_path_len);
+  snprintf(cache_path, cache_path_len, "%s.col", complete_map_path);
+
+  chunk->collision = G_LoadCollisionCache(cache_path, map_hash);
+  if (!chunk->collision) {
+    chunk->collision =
+        G_LoadCollisionMap(chunk->mesh.primitives, chunk->mesh.primitive_count);
+    G_SaveCollisionCache(chunk->collision, cache_path, map_hash);
   }
-  free(primitives);
-  free(textures);
+
+  free(cache_path);
+  free(complete_map_path);
+
+  chunk->is_map = true;
 
   return true;
 }
 
-bool G_LoadEnemies(client_t *client, game_t *game, toml_table_t *enemies) {
-  for (int i = 0;; i++) {
-    const char *key = toml_key_in(enemies, i);
-    if (!key) {
-      break;
-    }
-    toml_table_t *enemy = toml_table_in(enemies, key);
-    toml_datum_t enemy_path = toml_string_in(enemy, "mesh");
-    if (!enemy_path.ok) {
-      printf("Enemy `%s` must have a mesh field describing the path to the "
-             "3D model.\n",
+static bool G_LoadEnemy(scene_loader_t *loader, const char *key,
+                        toml_table_t *enemy, unsigned chunk_index) {
+  game_t *game = loader->game;
+  scene_chunk_t *chunk = &loader->chunks[chunk_index];
+
+  toml_datum_t enemy_path = toml_string_in(enemy, "mesh");
+  if (!enemy_path.ok) {
+    printf("Enemy `%s` must have a mesh field describing the path to the "
+           "3D model.\n",
+           key);
+    return false;
+  }
+
+  vec3 pos = {0.0, 0.0, 0.0};
+  toml_array_t *enemy_pos = toml_array_in(enemy, "position");
+  if (!enemy_pos) {
+    printf("Enemy `%s` must have a position field [x, y, z].\n", key);
+  } else {
+    toml_datum_t x = toml_double_at(enemy_pos, 0);
+    toml_datum_t y = toml_double_at(enemy_pos, 1);
+    toml_datum_t z = toml_double_at(enemy_pos, 2);
+    if (!x.ok || !y.ok || !z.ok) {
+      printf("Enemy `%s` must have a position field [x, y, z]. Each "
+             "component has to be a number.\n",
              key);
+      free(enemy_path.u.s);
       return false;
     }
 
-    primitive_t *primitives;
-    unsigned primitive_count;
-    texture_t *textures;
-    unsigned texture_count;
+    pos[0] = (float)x.u.d;
+    pos[1] = (float)y.u.d;
+    pos[2] = (float)z.u.d;
+  }
+  vec3 rot = {0.0, 0.0, 0.0};
+  toml_array_t *enemy_rot = toml_array_in(enemy, "rotation");
+  if (enemy_rot) {
+    toml_datum_t x = toml_double_at(enemy_rot, 0);
+    toml_datum_t y = toml_double_at(enemy_rot, 1);
+    toml_datum_t z = toml_double_at(enemy_rot, 2);
+    if (!x.ok || !y.ok || !z.ok) {
+      printf("Enemy `%s` must have a rotation field [x, y, z] where each"
+             "component has to be a number.\n",
+             key);
+      free(enemy_path.u.s);
+      return false;
+    }
 
-    if (!G_LoadGLTF(game, &primitives, &primitive_count, &textures,
-                    &texture_count, enemy_path.u.s)) {
-      printf("Enemy `%s` has an invalid path to 3D model or the model failed "
-             "to be loaded.\n",
+    rot[0] = (float)x.u.d;
+    rot[1] = (float)y.u.d;
+    rot[2] = (float)z.u.d;
+  }
+  vec3 scale = {
+      [0] = 1.0,
+      [1] = 1.0,
+      [2] = 1.0,
+  };
+  toml_array_t *enemy_scale = toml_array_in(enemy, "scale");
+  if (enemy_scale) {
+    toml_datum_t x = toml_double_at(enemy_scale, 0);
+    toml_datum_t y = toml_double_at(enemy_scale, 1);
+    toml_datum_t z = toml_double_at(enemy_scale, 2);
+    if (!x.ok || !y.ok || !z.ok) {
+      printf("Enemy `%s` must have a scale field [x, y, z] where each"
+             "component has to be a number.\n",
              key);
+      free(enemy_path.u.s);
       return false;
     }
 
-    // size_t enemy_handle =
-    //     VK_PushModel(CL_GetRend(client), primitives, primitive_count,
-    //     textures,
-    //                  texture_count);
+    scale[0] = (float)x.u.d;
+    scale[1] = (float)y.u.d;
+    scale[2] = (float)z.u.d;
+  }
 
-    vec3 pos;
-    toml_array_t *enemy_pos = toml_array_in(enemy, "position");
-    if (!enemy_pos) {
-      printf("Enemy `%s` must have a position field [x, y, z].\n", key);
-    } else {
-      toml_datum_t x = toml_double_at(enemy_pos, 0);
-      toml_datum_t y = toml_double_at(enemy_pos, 1);
-      toml_datum_t z = toml_double_at(enemy_pos, 2);
-      if (!x.ok || !y.ok || !z.ok) {
-        printf("Enemy `%s` must have a position field [x, y, z]. Each "
-               "component has to be a number.\n",
-               key);
-        return false;
-      }
+  // Instances of a mesh already loaded are drawn along with it
+  chunk->mesh_path = enemy_path.u.s;
+  chunk->model_chunk = chunk_index;
+  for (unsigned c = 1; c < chunk_index; c++) {
+    if (strcmp(loader->chunks[c].mesh_path, chunk->mesh_path) == 0) {
+      chunk->model_chunk = loader->chunks[c].model_chunk;
+      break;
+    }
+  }
 
-      pos[0] = (float)x.u.d;
-      pos[1] = (float)y.u.d;
-      pos[2] = (float)z.u.d;
+  // Textures it adds to the cache keep their bindless index, as chunks are
+  // committed in the order they are loaded
+  if (chunk->model_chunk == chunk_index &&
+      !G_LoadGLTF(game, &chunk->mesh, &chunk->textures, &chunk->texture_count,
+                  chunk->mesh_path, NULL)) {
+    printf("Enemy `%s` has an invalid path to 3D model or the model failed "
+           "to be loaded.\n",
+           key);
+    return false;
+  }
 
-      printf("pos: %f, %f, %f\n", pos[0], pos[1], pos[2]);
-    }
-    vec3 rot;
-    toml_array_t *enemy_rot = toml_array_in(enemy, "rotation");
-    if (enemy_rot) {
-      toml_datum_t x = toml_double_at(enemy_rot, 0);
-      toml_datum_t y = toml_double_at(enemy_rot, 1);
-      toml_datum_t z = toml_double_at(enemy_rot, 2);
-      if (!x.ok || !y.ok || !z.ok) {
-        printf("Enemy `%s` must have a rotation field [x, y, z] where each"
-               "component has to be a number.\n",
-               key);
-        return false;
-      }
+  glm_vec3_copy(pos, chunk->position);
+  glm_vec3_copy(rot, chunk->rotation);
+  glm_vec3_copy(scale, chunk->scale);
 
-      rot[0] = (float)x.u.d;
-      rot[1] = (float)y.u.d;
-      rot[2] = (float)z.u.d;
+  return true;
+}
+
+/// @brief Loader thread: everything but the uploads, one chunk at a time.
+static void G_LoadSceneJob(void *data, unsigned index) {
+  scene_loader_t *loader = data;
+  game_t *game = loader->game;
+
+  printf("Loading %s...\n", loader->map_path);
+  if (!G_LoadMap(game, loader->map_path, &loader->chunks[0])) {
+    printf("Failed to load map file.\n");
+    atomic_store(&loader->failed, true);
+    return;
+  }
+  atomic_store(&loader->ready_count, 1);
 
-      printf("rot: %f, %f, %f\n", rot[0], rot[1], rot[2]);
+  printf("Loading enemies...\n");
+  for (unsigned c = 1; c < loader->chunk_count; c++) {
+    const char *key = toml_key_in(loader->enemies, (int)c - 1);
+    toml_table_t *enemy = toml_table_in(loader->enemies, key);
+    if (!G_LoadEnemy(loader, key, enemy, c)) {
+      printf("Failed to load enemies.\n");
+      atomic_store(&loader->failed, true);
+      return;
     }
-    vec3 scale = {
-        [0] = 1.0,
-        [1] = 1.0,
-        [2] = 1.0,
-    };
-    toml_array_t *enemy_scale = toml_array_in(enemy, "scale");
-    if (enemy_scale) {
-      toml_datum_t x = toml_double_at(enemy_scale, 0);
-      toml_datum_t y = toml_double_at(enemy_scale, 1);
-      toml_datum_t z = toml_double_at(enemy_scale, 2);
-      if (!x.ok || !y.ok || !z.ok) {
-        printf("Enemy `%s` must have a scale field [x, y, z] where each"
-               "component has to be a number.\n",
-               key);
-        return false;
-      }
+    atomic_store(&loader->ready_count, c + 1);
+  }
+}
 
-      scale[0] = (float)x.u.d;
-      scale[1] = (float)y.u.d;
-      scale[2] = (float)z.u.d;
+/// @brief Give a loaded chunk to the renderer, on the main thread.
+static void G_CommitChunk(client_t *client, game_t *game,
+                          scene_loader_t *loader, scene_chunk_t *chunk) {
+  vk_rend_t *rend = CL_GetRend(client);
 
-      printf("scale: %f, %f, %f\n", rot[0], rot[1], rot[2]);
+  if (chunk->is_map) {
+    if (game->current_mesh) {
+      G_DestroyCollisionMap(game->current_mesh);
     }
+    game->current_mesh = chunk->collision;
+    chunk->collision = NULL;
 
-    unsigned model_id = VK_PushModel(CL_GetRend(client), primitives,
-                                     primitive_count, textures, texture_count);
-    game->actors[model_id].position[0] = pos[0];
-    game->actors[model_id].position[1] = pos[1];
-    game->actors[model_id].position[2] = pos[2];
+    VK_PushMap(rend, chunk->mesh.primitives, chunk->mesh.primitive_count,
+               chunk->textures, chunk->texture_count);
+  } else {
+    // Chunks sharing a model come after the one loading it
+    if (chunk->model_chunk == (unsigned)(chunk - loader->chunks)) {
+      chunk->model_id = VK_PushModel(rend, chunk->mesh.primitives,
+                                     chunk->mesh.primitive_count,
+                                     chunk->textures, chunk->texture_count);
+    } else {
+      chunk->model_id = loader->chunks[chunk->model_chunk].model_id;
+    }
 
-    game->actors[model_id].rotation[0] = rot[0];
-    game->actors[model_id].rotation[1] = rot[1];
-    game->actors[model_id].rotation[2] = rot[2];
+    if (game->actor_count < GAME_MAX_ACTORS) {
+      unsigned a = game->actor_count++;
+      glm_vec3_copy(chunk->position, game->actors[a].position);
+      glm_vec3_copy(chunk->rotation, game->actors[a].rotation);
+      glm_vec3_copy(chunk->scale, game->actors[a].scale);
+      game->actors[a].model_id = chunk->model_id;
+      game->actors[a].dirty = true;
+    } else {
+      printf("Only %d actors fit in a scene, dropping one.\n",
+             GAME_MAX_ACTORS);
+    }
+  }
 
-    game->actors[model_id].scale[0] = scale[0];
-    game->actors[model_id].scale[1] = scale[1];
-    game->actors[model_id].scale[2] = scale[2];
+  G_DestroyChunk(chunk);
+}
+
+static void G_DestroySceneLoader(game_t *game) {
+  scene_loader_t *loader = game->loader;
 
-    game->actors[model_id].dirty = true;
+  G_WaitJob(loader->job);
 
-    game->actor_count++;
+  // Whatever wasn't committed, including a chunk the loader failed on
+  for (unsigned c = loader->committed_count; c < loader->chunk_count; c++) {
+    if (loader->chunks[c].collision) {
+      G_DestroyCollisionMap(loader->chunks[c].collision);
+    }
+    if (c < atomic_load(&loader->ready_count)) {
+      G_DestroyChunk(&loader->chunks[c]);
+    }
   }
 
-  return true;
+  for (unsigned c = 0; c < loader->chunk_count; c++) {
+    free(loader->chunks[c].mesh_path);
+  }
+  free(loader->chunks);
+  free(loader->map_path);
+  free(loader);
+  game->loader = NULL;
 }
 
 bool G_LoadCurrentScene(client_t *client, game_t *game) {
@@ -517,7 +787,7 @@ bool G_LoadCurrentScene(client_t *client, game_t *game) {
     return false;
   }
 
-  if (game->current_scene->loaded) {
+  if (game->current_scene->loaded || game->loader) {
     printf("Current scene was already loaded.\n");
     return false;
   }
@@ -538,35 +808,72 @@ bool G_LoadCurrentScene(client_t *client, game_t *game) {
     return false;
   }
 
-  char *level_path = map.u.s;
-
-  printf("Loading %s...\n", level_path);
+  toml_table_t *enemies = toml_table_in(scene->def, "enemies");
+  unsigned enemy_count = 0;
+  if (!enemies) {
+    printf("No enemy.\n");
+  } else {
+    while (toml_key_in(enemies, (int)enemy_count)) {
+      enemy_count++;
+    }
+  }
 
-  if (!G_LoadMap(client, game, level_path)) {
-    printf("Failed to load map file.\n");
-    free(level_path);
+  // The map first, then one chunk per enemy
+  scene_loader_t *loader = calloc(1, sizeof(scene_loader_t));
+  loader->game = game;
+  loader->map_path = map.u.s;
+  loader->enemies = enemies;
+  loader->chunk_count = enemy_count + 1;
+  loader->chunks = calloc(loader->chunk_count, sizeof(scene_chunk_t));
+  atomic_init(&loader->ready_count, 0);
+  atomic_init(&loader->failed, false);
+
+  loader->job = G_StartJob(G_LoadSceneJob, loader);
+  if (!loader->job) {
+    free(loader->chunks);
+    free(loader->map_path);
+    free(loader);
     return false;
   }
+  game->loader = loader;
 
-  printf("Finished!\n");
+  return true;
+}
 
-  free(level_path);
+scene_status_t G_StreamCurrentScene(client_t *client, game_t *game,
+                                    float budget_ms) {
+  scene_loader_t *loader = game->loader;
+  if (!loader) {
+    return game->current_scene->loaded ? SCENE_LOADED : SCENE_FAILED;
+  }
 
-  printf("Loading enemies...\n");
+  // At least one chunk per call, so that loading always moves forward
+  double start = G_Now();
+  unsigned ready_count = atomic_load(&loader->ready_count);
+  while (loader->committed_count < ready_count) {
+    G_CommitChunk(client, game, loader,
+                  &loader->chunks[loader->committed_count++]);
 
-  toml_table_t *enemies = toml_table_in(scene->def, "enemies");
-  if (!enemies) {
-    printf("No enemy.\n");
-  } else {
-    if (!G_LoadEnemies(client, game, enemies)) {
-      printf("Failed to load enemies.\n");
-      return false;
+    if ((G_Now() - start) * 1e3 >= budget_ms) {
+      break;
     }
   }
 
+  if (loader->committed_count < loader->chunk_count) {
+    if (!atomic_load(&loader->failed) || !G_IsJobDone(loader->job) ||
+        loader->committed_count < atomic_load(&loader->ready_count)) {
+      return SCENE_LOADING;
+    }
+
+    G_DestroySceneLoader(game);
+    return SCENE_FAILED;
+  }
+
+  G_DestroySceneLoader(game);
+  game->current_scene->loaded = true;
   printf("Loading finished...\n");
 
-  return true;
+  return SCENE_LOADED;
 }
 
 game_state_t G_TickGame(client_t *client, game_t *game) {
@@ -598,40 +905,114 @@ game_state_t G_TickGame(client_t *client, game_t *game) {
   glm_vec3_normalize(mvnt);
   glm_vec3_normalize(center);
 
-  vec3 foot_pos;
-  glm_vec3_sub(game->fps_pos, (vec3){0.0, 0.8, 0.0}, foot_pos);
+  // The ground under the player's feet and under every actor, in one batch.
+  // The player's ray goes first
+  collision_ray_t ground_rays[GAME_MAX_ACTORS + 1];
+  collision_hit_t ground_hits[GAME_MAX_ACTORS + 1];
+
+  ground_rays[0] = (collision_ray_t){
+      .orig = {game->fps_pos[0], game->fps_pos[1] - 0.8f, game->fps_pos[2]},
+      .dir = {0.0, -1.0, 0.0},
+      .distance = 0.8,
+  };
+  for (unsigned i = 0; i < game->actor_count; i++) {
+    float *position = game->actors[i].position;
+    ground_rays[i + 1] = (collision_ray_t){
+        .orig = {position[0], position[1] + ACTOR_STEP_HEIGHT, position[2]},
+        .dir = {0.0, -1.0, 0.0},
+        .distance = ACTOR_STEP_HEIGHT + ACTOR_FALL_SPEED,
+    };
+  }
+
+  G_CollisionRayQueryBatch(game->current_mesh, ground_rays, ground_hits,
+                           game->actor_count + 1);
+
+  for (unsigned i = 0; i < game->actor_count; i++) {
+    collision_hit_t *hit = &ground_hits[i + 1];
+    float fall = hit->hit ? hit->t - ACTOR_STEP_HEIGHT : ACTOR_FALL_SPEED;
+    // Resting actors stay put, and out of the broadphase update
+    if (fabsf(fall) > 0.0001f) {
+      game->actors[i].position[1] -= fall;
+      game->actors[i].dirty = true;
+    }
+  }
+
+  // Only actors that moved are updated in the broadphase, before the player
+  // collides with them
+  for (unsigned i = 0; i < game->actor_count; i++) {
+    if (!game->actors[i].dirty) {
+      continue;
+    }
+
+    float radius = ACTOR_RADIUS * glm_vec3_max(game->actors[i].scale);
+    G_UpdateSpatialEntry(game->actor_grid, i, game->actors[i].position,
+                         radius);
+    game->actors[i].dirty = false;
+  }
 
   vec3 gravity = {0.0, -1.0, 0.0};
 
   float t;
-  bool collided = G_CollisionRayQuery(game->current_mesh, foot_pos, gravity,
-                                      0.8, false, &t);
-  if (!collided) {
+  if (!ground_hits[0].hit) {
     gravity[1] *= 0.12;
   } else {
-    gravity[1] = (0.7 - t);
+    gravity[1] = (0.7 - ground_hits[0].t);
   }
   glm_vec3_add(gravity, game->fps_pos, game->fps_pos);
 
-  bool collided2 =
-      G_CollisionRayQuery(game->current_mesh, foot_pos, mvnt, 0.35, true, &t);
+  // Collide and slide a sphere around the feet. Each wall hit eats the
+  // movement up to the contact, the rest slides along the wall.
+  vec3 body;
+  glm_vec3_sub(game->fps_pos, (vec3){0.0, 0.8, 0.0}, body);
 
-  if (!collided2) {
-    mvnt[0] *= 0.22;
-    mvnt[1] = 0.0;
-    mvnt[2] *= 0.22;
-    glm_vec3_add(mvnt, game->fps_pos, game->fps_pos);
-  } else {
-    bool collided_with_updated =
-        G_CollisionRayQuery(game->current_mesh, foot_pos, mvnt, 0.35, true, &t);
-    if (!collided_with_updated) {
-      mvnt[0] *= 0.22;
-      mvnt[1] = 0.0;
-      mvnt[2] *= 0.22;
-      glm_vec3_add(mvnt, game->fps_pos, game->fps_pos);
+  vec3 motion = {mvnt[0] * 0.22f, 0.0, mvnt[2] * 0.22f};
+  for (unsigned i = 0; i < PLAYER_SLIDE_ITERATIONS; i++) {
+    float length = glm_vec3_norm(motion);
+    if (length < 0.0001f) {
+      break;
+    }
+
+    vec3 dir;
+    glm_vec3_scale(motion, 1.0f / length, dir);
+
+    vec3 n;
+    if (!G_CollisionSphereSweep(game->current_mesh, body, PLAYER_RADIUS, dir,
+                                length, &t, n)) {
+      glm_vec3_add(body, motion, body);
+      break;
+    }
+
+    // Stop a bit before the contact, to not start the next sweep touching it
+    float advance = glm_max(t - PLAYER_SKIN, 0.0f);
+    glm_vec3_muladds(dir, advance, body);
+
+    glm_vec3_scale(dir, length - advance, motion);
+    glm_vec3_muladds(n, -glm_vec3_dot(motion, n), motion);
+    // Height is gravity's business
+    motion[1] = 0.0;
+  }
+
+  // Actors are solid too, the body is pushed out of the ones it walked into.
+  // Only sideways, and without sweeping again, the push is small
+  unsigned contacts[PLAYER_MAX_CONTACTS];
+  unsigned contact_count = G_QuerySpatialGrid(
+      game->actor_grid, body, PLAYER_RADIUS, contacts, PLAYER_MAX_CONTACTS);
+  for (unsigned i = 0; i < contact_count; i++) {
+    float *position = game->actors[contacts[i]].position;
+    float *scale = game->actors[contacts[i]].scale;
+    float reach = PLAYER_RADIUS + ACTOR_RADIUS * glm_vec3_max(scale);
+    vec3 away = {body[0] - position[0], 0.0, body[2] - position[2]};
+    float distance = glm_vec3_norm(away);
+    if (distance < 0.0001f || distance >= reach) {
+      continue;
     }
+
+    glm_vec3_muladds(away, (reach - distance) / distance, body);
   }
 
+  game->fps_pos[0] = body[0];
+  game->fps_pos[2] = body[2];
+
   // Construct game state
   unsigned v_width, v_height;
   CL_GetViewDim(client, &v_width, &v_height);
@@ -652,35 +1033,44 @@ game_state_t G_TickGame(client_t *client, game_t *game) {
   // Iterate through actor and update transforms
   for (unsigned i = 0; i < game->actor_count; i++) {
     mat4 model;
-    mat4 inv_model;
+    mat4 tmp;
 
     mat4 translation;
-    glm_translate(translation, game->actors[i].position);
+    glm_translate_make(translation, game->actors[i].position);
 
     mat4 rot_x;
-    glm_rotate(rot_x, game->actors[i].rotation[0], (vec3){1.0, 0.0, 0.0});
+    glm_rotate_make(rot_x, game->actors[i].rotation[0], (vec3){1.0, 0.0, 0.0});
     mat4 rot_y;
-    glm_rotate(rot_y, game->actors[i].rotation[1], (vec3){0.0, 1.0, 0.0});
+    glm_rotate_make(rot_y, game->actors[i].rotation[1], (vec3){0.0, 1.0, 0.0});
     mat4 rot_z;
-    glm_rotate(rot_z, game->actors[i].rotation[2], (vec3){0.0, 0.0, 1.0});
+    glm_rotate_make(rot_z, game->actors[i].rotation[2], (vec3){0.0, 0.0, 1.0});
 
     mat4 scale;
-    glm_scale(scale, game->actors[i].scale);
+    glm_scale_make(scale, game->actors[i].scale);
 
     glm_mat4_mul(translation, rot_x, model);
-    glm_mat4_mul(model, rot_y, inv_model);
-    glm_mat4_mul(inv_model, rot_z, model);
-    glm_mat4_mul(model, rot_z, inv_model);
-    glm_mat4_mul(inv_model, scale, game_state.actors[i].model);
+    glm_mat4_mul(model, rot_y, tmp);
+    glm_mat4_mul(tmp, rot_z, model);
+    glm_mat4_mul(model, scale, game_state.actors[i].model);
 
-    glm_mat4_inv(model, game_state.actors[i].inv_model);
+    // Normals are transformed by its inverse transpose, scale included
+    glm_mat4_inv(game_state.actors[i].model, game_state.actors[i].inv_model);
+    game_state.actors[i].model_id = game->actors[i].model_id;
   }
+  game_state.actor_count = game->actor_count;
 
   return game_state;
 }
 
 void G_DestroyGame(game_t *game) {
-  G_DestroyCollisionMap(game->current_mesh);
+  if (game->loader) {
+    G_DestroySceneLoader(game);
+  }
+  if (game->current_mesh) {
+    G_DestroyCollisionMap(game->current_mesh);
+  }
+  G_DestroySpatialGrid(game->actor_grid);
+  free(game->textures);
   free(game->base);
   toml_free(game->current_scene->def);
   free(game->current_scene);
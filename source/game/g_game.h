@@ -8,6 +8,9 @@ typedef struct client_t client_t;
 
 typedef struct game_t game_t;
 
+// Actors in a scene, enemies included
+#define GAME_MAX_ACTORS 256
+
 typedef struct game_state_t {
   // First person camera.
   // Yes, we want to speed gameplay
@@ -23,7 +26,10 @@ typedef struct game_state_t {
   struct {
     mat4 model;
     mat4 inv_model;
-  } actors[64];
+    // Id given by `VK_PushModel`, shared by actors using the same mesh
+    unsigned model_id;
+  } actors[GAME_MAX_ACTORS];
+  unsigned actor_count;
 } game_state_t;
 
 /// @brief Create a new game, allocating the memory for it. Read `main.toml`
@@ -33,8 +39,27 @@ typedef struct game_state_t {
 /// @return
 game_t *G_CreateGame(char *base);
 
+typedef enum scene_status_t {
+  SCENE_LOADING,
+  SCENE_LOADED,
+  SCENE_FAILED,
+} scene_status_t;
+
+/// @brief Start loading the current scene in the background. The TOML
+/// definition is read, models decoded and collision built by a loader
+/// thread, nothing is uploaded until `G_StreamCurrentScene` is called.
+/// @return false if the scene definition is invalid, or already loaded.
 bool G_LoadCurrentScene(client_t *client, game_t *game);
 
+/// @brief Upload the parts of the current scene the loader is done with: the
+/// map, then each enemy. Called once per frame while the scene is loading,
+/// the game shouldn't be ticked before it's over.
+/// @param budget_ms Time after which the remaining parts wait for the next
+/// call. At least one is uploaded per call.
+/// @return
+scene_status_t G_StreamCurrentScene(client_t *client, game_t *game,
+                                    float budget_ms);
+
 game_state_t G_TickGame(client_t *client, game_t *game);
 
 void G_DestroyGame(game_t *game);
@@ -0,0 +1,215 @@
+#include "g_jobs.h"
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define JOBS_MAX_THREADS 64
+
+typedef struct parallel_for_t {
+  job_func_t func;
+  void *data;
+  unsigned count;
+  SDL_atomic_t next;
+} parallel_for_t;
+
+static unsigned job_thread_count = 0;
+
+unsigned G_GetJobThreadCount() {
+  unsigned thread_count = job_thread_count;
+  if (thread_count == 0) {
+    int cpu_count = SDL_GetCPUCount();
+    thread_count = cpu_count > 0 ? (unsigned)cpu_count : 1;
+  }
+
+  return thread_count > JOBS_MAX_THREADS ? JOBS_MAX_THREADS : thread_count;
+}
+
+void G_SetJobThreadCount(unsigned thread_count) {
+  job_thread_count = thread_count;
+}
+
+static void G_RunParallelFor(parallel_for_t *job) {
+  for (;;) {
+    unsigned index = (unsigned)SDL_AtomicAdd(&job->next, 1);
+    if (index >= job->count) {
+      break;
+    }
+    job->func(job->data, index);
+  }
+}
+
+// Workers of `G_ParallelFor`, created on first use and kept waiting for the
+// next call. One call has them at a time, the others run on their own
+// thread.
+static struct {
+  SDL_atomic_t busy;
+  SDL_mutex *mutex;
+  // Workers wait for a new call, the caller for them to be done with it
+  SDL_cond *wake;
+  SDL_cond *done;
+
+  unsigned worker_count;
+  // Each call is a new generation, joined by the first `wanted` workers
+  unsigned generation;
+  unsigned wanted;
+  unsigned active;
+  parallel_for_t *job;
+} job_pool;
+
+typedef struct job_worker_t {
+  unsigned index;
+  // Last generation seen
+  unsigned generation;
+} job_worker_t;
+
+static job_worker_t job_workers[JOBS_MAX_THREADS];
+
+static int G_JobWorker(void *data) {
+  job_worker_t *worker = data;
+
+  SDL_LockMutex(job_pool.mutex);
+  for (;;) {
+    while (job_pool.generation == worker->generation) {
+      SDL_CondWait(job_pool.wake, job_pool.mutex);
+    }
+    worker->generation = job_pool.generation;
+    if (worker->index >= job_pool.wanted) {
+      continue;
+    }
+
+    parallel_for_t *job = job_pool.job;
+    SDL_UnlockMutex(job_pool.mutex);
+    G_RunParallelFor(job);
+    SDL_LockMutex(job_pool.mutex);
+
+    if (--job_pool.active == 0) {
+      SDL_CondSignal(job_pool.done);
+    }
+  }
+
+  return 0;
+}
+
+/// @brief Create the workers missing for `worker_count` of them. Only called
+/// by the caller holding the pool, so the generation doesn't move.
+/// @return Number of workers available, fewer if some couldn't be created.
+static unsigned G_StartJobWorkers(unsigned worker_count) {
+  if (!job_pool.mutex) {
+    job_pool.mutex = SDL_CreateMutex();
+    job_pool.wake = SDL_CreateCond();
+    job_pool.done = SDL_CreateCond();
+    if (!job_pool.mutex || !job_pool.wake || !job_pool.done) {
+      printf("Couldn't create the job pool: %s\n", SDL_GetError());
+      return 0;
+    }
+  }
+
+  while (job_pool.worker_count < worker_count) {
+    job_worker_t *worker = &job_workers[job_pool.worker_count];
+    worker->index = job_pool.worker_count;
+    worker->generation = job_pool.generation;
+
+    // Never joined, they wait for work until the process exits
+    SDL_Thread *thread =
+        SDL_CreateThread(G_JobWorker, "maidenless_job", worker);
+    if (!thread) {
+      printf("Couldn't create a job thread: %s\n", SDL_GetError());
+      break;
+    }
+    SDL_DetachThread(thread);
+    job_pool.worker_count++;
+  }
+
+  return job_pool.worker_count < worker_count ? job_pool.worker_count
+                                              : worker_count;
+}
+
+void G_ParallelFor(unsigned count, job_func_t func, void *data) {
+  if (count == 0) {
+    return;
+  }
+
+  unsigned thread_count = G_GetJobThreadCount();
+  if (thread_count > count) {
+    thread_count = count;
+  }
+
+  parallel_for_t job = {
+      .func = func,
+      .data = data,
+      .count = count,
+  };
+  SDL_AtomicSet(&job.next, 0);
+
+  // Workers are taken by another call, from another thread or from a job.
+  // Waiting for them could stall a frame behind a load, or never end
+  if (thread_count == 1 || !SDL_AtomicCAS(&job_pool.busy, 0, 1)) {
+    G_RunParallelFor(&job);
+    return;
+  }
+
+  // If no worker could be created, the calling thread does everything
+  unsigned worker_count = G_StartJobWorkers(thread_count - 1);
+  if (worker_count > 0) {
+    SDL_LockMutex(job_pool.mutex);
+    job_pool.job = &job;
+    job_pool.wanted = worker_count;
+    job_pool.active = worker_count;
+    job_pool.generation++;
+    SDL_CondBroadcast(job_pool.wake);
+    SDL_UnlockMutex(job_pool.mutex);
+  }
+
+  G_RunParallelFor(&job);
+
+  if (worker_count > 0) {
+    SDL_LockMutex(job_pool.mutex);
+    while (job_pool.active > 0) {
+      SDL_CondWait(job_pool.done, job_pool.mutex);
+    }
+    job_pool.job = NULL;
+    SDL_UnlockMutex(job_pool.mutex);
+  }
+
+  SDL_AtomicSet(&job_pool.busy, 0);
+}
+
+struct job_t {
+  SDL_Thread *thread;
+  job_func_t func;
+  void *data;
+  SDL_atomic_t done;
+};
+
+static int G_JobThread(void *data) {
+  job_t *job = data;
+
+  job->func(job->data, 0);
+  SDL_AtomicSet(&job->done, 1);
+
+  return 0;
+}
+
+job_t *G_StartJob(job_func_t func, void *data) {
+  job_t *job = calloc(1, sizeof(job_t));
+  job->func = func;
+  job->data = data;
+  SDL_AtomicSet(&job->done, 0);
+
+  job->thread = SDL_CreateThread(G_JobThread, "maidenless_job", job);
+  if (!job->thread) {
+    printf("Couldn't create a job thread: %s\n", SDL_GetError());
+    free(job);
+    return NULL;
+  }
+
+  return job;
+}
+
+bool G_IsJobDone(job_t *job) { return SDL_AtomicGet(&job->done) != 0; }
+
+void G_WaitJob(job_t *job) {
+  SDL_WaitThread(job->thread, NULL);
+  free(job);
+}
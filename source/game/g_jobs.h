@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+/// @brief Work of a parallel for, called once per index.
+typedef void (*job_func_t)(void *data, unsigned index);
+
+/// @brief Call `func` for every index in [0, count), spread over worker
+/// threads. The calling thread takes part, and the call returns once every
+/// index is done. Indices are picked in order, but may complete in any order.
+///
+/// Workers are created on first use, and wait for the next call afterwards.
+/// They serve one call at a time: a call made while they're taken, from
+/// another thread or from `func`, runs on the calling thread alone.
+/// @param count Number of indices. Better be a few times the thread count,
+/// for the threads to balance the load.
+/// @param func Function called for each index, from any thread.
+/// @param data Passed to `func`.
+void G_ParallelFor(unsigned count, job_func_t func, void *data);
+
+/// @brief Number of threads used by `G_ParallelFor`, the number of CPUs by
+/// default.
+unsigned G_GetJobThreadCount();
+
+/// @brief Change the number of threads used by `G_ParallelFor`, 0 to go back
+/// to the number of CPUs.
+void G_SetJobThreadCount(unsigned thread_count);
+
+typedef struct job_t job_t;
+
+/// @brief Call `func` once, with index 0, on a thread of its own. Meant for
+/// long work the main thread shouldn't wait for, like loading a scene.
+/// @return The running job, to be waited for with `G_WaitJob`. NULL if no
+/// thread could be created.
+job_t *G_StartJob(job_func_t func, void *data);
+
+/// @brief Whether `func` returned. Doesn't block.
+bool G_IsJobDone(job_t *job);
+
+/// @brief Wait for `func` to return, and free the job.
+void G_WaitJob(job_t *job);
@@ -0,0 +1,952 @@
+#include "g_mesh.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cglm/cglm.h"
+#include "cgltf.h"
+
+// Bump whenever the layout of cooked meshes, or of the vertices, changes
+#define MESH_COOKED_VERSION 4
+// Past that, half floats are too coarse for UVs: a step is over 1/1024
+#define MESH_PACKED_MAX_UV 2.0f
+// Cut overdraw clusters where the cache misses stay within 5% of the best
+#define MESH_OVERDRAW_THRESHOLD 1.05f
+
+typedef struct cooked_mesh_header_t {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_hash;
+  // Catches a cooked mesh written by a build with other vertex layouts
+  uint32_t vertex_size;
+  uint32_t packed_vertex_size;
+  uint32_t primitive_count;
+  uint32_t meshlet_size;
+} cooked_mesh_header_t;
+
+/// @brief Where the vertices, indices and meshlets of a primitive are, in the
+/// file. The table of primitives follows the header.
+typedef struct cooked_primitive_t {
+  uint64_t vertex_offset;
+  uint64_t vertex_count;
+  uint64_t index_offset;
+  uint64_t index_count;
+  uint64_t meshlet_offset;
+  uint64_t meshlet_count;
+  uint32_t index_size;
+  uint32_t vertex_format;
+} cooked_primitive_t;
+
+static bool G_ReadGLTFAttribute(cgltf_primitive *primitive, const char *name,
+                                vertex_t *vertices, size_t vertex_count,
+                                size_t offset, size_t component_count) {
+  for (cgltf_size a = 0; a < primitive->attributes_count; a++) {
+    cgltf_attribute *attribute = &primitive->attributes[a];
+    if (strcmp(attribute->name, name) != 0) {
+      continue;
+    }
+
+    if (attribute->data->count != vertex_count) {
+      printf("Attribute `%s` doesn't have as many elements as `POSITION`.\n",
+             name);
+      return false;
+    }
+
+    for (size_t v = 0; v < vertex_count; v++) {
+      float *dst = (float *)((char *)&vertices[v] + offset);
+      if (!cgltf_accessor_read_float(attribute->data, v, dst,
+                                     component_count)) {
+        printf("Attribute `%s` can't be read as floats.\n", name);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  printf("All primitives have to have a `%s` attribute.\n", name);
+  return false;
+}
+
+/// @brief Write an index of a decoded primitive, whatever its size.
+static void G_SetIndex(primitive_t *primitive, size_t i, size_t index) {
+  if (primitive->index_size == sizeof(uint16_t)) {
+    ((uint16_t *)primitive->indices)[i] = (uint16_t)index;
+  } else {
+    ((uint32_t *)primitive->indices)[i] = (uint32_t)index;
+  }
+}
+
+static bool G_ExtractGLTFPrimitive(cgltf_primitive *gltf_primitive,
+                                   primitive_t *primitive) {
+  cgltf_accessor *positions = NULL;
+  for (cgltf_size a = 0; a < gltf_primitive->attributes_count; a++) {
+    if (strcmp(gltf_primitive->attributes[a].name, "POSITION") == 0) {
+      positions = gltf_primitive->attributes[a].data;
+    }
+  }
+
+  if (gltf_primitive->type != cgltf_primitive_type_triangles) {
+    printf("All primitives have to be triangles.\n");
+    return false;
+  }
+
+  if (!positions || !gltf_primitive->indices) {
+    printf("All primitives have to be indexed, and have a `POSITION` "
+           "attribute.\n");
+    return false;
+  }
+
+  primitive->vertex_count = positions->count;
+  primitive->vertices = calloc(positions->count, sizeof(vertex_t));
+  primitive->vertex_format = VERTEX_FORMAT_FULL;
+  // As narrow as the vertex count allows, whatever the glTF uses. 8 bits
+  // indices would need VK_EXT_index_type_uint8, so they're 16 bits at least
+  primitive->index_count = gltf_primitive->indices->count;
+  primitive->index_size = primitive->vertex_count <= UINT16_MAX + 1
+                              ? sizeof(uint16_t)
+                              : sizeof(uint32_t);
+  primitive->indices = malloc(primitive->index_size * primitive->index_count);
+  primitive->double_sided =
+      gltf_primitive->material && gltf_primitive->material->double_sided;
+
+  bool extracted =
+      G_ReadGLTFAttribute(gltf_primitive, "POSITION", primitive->vertices,
+                          primitive->vertex_count, offsetof(vertex_t, pos),
+                          3) &&
+      G_ReadGLTFAttribute(gltf_primitive, "NORMAL", primitive->vertices,
+                          primitive->vertex_count, offsetof(vertex_t, norm),
+                          3) &&
+      G_ReadGLTFAttribute(gltf_primitive, "TEXCOORD_0", primitive->vertices,
+                          primitive->vertex_count, offsetof(vertex_t, uv), 2);
+
+  for (size_t i = 0; extracted && i < primitive->index_count; i++) {
+    size_t index = cgltf_accessor_read_index(gltf_primitive->indices, i);
+    if (index >= primitive->vertex_count) {
+      printf("Index %zu is out of the %zu vertices of the primitive.\n", index,
+             primitive->vertex_count);
+      extracted = false;
+    }
+    G_SetIndex(primitive, i, index);
+  }
+
+  if (!extracted) {
+    free(primitive->vertices);
+    free(primitive->indices);
+  }
+
+  return extracted;
+}
+
+bool G_ExtractGLTFMesh(cgltf_data *data, mesh_t *mesh) {
+  memset(mesh, 0, sizeof(mesh_t));
+
+  size_t primitive_count = 0;
+  for (cgltf_size m = 0; m < data->meshes_count; m++) {
+    primitive_count += data->meshes[m].primitives_count;
+  }
+
+  primitive_t *primitives = calloc(primitive_count, sizeof(primitive_t));
+
+  size_t curr_primitive = 0;
+  for (cgltf_size m = 0; m < data->meshes_count; m++) {
+    cgltf_mesh *gltf_mesh = &data->meshes[m];
+
+    for (cgltf_size p = 0; p < gltf_mesh->primitives_count; p++) {
+      if (!G_ExtractGLTFPrimitive(&gltf_mesh->primitives[p],
+                                  &primitives[curr_primitive])) {
+        mesh->primitives = primitives;
+        mesh->primitive_count = curr_primitive;
+        G_DestroyMesh(mesh);
+        return false;
+      }
+      curr_primitive++;
+    }
+  }
+
+  mesh->primitives = primitives;
+  mesh->primitive_count = primitive_count;
+
+  return true;
+}
+
+float G_ComputeACMR(mesh_t *mesh, unsigned cache_size) {
+  size_t misses = 0;
+  size_t triangle_count = 0;
+
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+
+    // FIFO cache: a vertex is still there if less than `cache_size` vertices
+    // were transformed since its own transformation
+    uint32_t *timestamps = calloc(primitive->vertex_count, sizeof(uint32_t));
+    uint32_t time = cache_size + 1;
+    for (size_t i = 0; i < primitive->index_count; i++) {
+      unsigned v = VK_GetIndex(primitive, i);
+      if (time - timestamps[v] > cache_size) {
+        timestamps[v] = time++;
+        misses++;
+      }
+    }
+    free(timestamps);
+
+    triangle_count += primitive->index_count / 3;
+  }
+
+  return triangle_count ? (float)misses / (float)triangle_count : 0.0f;
+}
+
+#define NO_VERTEX UINT32_MAX
+
+/// @brief Tipsify, from "Fast Triangle Reordering for Vertex Locality and
+/// Reduced Overdraw" (Sander et al. 2007). Triangles are emitted in fans
+/// around a vertex, the next one being the vertex that will still be in the
+/// cache once its own fan is emitted.
+static void G_OptimizeVertexCache(const uint32_t *indices, size_t index_count,
+                                  size_t vertex_count, unsigned cache_size,
+                                  uint32_t *optimized) {
+  size_t triangle_count = index_count / 3;
+
+  // Triangles around each vertex
+  uint32_t *offsets = calloc(vertex_count + 1, sizeof(uint32_t));
+  for (size_t i = 0; i < index_count; i++) {
+    offsets[indices[i] + 1]++;
+  }
+  for (size_t v = 0; v < vertex_count; v++) {
+    offsets[v + 1] += offsets[v];
+  }
+
+  uint32_t *adjacency = malloc(sizeof(uint32_t) * index_count);
+  uint32_t *live = malloc(sizeof(uint32_t) * vertex_count);
+  for (size_t v = 0; v < vertex_count; v++) {
+    live[v] = offsets[v + 1] - offsets[v];
+  }
+  for (size_t i = 0; i < index_count; i++) {
+    uint32_t v = indices[i];
+    adjacency[offsets[v + 1] - live[v]] = (uint32_t)(i / 3);
+    live[v]--;
+  }
+  for (size_t v = 0; v < vertex_count; v++) {
+    live[v] = offsets[v + 1] - offsets[v];
+  }
+
+  uint32_t *timestamps = calloc(vertex_count, sizeof(uint32_t));
+  uint32_t *dead_ends = malloc(sizeof(uint32_t) * index_count);
+  uint32_t *candidates = malloc(sizeof(uint32_t) * index_count);
+  bool *emitted = calloc(triangle_count, sizeof(bool));
+
+  uint32_t time = cache_size + 1;
+  size_t dead_end_count = 0;
+  size_t optimized_count = 0;
+  uint32_t cursor = 0;
+  uint32_t fan = vertex_count > 0 ? 0 : NO_VERTEX;
+
+  while (fan != NO_VERTEX) {
+    size_t candidate_count = 0;
+    for (uint32_t a = offsets[fan]; a < offsets[fan + 1]; a++) {
+      uint32_t t = adjacency[a];
+      if (emitted[t]) {
+        continue;
+      }
+      emitted[t] = true;
+
+      for (unsigned c = 0; c < 3; c++) {
+        uint32_t v = indices[t * 3 + c];
+        optimized[optimized_count++] = v;
+        dead_ends[dead_end_count++] = v;
+        candidates[candidate_count++] = v;
+        live[v]--;
+        if (time - timestamps[v] > cache_size) {
+          timestamps[v] = time++;
+        }
+      }
+    }
+
+    // Prefer the oldest vertex that stays in the cache while its fan is
+    // emitted, which can't take more than two new vertices per triangle
+    fan = NO_VERTEX;
+    uint32_t best_priority = 0;
+    for (size_t c = 0; c < candidate_count; c++) {
+      uint32_t v = candidates[c];
+      if (live[v] == 0) {
+        continue;
+      }
+
+      uint32_t priority = 0;
+      if (time - timestamps[v] + 2 * live[v] <= cache_size) {
+        priority = time - timestamps[v];
+      }
+      if (fan == NO_VERTEX || priority > best_priority) {
+        fan = v;
+        best_priority = priority;
+      }
+    }
+
+    // Dead end: back to the most recent vertex with triangles left, or to
+    // the next one in the input order
+    while (fan == NO_VERTEX && dead_end_count > 0) {
+      uint32_t v = dead_ends[--dead_end_count];
+      if (live[v] > 0) {
+        fan = v;
+      }
+    }
+    while (fan == NO_VERTEX && cursor < vertex_count) {
+      if (live[cursor] > 0) {
+        fan = cursor;
+      }
+      cursor++;
+    }
+  }
+
+  free(offsets);
+  free(adjacency);
+  free(live);
+  free(timestamps);
+  free(dead_ends);
+  free(candidates);
+  free(emitted);
+}
+
+/// @brief Number of vertices of a triangle missing from a FIFO cache, which
+/// then holds them.
+static unsigned G_SimulateCache(const uint32_t *triangle, uint32_t *timestamps,
+                                uint32_t *time, unsigned cache_size) {
+  unsigned misses = 0;
+  for (unsigned c = 0; c < 3; c++) {
+    if (*time - timestamps[triangle[c]] > cache_size) {
+      timestamps[triangle[c]] = (*time)++;
+      misses++;
+    }
+  }
+  return misses;
+}
+
+typedef struct overdraw_cluster_t {
+  float sort_key;
+  uint32_t start;
+  uint32_t end;
+} overdraw_cluster_t;
+
+static int G_CompareClusters(const void *a, const void *b) {
+  const overdraw_cluster_t *cluster_a = a;
+  const overdraw_cluster_t *cluster_b = b;
+  if (cluster_a->sort_key != cluster_b->sort_key) {
+    return cluster_a->sort_key > cluster_b->sort_key ? -1 : 1;
+  }
+  return cluster_a->start < cluster_b->start ? -1 : 1;
+}
+
+/// @brief Second half of Tipsify. The cache-optimized triangles are cut into
+/// clusters, which are drawn from the most outward facing to the most inward
+/// facing, so that occluders tend to come first. Clusters are only cut where
+/// it barely costs any cache miss.
+static void G_OptimizeOverdraw(const primitive_t *primitive,
+                               const uint32_t *indices, size_t index_count,
+                               unsigned cache_size, float threshold,
+                               uint32_t *optimized) {
+  size_t triangle_count = index_count / 3;
+  overdraw_cluster_t *clusters =
+      malloc(sizeof(overdraw_cluster_t) * (triangle_count + 1));
+  size_t cluster_count = 0;
+
+  uint32_t *timestamps = calloc(primitive->vertex_count, sizeof(uint32_t));
+  uint32_t time = cache_size + 1;
+
+  // Hard boundaries, where the cache was flushed anyway
+  for (size_t t = 0; t < triangle_count; t++) {
+    if (G_SimulateCache(&indices[t * 3], timestamps, &time, cache_size) == 3 ||
+        t == 0) {
+      clusters[cluster_count++].start = (uint32_t)t;
+    }
+  }
+  clusters[cluster_count].start = (uint32_t)triangle_count;
+
+  // Soft boundaries, wherever the cache misses so far are about as low as in
+  // the whole hard cluster. Starting a cluster flushes the cache
+  size_t hard_cluster_count = cluster_count;
+  overdraw_cluster_t *hard_clusters = clusters;
+  clusters = malloc(sizeof(overdraw_cluster_t) * triangle_count);
+  cluster_count = 0;
+  for (size_t h = 0; h < hard_cluster_count; h++) {
+    uint32_t start = hard_clusters[h].start;
+    uint32_t end = hard_clusters[h + 1].start;
+
+    time += cache_size + 1;
+    unsigned misses = 0;
+    for (uint32_t t = start; t < end; t++) {
+      misses += G_SimulateCache(&indices[t * 3], timestamps, &time, cache_size);
+    }
+    float max_acmr = (float)misses / (float)(end - start) * threshold;
+
+    time += cache_size + 1;
+    misses = 0;
+    uint32_t cluster_start = start;
+    for (uint32_t t = start; t < end; t++) {
+      misses += G_SimulateCache(&indices[t * 3], timestamps, &time, cache_size);
+      if ((float)misses / (float)(t + 1 - cluster_start) <= max_acmr ||
+          t + 1 == end) {
+        clusters[cluster_count].start = cluster_start;
+        clusters[cluster_count].end = t + 1;
+        cluster_count++;
+
+        time += cache_size + 1;
+        misses = 0;
+        cluster_start = t + 1;
+      }
+    }
+  }
+  free(hard_clusters);
+  free(timestamps);
+
+  // How much each cluster faces away from the center of the primitive
+  vec3 center = {0.0f, 0.0f, 0.0f};
+  for (size_t i = 0; i < index_count; i++) {
+    glm_vec3_add(center, (float *)VK_GetVertexPosition(primitive, indices[i]),
+                 center);
+  }
+  glm_vec3_scale(center, 1.0f / (float)index_count, center);
+
+  for (size_t c = 0; c < cluster_count; c++) {
+    vec3 centroid = {0.0f, 0.0f, 0.0f};
+    vec3 normal = {0.0f, 0.0f, 0.0f};
+    for (uint32_t t = clusters[c].start; t < clusters[c].end; t++) {
+      float *p0 = (float *)VK_GetVertexPosition(primitive, indices[t * 3]);
+      float *p1 =
+          (float *)VK_GetVertexPosition(primitive, indices[t * 3 + 1]);
+      float *p2 =
+          (float *)VK_GetVertexPosition(primitive, indices[t * 3 + 2]);
+
+      vec3 e1, e2, n;
+      glm_vec3_sub(p1, p0, e1);
+      glm_vec3_sub(p2, p0, e2);
+      glm_vec3_cross(e1, e2, n);
+      glm_vec3_add(normal, n, normal);
+
+      glm_vec3_add(centroid, p0, centroid);
+      glm_vec3_add(centroid, p1, centroid);
+      glm_vec3_add(centroid, p2, centroid);
+    }
+
+    unsigned count = clusters[c].end - clusters[c].start;
+    glm_vec3_scale(centroid, 1.0f / (float)(count * 3), centroid);
+    glm_vec3_sub(centroid, center, centroid);
+    glm_vec3_normalize(normal);
+    clusters[c].sort_key = glm_vec3_dot(centroid, normal);
+  }
+
+  qsort(clusters, cluster_count, sizeof(overdraw_cluster_t),
+        G_CompareClusters);
+
+  size_t optimized_count = 0;
+  for (size_t c = 0; c < cluster_count; c++) {
+    size_t count = (clusters[c].end - clusters[c].start) * 3;
+    memcpy(&optimized[optimized_count], &indices[clusters[c].start * 3],
+           sizeof(uint32_t) * count);
+    optimized_count += count;
+  }
+
+  free(clusters);
+}
+
+/// @brief Renumber vertices in the order they are first used, so that they
+/// are fetched linearly. Vertices used by no triangle are dropped.
+static void G_OptimizeVertexFetch(primitive_t *primitive, uint32_t *indices) {
+  size_t vertex_size = VK_GetVertexSize(primitive->vertex_format);
+  char *old_vertices = primitive->vertices;
+  char *vertices = malloc(vertex_size * primitive->vertex_count);
+
+  uint32_t *remap = malloc(sizeof(uint32_t) * primitive->vertex_count);
+  memset(remap, 0xFF, sizeof(uint32_t) * primitive->vertex_count);
+
+  uint32_t vertex_count = 0;
+  for (size_t i = 0; i < primitive->index_count; i++) {
+    uint32_t v = indices[i];
+    if (remap[v] == NO_VERTEX) {
+      remap[v] = vertex_count;
+      memcpy(vertices + vertex_count * vertex_size,
+             old_vertices + v * vertex_size, vertex_size);
+      vertex_count++;
+    }
+    indices[i] = remap[v];
+  }
+
+  free(remap);
+  free(old_vertices);
+  primitive->vertices = vertices;
+  primitive->vertex_count = vertex_count;
+}
+
+bool G_OptimizeMesh(mesh_t *mesh, bool overdraw) {
+  if (mesh->file.data) {
+    printf("Cooked meshes are read-only, they can't be optimized.\n");
+    return false;
+  }
+
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+    size_t index_count = primitive->index_count - primitive->index_count % 3;
+
+    // Triangles move around, meshlets have to be built again
+    free(primitive->meshlets);
+    primitive->meshlets = NULL;
+    primitive->meshlet_count = 0;
+
+    uint32_t *indices = malloc(sizeof(uint32_t) * index_count);
+    uint32_t *optimized = malloc(sizeof(uint32_t) * index_count);
+    for (size_t i = 0; i < index_count; i++) {
+      indices[i] = VK_GetIndex(primitive, i);
+    }
+
+    G_OptimizeVertexCache(indices, index_count, primitive->vertex_count,
+                          MESH_VERTEX_CACHE_SIZE, optimized);
+    if (overdraw && index_count > 0) {
+      G_OptimizeOverdraw(primitive, optimized, index_count,
+                         MESH_VERTEX_CACHE_SIZE, MESH_OVERDRAW_THRESHOLD,
+                         indices);
+    } else {
+      memcpy(indices, optimized, sizeof(uint32_t) * index_count);
+    }
+
+    primitive->index_count = index_count;
+    G_OptimizeVertexFetch(primitive, indices);
+    for (size_t i = 0; i < index_count; i++) {
+      G_SetIndex(primitive, i, indices[i]);
+    }
+
+    free(indices);
+    free(optimized);
+  }
+
+  return true;
+}
+
+/// @brief Bounding box, sphere and normal cone of the triangles of a
+/// meshlet. Cones are from "Optimizing the Graphics Pipeline with Compute"
+/// (Wihlidal 2016), around the average of the normals.
+static void G_ComputeMeshletBounds(const primitive_t *primitive,
+                                   meshlet_t *meshlet) {
+  size_t first = meshlet->first_index;
+  size_t end = first + meshlet->index_count;
+
+  vec3 min, max;
+  glm_vec3_copy((float *)VK_GetVertexPosition(
+                    primitive, VK_GetIndex(primitive, first)),
+                min);
+  glm_vec3_copy(min, max);
+  for (size_t i = first; i < end; i++) {
+    float *pos =
+        (float *)VK_GetVertexPosition(primitive, VK_GetIndex(primitive, i));
+    glm_vec3_minv(min, pos, min);
+    glm_vec3_maxv(max, pos, max);
+  }
+
+  glm_vec3_center(min, max, meshlet->center);
+  glm_vec3_sub(max, meshlet->center, meshlet->extents);
+
+  float radius2 = 0.0f;
+  for (size_t i = first; i < end; i++) {
+    float *pos =
+        (float *)VK_GetVertexPosition(primitive, VK_GetIndex(primitive, i));
+    radius2 = glm_max(radius2, glm_vec3_distance2(meshlet->center, pos));
+  }
+  meshlet->radius = sqrtf(radius2);
+
+  // Normals of the triangles, in the winding glTF considers front facing.
+  // Degenerate ones face nowhere and are left out
+  vec3 normals[MESH_MESHLET_MAX_TRIANGLES];
+  unsigned normal_count = 0;
+  vec3 axis = {0.0f, 0.0f, 0.0f};
+  for (size_t i = first; i + 2 < end; i += 3) {
+    float *a =
+        (float *)VK_GetVertexPosition(primitive, VK_GetIndex(primitive, i));
+    float *b = (float *)VK_GetVertexPosition(primitive,
+                                             VK_GetIndex(primitive, i + 1));
+    float *c = (float *)VK_GetVertexPosition(primitive,
+                                             VK_GetIndex(primitive, i + 2));
+
+    vec3 ab, ac;
+    glm_vec3_sub(b, a, ab);
+    glm_vec3_sub(c, a, ac);
+    glm_vec3_cross(ab, ac, normals[normal_count]);
+    if (glm_vec3_norm2(normals[normal_count]) == 0.0f) {
+      continue;
+    }
+
+    glm_vec3_normalize(normals[normal_count]);
+    glm_vec3_add(axis, normals[normal_count], axis);
+    normal_count++;
+  }
+
+  // Whatever the cone, a meshlet seen from both sides always faces the
+  // camera
+  meshlet->cone_cutoff = 1.0f;
+  glm_vec3_zero(meshlet->cone_axis);
+  if (primitive->double_sided || normal_count == 0 ||
+      glm_vec3_norm2(axis) == 0.0f) {
+    return;
+  }
+
+  glm_vec3_normalize(axis);
+  float min_dot = 1.0f;
+  for (unsigned n = 0; n < normal_count; n++) {
+    min_dot = glm_min(min_dot, glm_vec3_dot(axis, normals[n]));
+  }
+
+  // Past 90 degrees, some triangle faces the camera from any direction
+  if (min_dot > 0.0f) {
+    glm_vec3_copy(axis, meshlet->cone_axis);
+    meshlet->cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+  }
+}
+
+bool G_BuildMeshlets(mesh_t *mesh) {
+  if (mesh->file.data) {
+    printf("Cooked meshes are read-only, meshlets can't be built.\n");
+    return false;
+  }
+
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+    size_t triangle_count = primitive->index_count / 3;
+
+    free(primitive->meshlets);
+    primitive->meshlets = NULL;
+    primitive->meshlet_count = 0;
+    if (triangle_count == 0) {
+      continue;
+    }
+
+    // A meshlet is only over once it can't take 3 more vertices, so all but
+    // the last have at least a third of the vertices as triangles
+    meshlet_t *meshlets = malloc(
+        sizeof(meshlet_t) *
+        (triangle_count / (MESH_MESHLET_MAX_VERTICES / 3) + 1));
+    size_t meshlet_count = 0;
+
+    // Meshlet in which each vertex was last counted
+    uint32_t *stamps = malloc(sizeof(uint32_t) * primitive->vertex_count);
+    memset(stamps, 0xFF, sizeof(uint32_t) * primitive->vertex_count);
+
+    meshlet_t meshlet = {0};
+    for (size_t t = 0; t < triangle_count; t++) {
+      unsigned new_vertices = 0;
+      for (unsigned k = 0; k < 3; k++) {
+        unsigned v = VK_GetIndex(primitive, t * 3 + k);
+        new_vertices += stamps[v] != meshlet_count;
+      }
+
+      // Triangles are taken in order, the meshlet is over when the next one
+      // doesn't fit
+      if (meshlet.index_count == MESH_MESHLET_MAX_TRIANGLES * 3 ||
+          meshlet.vertex_count + new_vertices > MESH_MESHLET_MAX_VERTICES) {
+        G_ComputeMeshletBounds(primitive, &meshlet);
+        meshlets[meshlet_count++] = meshlet;
+
+        meshlet = (meshlet_t){.first_index = t * 3};
+      }
+
+      for (unsigned k = 0; k < 3; k++) {
+        unsigned v = VK_GetIndex(primitive, t * 3 + k);
+        if (stamps[v] != meshlet_count) {
+          stamps[v] = meshlet_count;
+          meshlet.vertex_count++;
+        }
+      }
+      meshlet.index_count += 3;
+    }
+
+    G_ComputeMeshletBounds(primitive, &meshlet);
+    meshlets[meshlet_count++] = meshlet;
+
+    free(stamps);
+    primitive->meshlets = meshlets;
+    primitive->meshlet_count = meshlet_count;
+  }
+
+  return true;
+}
+
+static int16_t G_PackSnorm16(float v) {
+  return (int16_t)lrintf(fminf(fmaxf(v, -1.0f), 1.0f) * 32767.0f);
+}
+
+/// @brief Octahedral encoding of a unit vector: projected on the octahedron,
+/// whose lower half is folded over the upper one.
+static void G_PackNormal(const float n[3], int16_t packed[2]) {
+  float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+  if (l1 == 0.0f) {
+    packed[0] = 0;
+    packed[1] = 0;
+    return;
+  }
+
+  float x = n[0] / l1;
+  float y = n[1] / l1;
+  if (n[2] < 0.0f) {
+    float folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = folded_x;
+    y = folded_y;
+  }
+
+  packed[0] = G_PackSnorm16(x);
+  packed[1] = G_PackSnorm16(y);
+}
+
+/// @brief IEEE 754 half float, rounded to nearest even.
+static uint16_t G_PackHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+
+  uint16_t sign = (x >> 16) & 0x8000;
+  uint32_t abs = x & 0x7FFFFFFF;
+
+  if (abs >= 0x47800000) {
+    // Too big, infinity or NaN
+    return sign | (abs > 0x7F800000 ? 0x7E00 : 0x7C00);
+  }
+
+  if (abs < 0x38800000) {
+    // Denormal, in units of 2^-24
+    float denormal;
+    memcpy(&denormal, &abs, sizeof(denormal));
+    return sign | (uint16_t)lrintf(denormal * 16777216.0f);
+  }
+
+  // Rebias the exponent, and round the 13 dropped bits of mantissa
+  abs += 0xC8000FFF + ((abs >> 13) & 1);
+  return sign | (uint16_t)(abs >> 13);
+}
+
+bool G_PackMesh(mesh_t *mesh) {
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+    vertex_t *vertices = primitive->vertices;
+
+    if (primitive->vertex_format != VERTEX_FORMAT_FULL) {
+      return false;
+    }
+
+    for (size_t v = 0; v < primitive->vertex_count; v++) {
+      if (fabsf(vertices[v].uv[0]) > MESH_PACKED_MAX_UV ||
+          fabsf(vertices[v].uv[1]) > MESH_PACKED_MAX_UV) {
+        return false;
+      }
+    }
+  }
+
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+    vertex_t *vertices = primitive->vertices;
+
+    packed_vertex_t *packed =
+        malloc(sizeof(packed_vertex_t) * primitive->vertex_count);
+    for (size_t v = 0; v < primitive->vertex_count; v++) {
+      memcpy(packed[v].pos, vertices[v].pos, sizeof(packed[v].pos));
+      G_PackNormal(vertices[v].norm, packed[v].norm);
+      packed[v].uv[0] = G_PackHalf(vertices[v].uv[0]);
+      packed[v].uv[1] = G_PackHalf(vertices[v].uv[1]);
+    }
+
+    free(primitive->vertices);
+    primitive->vertices = packed;
+    primitive->vertex_format = VERTEX_FORMAT_PACKED;
+  }
+
+  return true;
+}
+
+static void G_InitCookedHeader(cooked_mesh_header_t *header,
+                               uint64_t source_hash) {
+  memset(header, 0, sizeof(cooked_mesh_header_t));
+  memcpy(header->magic, "MMSH", 4);
+  header->version = MESH_COOKED_VERSION;
+  header->source_hash = source_hash;
+  header->vertex_size = sizeof(vertex_t);
+  header->packed_vertex_size = sizeof(packed_vertex_t);
+  header->meshlet_size = sizeof(meshlet_t);
+}
+
+typedef struct cooked_mesh_write_t {
+  cooked_mesh_header_t *header;
+  cooked_primitive_t *table;
+  mesh_t *mesh;
+} cooked_mesh_write_t;
+
+static bool G_WriteCookedMesh(FILE *f, void *data) {
+  cooked_mesh_write_t *write = data;
+  mesh_t *mesh = write->mesh;
+
+  if (fwrite(write->header, sizeof(cooked_mesh_header_t), 1, f) != 1 ||
+      !G_WriteFileSection(f, sizeof(cooked_mesh_header_t), write->table,
+                          sizeof(cooked_primitive_t) * mesh->primitive_count)) {
+    return false;
+  }
+
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+    if (!G_WriteFileSection(f, write->table[p].vertex_offset,
+                            primitive->vertices,
+                            VK_GetVertexSize(primitive->vertex_format) *
+                                primitive->vertex_count) ||
+        !G_WriteFileSection(f, write->table[p].index_offset,
+                            primitive->indices,
+                            primitive->index_size * primitive->index_count) ||
+        !G_WriteFileSection(f, write->table[p].meshlet_offset,
+                            primitive->meshlets,
+                            sizeof(meshlet_t) * primitive->meshlet_count)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool G_SaveCookedMesh(mesh_t *mesh, const char *path, uint64_t source_hash) {
+  cooked_mesh_header_t header;
+  G_InitCookedHeader(&header, source_hash);
+  header.primitive_count = mesh->primitive_count;
+
+  // Vertices, indices then meshlets of each primitive, one after the other
+  cooked_primitive_t *table =
+      calloc(mesh->primitive_count, sizeof(cooked_primitive_t));
+  uint64_t offset = sizeof(cooked_mesh_header_t) +
+                    sizeof(cooked_primitive_t) * mesh->primitive_count;
+  for (unsigned p = 0; p < mesh->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+
+    table[p].vertex_offset = G_AlignFileOffset(offset);
+    table[p].vertex_count = primitive->vertex_count;
+    table[p].vertex_format = primitive->vertex_format;
+    offset = table[p].vertex_offset +
+             VK_GetVertexSize(primitive->vertex_format) * table[p].vertex_count;
+
+    table[p].index_offset = G_AlignFileOffset(offset);
+    table[p].index_count = primitive->index_count;
+    table[p].index_size = primitive->index_size;
+    offset = table[p].index_offset + table[p].index_size * table[p].index_count;
+
+    table[p].meshlet_offset = G_AlignFileOffset(offset);
+    table[p].meshlet_count = primitive->meshlet_count;
+    offset =
+        table[p].meshlet_offset + sizeof(meshlet_t) * table[p].meshlet_count;
+  }
+
+  cooked_mesh_write_t write = {
+      .header = &header,
+      .table = table,
+      .mesh = mesh,
+  };
+  bool written = G_WriteFileAtomic(path, G_WriteCookedMesh, &write);
+
+  free(table);
+  return written;
+}
+
+bool G_LoadCookedMesh(const char *path, uint64_t source_hash, mesh_t *mesh) {
+  memset(mesh, 0, sizeof(mesh_t));
+
+  mapped_file_t file;
+  if (!G_MapFile(path, &file)) {
+    return false;
+  }
+
+  cooked_mesh_header_t expected;
+  G_InitCookedHeader(&expected, source_hash);
+
+  cooked_mesh_header_t *header = file.data;
+  if (file.size < sizeof(cooked_mesh_header_t) ||
+      memcmp(header->magic, expected.magic, 4) != 0 ||
+      header->version != expected.version ||
+      header->vertex_size != expected.vertex_size ||
+      header->packed_vertex_size != expected.packed_vertex_size ||
+      header->meshlet_size != expected.meshlet_size) {
+    printf("Cooked mesh `%s` is from another version, ignoring it.\n", path);
+    G_UnmapFile(&file);
+    return false;
+  }
+
+  if (header->source_hash != source_hash) {
+    printf("Cooked mesh `%s` is out of date, ignoring it.\n", path);
+    G_UnmapFile(&file);
+    return false;
+  }
+
+  char *base = file.data;
+  cooked_primitive_t *table =
+      (cooked_primitive_t *)(base + sizeof(cooked_mesh_header_t));
+  uint64_t table_end = sizeof(cooked_mesh_header_t) +
+                       (uint64_t)sizeof(cooked_primitive_t) *
+                           header->primitive_count;
+  bool valid = table_end <= file.size;
+  for (unsigned p = 0; valid && p < header->primitive_count; p++) {
+    if (table[p].vertex_format >= VERTEX_FORMAT_COUNT) {
+      valid = false;
+      break;
+    }
+
+    uint64_t vertices_end =
+        table[p].vertex_offset + VK_GetVertexSize(table[p].vertex_format) *
+                                     table[p].vertex_count;
+    uint64_t indices_end =
+        table[p].index_offset + table[p].index_size * table[p].index_count;
+    uint64_t meshlets_end =
+        table[p].meshlet_offset + sizeof(meshlet_t) * table[p].meshlet_count;
+    valid = vertices_end <= file.size && indices_end <= file.size &&
+            meshlets_end <= file.size &&
+            (table[p].index_size == sizeof(uint16_t) ||
+             table[p].index_size == sizeof(uint32_t)) &&
+            table[p].vertex_offset % FILE_SECTION_ALIGN == 0 &&
+            table[p].index_offset % FILE_SECTION_ALIGN == 0 &&
+            table[p].meshlet_offset % FILE_SECTION_ALIGN == 0;
+
+    // Meshlets are drawn as they are, they can't go past the indices
+    meshlet_t *meshlets = (meshlet_t *)(base + table[p].meshlet_offset);
+    for (uint64_t m = 0; valid && m < table[p].meshlet_count; m++) {
+      valid = (uint64_t)meshlets[m].first_index + meshlets[m].index_count <=
+              table[p].index_count;
+    }
+  }
+
+  if (!valid) {
+    printf("Cooked mesh `%s` is corrupted, ignoring it.\n", path);
+    G_UnmapFile(&file);
+    return false;
+  }
+
+  mesh->primitives = calloc(header->primitive_count, sizeof(primitive_t));
+  mesh->primitive_count = header->primitive_count;
+  for (unsigned p = 0; p < header->primitive_count; p++) {
+    primitive_t *primitive = &mesh->primitives[p];
+    primitive->vertices = base + table[p].vertex_offset;
+    primitive->vertex_count = table[p].vertex_count;
+    primitive->vertex_format = table[p].vertex_format;
+    primitive->indices = base + table[p].index_offset;
+    primitive->index_count = table[p].index_count;
+    primitive->index_size = table[p].index_size;
+    primitive->meshlets = (meshlet_t *)(base + table[p].meshlet_offset);
+    primitive->meshlet_count = table[p].meshlet_count;
+  }
+  mesh->file = file;
+
+  return true;
+}
+
+void G_DestroyMesh(mesh_t *mesh) {
+  if (mesh->file.data) {
+    G_UnmapFile(&mesh->file);
+  } else {
+    for (unsigned p = 0; p < mesh->primitive_count; p++) {
+      free(mesh->primitives[p].vertices);
+      free(mesh->primitives[p].indices);
+      free(mesh->primitives[p].meshlets);
+    }
+  }
+  free(mesh->primitives);
+
+  mesh->primitives = NULL;
+  mesh->primitive_count = 0;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "g_file.h"
+#include "vk/vk.h"
+
+typedef struct cgltf_data cgltf_data;
+
+/// Size of the post-transform vertex cache meshes are optimized for. Actual
+/// GPUs don't have a FIFO of vertices anymore, but it's a good enough model.
+#define MESH_VERTEX_CACHE_SIZE 16
+
+/// Limits of a meshlet, the sizes mesh shaders usually work best with. 124
+/// triangles keep their 8 bits indices within 372 bytes, leaving room for a
+/// header in 384.
+#define MESH_MESHLET_MAX_VERTICES 64
+#define MESH_MESHLET_MAX_TRIANGLES 124
+
+/// @brief Geometry of a model, ready to be uploaded. Either decoded from a
+/// glTF file, or mapped from its cooked version, in which case `primitives`
+/// point into `file`.
+typedef struct mesh_t {
+  primitive_t *primitives;
+  unsigned primitive_count;
+
+  mapped_file_t file;
+} mesh_t;
+
+/// @brief Convert the triangles of a parsed glTF file to primitives. Every
+/// attribute is copied into interleaved vertices, and indices are stored on
+/// 16 bits whenever the primitive has few enough vertices.
+/// @param data glTF file, with its buffers loaded.
+/// @param mesh Filled with the primitives, in the order of the glTF meshes.
+/// @return
+bool G_ExtractGLTFMesh(cgltf_data *data, mesh_t *mesh);
+
+/// @brief Reorder the triangles of a decoded mesh to reuse transformed
+/// vertices as much as possible, then its vertices in the order they are
+/// fetched. Vertices used by no triangle are dropped.
+/// @param overdraw Also sort clusters of triangles to reduce overdraw, at the
+/// cost of a few cache misses.
+/// @return false if the mesh is mapped from a cooked file.
+bool G_OptimizeMesh(mesh_t *mesh, bool overdraw);
+
+/// @brief Cut the triangles of each primitive of a decoded mesh into
+/// meshlets, in the order of its indices. Best after `G_OptimizeMesh`, which
+/// keeps neighbouring triangles together, and drops the meshlets built
+/// before it.
+/// @return false if the mesh is mapped from a cooked file.
+bool G_BuildMeshlets(mesh_t *mesh);
+
+/// @brief Average cache miss ratio: vertices transformed per triangle, with a
+/// FIFO cache of `cache_size` vertices. From 3 down to about 0.5.
+float G_ComputeACMR(mesh_t *mesh, unsigned cache_size);
+
+/// @brief Quantize the vertices of a decoded mesh to `packed_vertex_t`.
+/// @return false if the mesh doesn't fit, in which case it's left untouched.
+/// UVs far from [0, 1] lose too much as half floats.
+bool G_PackMesh(mesh_t *mesh);
+
+/// @brief Write the vertices, indices and meshlets of a mesh as they are sent
+/// to the GPU, to be mapped back by `G_LoadCookedMesh`.
+/// @param path Path of the cooked mesh, usually the one of the model + `.mesh`.
+/// @param source_hash Hash of the asset the mesh was extracted from.
+/// @return
+bool G_SaveCookedMesh(mesh_t *mesh, const char *path, uint64_t source_hash);
+
+/// @brief Memory-map a mesh written by `G_SaveCookedMesh`. Nothing is copied
+/// nor converted.
+/// @param path Path of the cooked mesh.
+/// @param source_hash Hash of the asset the mesh is expected to come from.
+/// @param mesh Filled with primitives pointing into the mapping.
+/// @return false if the file doesn't exist, or is outdated or invalid.
+bool G_LoadCookedMesh(const char *path, uint64_t source_hash, mesh_t *mesh);
+
+void G_DestroyMesh(mesh_t *mesh);
@@ -0,0 +1,273 @@
+#include "g_spatial.h"
+
+#include "cglm/cglm.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SPATIAL_BUCKET_COUNT 4096
+
+/// @brief Copy of an entry, stored in its bucket so queries only walk
+/// contiguous memory.
+typedef struct spatial_item_t {
+  vec3 position;
+  float radius;
+  int cell[3];
+  unsigned id;
+} spatial_item_t;
+
+typedef struct spatial_bucket_t {
+  spatial_item_t *items;
+  unsigned count;
+  unsigned capacity;
+} spatial_bucket_t;
+
+typedef struct spatial_entry_t {
+  unsigned bucket;
+  unsigned slot;
+  bool present;
+} spatial_entry_t;
+
+struct spatial_grid_t {
+  float cell_size;
+  // Largest radius ever inserted, to know how far to look around a cell
+  float max_radius;
+
+  spatial_bucket_t buckets[SPATIAL_BUCKET_COUNT];
+
+  spatial_entry_t *entries;
+  unsigned capacity;
+};
+
+/// @brief Called for each item of the cells overlapping the searched range.
+typedef bool (*spatial_visit_t)(void *data, spatial_item_t *item);
+
+static void G_GetCell(spatial_grid_t *grid, vec3 position, int cell[3]) {
+  for (int axis = 0; axis < 3; axis++) {
+    cell[axis] = (int)floorf(position[axis] / grid->cell_size);
+  }
+}
+
+static unsigned G_HashCell(int cell[3]) {
+  unsigned hash = (unsigned)cell[0] * 73856093u ^
+                  (unsigned)cell[1] * 19349663u ^
+                  (unsigned)cell[2] * 83492791u;
+  return hash % SPATIAL_BUCKET_COUNT;
+}
+
+spatial_grid_t *G_CreateSpatialGrid(float cell_size, unsigned capacity) {
+  spatial_grid_t *grid = calloc(1, sizeof(spatial_grid_t));
+  grid->cell_size = cell_size;
+  grid->entries = calloc(capacity, sizeof(spatial_entry_t));
+  grid->capacity = capacity;
+
+  return grid;
+}
+
+void G_DestroySpatialGrid(spatial_grid_t *grid) {
+  for (unsigned b = 0; b < SPATIAL_BUCKET_COUNT; b++) {
+    free(grid->buckets[b].items);
+  }
+  free(grid->entries);
+  free(grid);
+}
+
+void G_RemoveSpatialEntry(spatial_grid_t *grid, unsigned id) {
+  if (id >= grid->capacity || !grid->entries[id].present) {
+    return;
+  }
+
+  spatial_entry_t *entry = &grid->entries[id];
+  spatial_bucket_t *bucket = &grid->buckets[entry->bucket];
+
+  // Swap with the last item of the bucket
+  bucket->count--;
+  if (entry->slot != bucket->count) {
+    bucket->items[entry->slot] = bucket->items[bucket->count];
+    grid->entries[bucket->items[entry->slot].id].slot = entry->slot;
+  }
+
+  entry->present = false;
+}
+
+void G_UpdateSpatialEntry(spatial_grid_t *grid, unsigned id, vec3 position,
+                          float radius) {
+  if (id >= grid->capacity) {
+    printf("Spatial entry %u is out of the grid capacity (%u).\n", id,
+           grid->capacity);
+    return;
+  }
+
+  if (radius > grid->max_radius) {
+    grid->max_radius = radius;
+  }
+
+  int cell[3];
+  G_GetCell(grid, position, cell);
+
+  spatial_entry_t *entry = &grid->entries[id];
+  if (entry->present) {
+    spatial_item_t *item = &grid->buckets[entry->bucket].items[entry->slot];
+    if (item->cell[0] == cell[0] && item->cell[1] == cell[1] &&
+        item->cell[2] == cell[2]) {
+      glm_vec3_copy(position, item->position);
+      item->radius = radius;
+      return;
+    }
+
+    G_RemoveSpatialEntry(grid, id);
+  }
+
+  unsigned b = G_HashCell(cell);
+  spatial_bucket_t *bucket = &grid->buckets[b];
+  if (bucket->count == bucket->capacity) {
+    bucket->capacity = bucket->capacity * 2 + 4;
+    bucket->items =
+        realloc(bucket->items, sizeof(spatial_item_t) * bucket->capacity);
+  }
+
+  spatial_item_t *item = &bucket->items[bucket->count];
+  glm_vec3_copy(position, item->position);
+  item->radius = radius;
+  item->cell[0] = cell[0];
+  item->cell[1] = cell[1];
+  item->cell[2] = cell[2];
+  item->id = id;
+
+  entry->bucket = b;
+  entry->slot = bucket->count;
+  entry->present = true;
+
+  bucket->count++;
+}
+
+/// @brief Visit the items of every cell touching the box `center` +-
+/// `reach`, until `visit` returns false.
+static void G_VisitSpatialRange(spatial_grid_t *grid, vec3 center, float reach,
+                                spatial_visit_t visit, void *data) {
+  int min[3], max[3];
+  G_GetCell(grid, (vec3){center[0] - reach, center[1] - reach,
+                         center[2] - reach},
+            min);
+  G_GetCell(grid, (vec3){center[0] + reach, center[1] + reach,
+                         center[2] + reach},
+            max);
+
+  // A huge range would hash the same buckets over and over, walking all of
+  // them once is cheaper
+  float cell_count = (float)(max[0] - min[0] + 1) *
+                     (float)(max[1] - min[1] + 1) *
+                     (float)(max[2] - min[2] + 1);
+  if (cell_count >= SPATIAL_BUCKET_COUNT) {
+    for (unsigned b = 0; b < SPATIAL_BUCKET_COUNT; b++) {
+      spatial_bucket_t *bucket = &grid->buckets[b];
+      for (unsigned i = 0; i < bucket->count; i++) {
+        if (!visit(data, &bucket->items[i])) {
+          return;
+        }
+      }
+    }
+    return;
+  }
+
+  int cell[3];
+  for (cell[0] = min[0]; cell[0] <= max[0]; cell[0]++) {
+    for (cell[1] = min[1]; cell[1] <= max[1]; cell[1]++) {
+      for (cell[2] = min[2]; cell[2] <= max[2]; cell[2]++) {
+        spatial_bucket_t *bucket = &grid->buckets[G_HashCell(cell)];
+
+        for (unsigned i = 0; i < bucket->count; i++) {
+          spatial_item_t *item = &bucket->items[i];
+          // Other cells share the bucket, they are visited on their own
+          if (item->cell[0] != cell[0] || item->cell[1] != cell[1] ||
+              item->cell[2] != cell[2]) {
+            continue;
+          }
+
+          if (!visit(data, item)) {
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
+static bool G_Overlap(vec3 a, float radius_a, vec3 b, float radius_b) {
+  float reach = radius_a + radius_b;
+  return glm_vec3_distance2(a, b) <= reach * reach;
+}
+
+typedef struct spatial_query_t {
+  vec3 center;
+  float radius;
+  unsigned *ids;
+  unsigned max_ids;
+  unsigned count;
+} spatial_query_t;
+
+static bool G_VisitQuery(void *data, spatial_item_t *item) {
+  spatial_query_t *query = data;
+
+  if (G_Overlap(query->center, query->radius, item->position, item->radius)) {
+    query->ids[query->count++] = item->id;
+  }
+
+  return query->count < query->max_ids;
+}
+
+unsigned G_QuerySpatialGrid(spatial_grid_t *grid, vec3 center, float radius,
+                            unsigned *ids, unsigned max_ids) {
+  if (max_ids == 0) {
+    return 0;
+  }
+
+  spatial_query_t query = {
+      .center = {center[0], center[1], center[2]},
+      .radius = radius,
+      .ids = ids,
+      .max_ids = max_ids,
+  };
+
+  G_VisitSpatialRange(grid, center, radius + grid->max_radius, G_VisitQuery,
+                      &query);
+
+  return query.count;
+}
+
+typedef struct spatial_pairs_t {
+  spatial_item_t *item;
+  spatial_pair_func_t func;
+  void *data;
+} spatial_pairs_t;
+
+static bool G_VisitPair(void *data, spatial_item_t *other) {
+  spatial_pairs_t *pairs = data;
+  spatial_item_t *item = pairs->item;
+
+  if (other->id > item->id && G_Overlap(item->position, item->radius,
+                                        other->position, other->radius)) {
+    pairs->func(pairs->data, item->id, other->id);
+  }
+
+  return true;
+}
+
+void G_ForEachSpatialPair(spatial_grid_t *grid, spatial_pair_func_t func,
+                          void *data) {
+  spatial_pairs_t pairs = {
+      .func = func,
+      .data = data,
+  };
+
+  for (unsigned b = 0; b < SPATIAL_BUCKET_COUNT; b++) {
+    spatial_bucket_t *bucket = &grid->buckets[b];
+    for (unsigned i = 0; i < bucket->count; i++) {
+      pairs.item = &bucket->items[i];
+      G_VisitSpatialRange(grid, pairs.item->position,
+                          pairs.item->radius + grid->max_radius, G_VisitPair,
+                          &pairs);
+    }
+  }
+}
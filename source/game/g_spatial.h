@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "cglm/types.h"
+
+/// @brief Spatial hash of spheres, to find what's around something without
+/// testing everything. Space is cut in cubic cells, hashed into buckets.
+/// Entries are identified by an index, typically the one of an actor.
+typedef struct spatial_grid_t spatial_grid_t;
+
+/// @brief Called for each overlapping pair, `a < b`.
+typedef void (*spatial_pair_func_t)(void *data, unsigned a, unsigned b);
+
+/// @brief Create an empty spatial grid.
+/// @param cell_size Size of a cell. Works best around the diameter of the
+/// usual entries, and the radius of the usual queries.
+/// @param capacity Entries are identified by an index in [0, capacity).
+/// @return
+spatial_grid_t *G_CreateSpatialGrid(float cell_size, unsigned capacity);
+
+void G_DestroySpatialGrid(spatial_grid_t *grid);
+
+/// @brief Insert an entry, or move it if it's already there. Cheap when it
+/// stays in the same cell.
+void G_UpdateSpatialEntry(spatial_grid_t *grid, unsigned id, vec3 position,
+                          float radius);
+
+void G_RemoveSpatialEntry(spatial_grid_t *grid, unsigned id);
+
+/// @brief Find the entries overlapping a sphere.
+/// @param ids Filled with the indices of the entries found.
+/// @param max_ids Size of `ids`, the search stops once it's full.
+/// @return Number of entries found.
+unsigned G_QuerySpatialGrid(spatial_grid_t *grid, vec3 center, float radius,
+                            unsigned *ids, unsigned max_ids);
+
+/// @brief Enumerate every pair of overlapping entries, once. `func` must not
+/// modify the grid.
+void G_ForEachSpatialPair(spatial_grid_t *grid, spatial_pair_func_t func,
+                          void *data);
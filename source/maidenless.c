@@ -7,6 +7,9 @@
 
 #define VERSION "0.1"
 
+// Time given to the scene loader each frame, the rest is for drawing
+#define LOADING_BUDGET_MS 4.0f
+
 int main(int argc, char **argv) {
   printf("Creating client using Maidenless Engine `%s`.\n", VERSION);
 
@@ -46,15 +49,30 @@ int main(int argc, char **argv) {
     CL_DestroyClient(client);
     return -1;
   }
-  CL_PopLoadingScreen(client);
 
   // Game state is here, so the game be paused while still drawing
-  game_state_t game_state;
+  game_state_t game_state = {0};
+  bool loading = true;
+  bool failed = false;
 
+  // The scene streams in while the window keeps being updated and drawn. The
+  // game only ticks once it's all there
   while ((CL_GetClientState(client) != CLIENT_DESTROYING) &&
          CL_GetClientState(client) != CLIENT_QUITTING) {
     CL_UpdateClient(client);
-    if (CL_GetClientState(client) != CLIENT_PAUSED) {
+    if (loading) {
+      scene_status_t status =
+          G_StreamCurrentScene(client, game, LOADING_BUDGET_MS);
+      if (status == SCENE_FAILED) {
+        printf("Couldn't load the main scene. Check error log for details.\n");
+        failed = true;
+        break;
+      }
+      if (status == SCENE_LOADED) {
+        CL_PopLoadingScreen(client);
+        loading = false;
+      }
+    } else if (CL_GetClientState(client) != CLIENT_PAUSED) {
       game_state = G_TickGame(client, game);
     }
     CL_DrawClient(client, &game_state);
@@ -62,6 +80,10 @@ int main(int argc, char **argv) {
   G_DestroyGame(game);
   CL_DestroyClient(client);
 
+  if (failed) {
+    return -1;
+  }
+
   printf(
       "Exiting client. Thx for using the Maidenless Engine `%s`. Maybe you'll "
       "find your maiden one day.\n",
@@ -0,0 +1,236 @@
+#version 450
+
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+#extension GL_GOOGLE_include_directive : enable
+
+#include "global_ubo.glsl"
+
+// VK_DRAW_BUCKET_COUNT
+#define DRAW_BUCKET_COUNT 4
+
+struct Instance {
+  mat4 model;
+  mat4 inv_model;
+};
+
+// vk_meshlet_t
+struct Meshlet {
+  vec4 sphere;
+  vec4 cone;
+  vec3 extents;
+  uint bucket;
+  uint index_count;
+  uint first_index;
+  int vertex_offset;
+  uint texture_id;
+};
+
+// vk_draw_candidate_t
+struct Candidate {
+  uint meshlet;
+  uint first_instance;
+  uint instance_count;
+  uint first_id;
+};
+
+// VkDrawIndexedIndirectCommand
+struct DrawCommand {
+  uint index_count;
+  uint instance_count;
+  uint first_index;
+  int vertex_offset;
+  uint first_instance;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer Instances {
+  Instance instances[];
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer Candidates {
+  Candidate candidates[];
+};
+
+layout(std430, set = 1, binding = 1) writeonly buffer Commands {
+  DrawCommand commands[];
+};
+
+layout(std430, set = 1, binding = 2) writeonly buffer Draws {
+  uint albedo_ids[];
+};
+
+// Surviving instances of each candidate, at the start of its ids
+layout(std430, set = 1, binding = 3) writeonly buffer InstanceIds {
+  uint instance_ids[];
+};
+
+layout(std430, set = 1, binding = 4) buffer Counts {
+  uint draw_counts[DRAW_BUCKET_COUNT];
+  uint visible_count;
+};
+
+// Meshlets of every model, the candidates point into it
+layout(std430, set = 1, binding = 5) readonly buffer Meshlets {
+  Meshlet meshlets[];
+};
+
+// Farthest depth of the last frame, level 0 is half the depth target
+layout(set = 1, binding = 6) uniform sampler2D depth_pyramid;
+
+layout(push_constant) uniform Constants {
+  mat4 pyramid_view_proj;
+  vec2 depth_size;
+  uint candidate_count;
+  uint occlusion;
+  uint firsts[DRAW_BUCKET_COUNT];
+}
+uniforms;
+
+bool IsInFrustum(vec3 center, float radius) {
+  mat4 m = transpose(global_ubo.view_proj);
+
+  // Planes of the Vulkan clip volume, -w <= x, y <= w and 0 <= z <= w
+  vec4 planes[6] = vec4[6](m[3] + m[0], m[3] - m[0], m[3] + m[1],
+                           m[3] - m[1], m[2], m[3] - m[2]);
+
+  for (int p = 0; p < 6; p++) {
+    if (dot(planes[p].xyz, center) + planes[p].w <
+        -radius * length(planes[p].xyz)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool IsBackfacing(Meshlet meshlet, Instance instance, vec3 center,
+                  float radius) {
+  if (meshlet.cone.w >= 1.0) {
+    return false;
+  }
+
+  // Normals go through the inverse transpose, and mirroring flips windings
+  vec3 axis = normalize(transpose(mat3(instance.inv_model)) * meshlet.cone.xyz);
+  if (determinant(mat3(instance.model)) < 0.0) {
+    axis = -axis;
+  }
+
+  // The view is rigid, the eye is where its translation comes from
+  mat4 view = global_ubo.view;
+  vec3 eye = -(transpose(mat3(view)) * view[3].xyz);
+
+  vec3 to_center = center - eye;
+  return dot(to_center, axis) >=
+         meshlet.cone.w * length(to_center) + radius;
+}
+
+bool IsOccluded(vec3 center, float radius) {
+  // Screen rectangle and nearest depth of the box around the sphere, as the
+  // last frame saw it
+  vec2 uv_min = vec2(1.0);
+  vec2 uv_max = vec2(0.0);
+  float nearest = 1.0;
+  for (int c = 0; c < 8; c++) {
+    vec3 corner = vec3((c & 1) != 0 ? radius : -radius,
+                       (c & 2) != 0 ? radius : -radius,
+                       (c & 4) != 0 ? radius : -radius);
+    vec4 clip = uniforms.pyramid_view_proj * vec4(center + corner, 1.0);
+
+    // Crossing the near plane, the projection means nothing
+    if (clip.w <= 0.0 || clip.z < 0.0) {
+      return false;
+    }
+
+    vec3 ndc = clip.xyz / clip.w;
+    uv_min = min(uv_min, ndc.xy * 0.5 + 0.5);
+    uv_max = max(uv_max, ndc.xy * 0.5 + 0.5);
+    nearest = min(nearest, ndc.z);
+  }
+
+  // Partly out of the last frame, what's there wasn't rendered
+  if (any(lessThan(uv_min, vec2(0.0))) ||
+      any(greaterThan(uv_max, vec2(1.0)))) {
+    return false;
+  }
+
+  ivec2 pixel_min = ivec2(uv_min * uniforms.depth_size);
+  ivec2 pixel_max = ivec2(uv_max * uniforms.depth_size);
+
+  // Lowest level where the rectangle covers at most 2x2 texels. A texel of
+  // level `l` covers 2^(l + 1) pixels, but the last ones also cover what's
+  // left of odd sizes
+  int level_count = textureQueryLevels(depth_pyramid);
+  int level = 0;
+  ivec2 texel_min, texel_max;
+  for (;;) {
+    ivec2 last = textureSize(depth_pyramid, level) - 1;
+    texel_min = min(pixel_min >> (level + 1), last);
+    texel_max = min(pixel_max >> (level + 1), last);
+    if (level == level_count - 1 ||
+        all(lessThanEqual(texel_max - texel_min, ivec2(1)))) {
+      break;
+    }
+    level++;
+  }
+
+  float farthest = 0.0;
+  for (int y = texel_min.y; y <= texel_max.y; y++) {
+    for (int x = texel_min.x; x <= texel_max.x; x++) {
+      farthest = max(farthest, texelFetch(depth_pyramid, ivec2(x, y), level).r);
+    }
+  }
+
+  return nearest > farthest;
+}
+
+void main() {
+  uint c = gl_GlobalInvocationID.x;
+  if (c >= uniforms.candidate_count) {
+    return;
+  }
+
+  Candidate candidate = candidates[c];
+  Meshlet meshlet = meshlets[candidate.meshlet];
+
+  // Surviving instances are listed at the start of the candidate's ids, and
+  // drawn all at once
+  uint survivor_count = 0;
+  for (uint n = 0; n < candidate.instance_count; n++) {
+    uint i = candidate.first_instance + n;
+    Instance instance = instances[i];
+    mat4 model = instance.model;
+
+    // Scaling makes the sphere grow with the longest axis
+    vec3 center = (model * vec4(meshlet.sphere.xyz, 1.0)).xyz;
+    float scale = max(max(length(model[0].xyz), length(model[1].xyz)),
+                      length(model[2].xyz));
+    float radius = meshlet.sphere.w * scale;
+
+    if (!IsInFrustum(center, radius)) {
+      continue;
+    }
+    if (IsBackfacing(meshlet, instance, center, radius)) {
+      continue;
+    }
+    if (uniforms.occlusion != 0 && IsOccluded(center, radius)) {
+      continue;
+    }
+
+    instance_ids[candidate.first_id + survivor_count] = i;
+    survivor_count++;
+  }
+
+  if (survivor_count == 0) {
+    return;
+  }
+  atomicAdd(visible_count, survivor_count);
+
+  // Draws are packed at the start of their bucket
+  uint bucket = meshlet.bucket;
+  uint d = uniforms.firsts[bucket] + atomicAdd(draw_counts[bucket], 1);
+
+  commands[d] =
+      DrawCommand(meshlet.index_count, survivor_count, meshlet.first_index,
+                  meshlet.vertex_offset, candidate.first_id);
+  albedo_ids[d] = meshlet.texture_id;
+}
@@ -0,0 +1,38 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Level above, or the depth target for level 0. A single level either way
+layout(set = 0, binding = 0) uniform sampler2D src_depth;
+layout(set = 0, binding = 1, r32f) uniform writeonly image2D dst_depth;
+
+void main() {
+  ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+  ivec2 dst_size = imageSize(dst_depth);
+
+  if (coord.x >= dst_size.x || coord.y >= dst_size.y) {
+    return;
+  }
+
+  // Halving odd sizes drops a column or a row, the last texels take it so
+  // that every source texel is covered
+  ivec2 src_size = textureSize(src_depth, 0);
+  ivec2 begin = coord * 2;
+  ivec2 end = min(begin + 2, src_size);
+  if (coord.x == dst_size.x - 1) {
+    end.x = src_size.x;
+  }
+  if (coord.y == dst_size.y - 1) {
+    end.y = src_size.y;
+  }
+
+  // Farthest depth, anything behind it is hidden
+  float depth = 0.0;
+  for (int y = begin.y; y < end.y; y++) {
+    for (int x = begin.x; x < end.x; x++) {
+      depth = max(depth, texelFetch(src_depth, ivec2(x, y), 0).r);
+    }
+  }
+
+  imageStore(dst_depth, coord, vec4(depth));
+}
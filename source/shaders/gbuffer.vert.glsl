@@ -1,9 +1,13 @@
 #version 450
 
 #extension GL_GOOGLE_include_directive : enable
+#extension GL_ARB_shader_draw_parameters : enable
 
 #include "global_ubo.glsl"
 
+// Set for packed vertices, whose normal is octahedral encoded in `norm.xy`
+layout(constant_id = 0) const bool octahedral_normal = false;
+
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec3 norm;
 layout(location = 2) in vec2 uv;
@@ -15,15 +19,49 @@ layout(location = 2) flat out int o_albedo_id;
 layout(location = 3) out vec3 vtx_position;
 layout(location = 4) out vec3 vtx_normal;
 
-layout(push_constant) uniform Constants { int albedo_id; }
+// First draw of the indirect call, in `albedo_ids`
+layout(push_constant) uniform Constants { uint first_draw; }
 uniforms;
 
+struct Instance {
+  mat4 model;
+  mat4 inv_model;
+};
+
+// The map is instance 0, with an identity transform. Actors follow, grouped
+// by model
+layout(std430, set = 0, binding = 1) readonly buffer Instances {
+  Instance instances[];
+};
+
+// One per indirect draw
+layout(std430, set = 0, binding = 2) readonly buffer Draws {
+  uint albedo_ids[];
+};
+
+// Instances surviving culling, listed from the first instance of each draw
+layout(std430, set = 0, binding = 3) readonly buffer InstanceIds {
+  uint instance_ids[];
+};
+
+vec3 DecodeOctahedral(vec2 e) {
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0);
+  n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+  return normalize(n);
+}
+
 void main() {
-  gl_Position = global_ubo.view_proj * vec4(pos, 1.0f);
+  Instance instance = instances[instance_ids[gl_InstanceIndex]];
+  vec4 world_pos = instance.model * vec4(pos, 1.0f);
+
+  gl_Position = global_ubo.view_proj * world_pos;
   o_color = vec3(uv, 1.0);
   vtx_uv = uv;
-  o_albedo_id = uniforms.albedo_id;
+  o_albedo_id = int(albedo_ids[uniforms.first_draw + gl_DrawIDARB]);
 
-  vtx_position = (global_ubo.view_proj * vec4(pos, 1.0f)).xyz;
-  vtx_normal = normalize(norm.xyz);
+  vtx_position = (global_ubo.view_proj * world_pos).xyz;
+  vec3 normal = octahedral_normal ? DecodeOctahedral(norm.xy)
+                                  : normalize(norm.xyz);
+  vtx_normal = normalize(transpose(mat3(instance.inv_model)) * normal);
 }
@@ -0,0 +1,580 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cglm/cglm.h"
+#include "game/g_collision.h"
+#include "game/g_jobs.h"
+#include "game/g_spatial.h"
+#include "vk/vk.h"
+
+// Benchmark of the collision queries, on procedural terrains of growing size.
+// The brute force path and the BVH, with every triangle kernel the CPU
+// supports, are run on the same rays and must agree on every single one. So
+// must sphere sweeps, which are also checked against known contacts, and the
+// queries of the spatial grid.
+
+#define TERRAIN_SIZE 64.0f
+#define CACHE_PATH "collision_bench.col"
+
+static double B_Now() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static float B_Random(unsigned *seed) {
+  // xorshift, good enough and reproducible across platforms
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return (float)(*seed & 0xFFFFFF) / (float)0xFFFFFF;
+}
+
+static float B_Height(float x, float z) {
+  return sinf(x * 0.35f) * 1.5f + cosf(z * 0.27f) * 1.2f +
+         sinf((x + z) * 1.3f) * 0.2f;
+}
+
+/// @brief Square heightfield of (quads * quads * 2) triangles, covering
+/// TERRAIN_SIZE units.
+static primitive_t B_CreateTerrain(unsigned quads) {
+  primitive_t terrain = {0};
+  unsigned side = quads + 1;
+
+  terrain.vertex_count = side * side;
+  terrain.vertices = calloc(terrain.vertex_count, sizeof(vertex_t));
+  terrain.index_count = quads * quads * 6;
+  terrain.indices = malloc(sizeof(uint32_t) * terrain.index_count);
+  terrain.index_size = sizeof(uint32_t);
+
+  vertex_t *vertices = terrain.vertices;
+  for (unsigned z = 0; z < side; z++) {
+    for (unsigned x = 0; x < side; x++) {
+      vertex_t *v = &vertices[z * side + x];
+      v->pos[0] = (float)x / quads * TERRAIN_SIZE;
+      v->pos[2] = (float)z / quads * TERRAIN_SIZE;
+      v->pos[1] = B_Height(v->pos[0], v->pos[2]);
+    }
+  }
+
+  uint32_t *index = terrain.indices;
+  for (unsigned z = 0; z < quads; z++) {
+    for (unsigned x = 0; x < quads; x++) {
+      unsigned i = z * side + x;
+      *index++ = i;
+      *index++ = i + side;
+      *index++ = i + 1;
+      *index++ = i + 1;
+      *index++ = i + side;
+      *index++ = i + side + 1;
+    }
+  }
+
+  return terrain;
+}
+
+typedef struct bench_ray_t {
+  vec3 orig;
+  vec3 dir;
+  float distance;
+} bench_ray_t;
+
+/// @brief Rays looking like the ones of `G_TickGame`: short probes around a
+/// player standing on the ground, either going down or sideways.
+static void B_CreateRays(bench_ray_t *rays, unsigned ray_count) {
+  unsigned seed = 0xC0FFEE;
+  for (unsigned r = 0; r < ray_count; r++) {
+    float x = B_Random(&seed) * TERRAIN_SIZE;
+    float z = B_Random(&seed) * TERRAIN_SIZE;
+    rays[r].orig[0] = x;
+    rays[r].orig[1] = B_Height(x, z) + 0.2f + B_Random(&seed) * 0.8f;
+    rays[r].orig[2] = z;
+
+    if (r % 2 == 0) {
+      rays[r].dir[0] = 0.0f;
+      rays[r].dir[1] = -1.0f;
+      rays[r].dir[2] = 0.0f;
+      rays[r].distance = 0.8f;
+    } else {
+      float angle = B_Random(&seed) * 6.2831853f;
+      rays[r].dir[0] = cosf(angle);
+      rays[r].dir[1] = 0.0f;
+      rays[r].dir[2] = sinf(angle);
+      rays[r].distance = 0.35f + B_Random(&seed) * 4.0f;
+    }
+  }
+}
+
+static bool B_SameHits(collision_mesh_t *a, collision_mesh_t *b) {
+  bench_ray_t rays[1000];
+  B_CreateRays(rays, 1000);
+
+  for (unsigned r = 0; r < 1000; r++) {
+    float t_a = 0.0f, t_b = 0.0f;
+    bool hit_a = G_CollisionRayQuery(a, rays[r].orig, rays[r].dir,
+                                     rays[r].distance, false, &t_a);
+    bool hit_b = G_CollisionRayQuery(b, rays[r].orig, rays[r].dir,
+                                     rays[r].distance, false, &t_b);
+    if (hit_a != hit_b || t_a != t_b) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+typedef struct bench_sweep_t {
+  const char *name;
+  vec3 center;
+  float radius;
+  vec3 dir;
+  bool hit;
+  float t;
+  vec3 n;
+} bench_sweep_t;
+
+/// @brief Sweeps with a known first contact, against a single triangle lying
+/// on y = 0, with the corners (0, 0, 0), (4, 0, 0) and (0, 0, 4).
+static bool B_CheckSweepContacts() {
+  primitive_t triangle = {0};
+  vertex_t vertices[3] = {
+      {.pos = {0.0f, 0.0f, 0.0f}},
+      {.pos = {4.0f, 0.0f, 0.0f}},
+      {.pos = {0.0f, 0.0f, 4.0f}},
+  };
+  uint32_t indices[3] = {0, 1, 2};
+  triangle.vertices = vertices;
+  triangle.vertex_count = 3;
+  triangle.indices = indices;
+  triangle.index_count = 3;
+  triangle.index_size = sizeof(uint32_t);
+
+  // Direction out of the corner (4, 0, 0), away from both of its edges
+  vec3 corner_dir = {2.0f, 1.0f, -1.0f};
+  glm_vec3_normalize(corner_dir);
+
+  bench_sweep_t sweeps[] = {
+      {"face", {1.0f, 2.0f, 1.0f}, 0.5f, {0.0f, -1.0f, 0.0f}, true, 1.5f,
+       {0.0f, 1.0f, 0.0f}},
+      {"back face", {1.0f, -2.0f, 1.0f}, 0.5f, {0.0f, 1.0f, 0.0f}, true,
+       1.5f, {0.0f, -1.0f, 0.0f}},
+      {"edge", {2.0f, 0.0f, -2.0f}, 0.5f, {0.0f, 0.0f, 1.0f}, true, 1.5f,
+       {0.0f, 0.0f, -1.0f}},
+      {"vertex",
+       {4.0f + corner_dir[0] * 2.0f, corner_dir[1] * 2.0f,
+        corner_dir[2] * 2.0f},
+       0.5f,
+       {-corner_dir[0], -corner_dir[1], -corner_dir[2]},
+       true,
+       1.5f,
+       {corner_dir[0], corner_dir[1], corner_dir[2]}},
+      {"touching face", {1.0f, 0.4f, 1.0f}, 0.5f, {0.0f, -1.0f, 0.0f}, true,
+       0.0f, {0.0f, 1.0f, 0.0f}},
+      {"touching edge", {2.0f, 0.0f, -0.3f}, 0.5f, {0.0f, 0.0f, 1.0f}, true,
+       0.0f, {0.0f, 0.0f, -1.0f}},
+      {"leaving face", {1.0f, 0.4f, 1.0f}, 0.5f, {0.0f, 1.0f, 0.0f}, false,
+       0.0f, {0.0f}},
+      {"passing by", {5.0f, 0.0f, 5.0f}, 0.5f, {0.0f, -1.0f, 0.0f}, false,
+       0.0f, {0.0f}},
+      {"too short", {1.0f, 6.0f, 1.0f}, 0.5f, {0.0f, -1.0f, 0.0f}, false,
+       0.0f, {0.0f}},
+  };
+  unsigned sweep_count = sizeof(sweeps) / sizeof(sweeps[0]);
+
+  collision_mesh_t *mesh = G_LoadCollisionMap(&triangle, 1);
+  bool ok = true;
+  for (unsigned s = 0; s < sweep_count; s++) {
+    bench_sweep_t *sweep = &sweeps[s];
+    for (int brute = 0; brute < 2; brute++) {
+      float t = -1.0f;
+      vec3 n = {0.0f, 0.0f, 0.0f};
+      bool hit = brute ? G_CollisionSphereSweepBruteForce(
+                             mesh, sweep->center, sweep->radius, sweep->dir,
+                             5.0f, &t, n)
+                       : G_CollisionSphereSweep(mesh, sweep->center,
+                                                sweep->radius, sweep->dir,
+                                                5.0f, &t, n);
+
+      if (hit != sweep->hit ||
+          (hit && (fabsf(t - sweep->t) > 1e-4f ||
+                   glm_vec3_dot(n, sweep->n) < 0.999f))) {
+        printf("Sweep `%s` (%s): hit %d at %f, normal (%f, %f, %f).\n",
+               sweep->name, brute ? "brute force" : "bvh", hit, t, n[0],
+               n[1], n[2]);
+        ok = false;
+      }
+    }
+  }
+  G_DestroyCollisionMap(mesh);
+
+  return ok;
+}
+
+#define GRID_CAPACITY 1024
+#define GRID_STEP_COUNT 20000
+
+typedef struct bench_grid_t {
+  bool present[GRID_CAPACITY];
+  vec3 positions[GRID_CAPACITY];
+  float radii[GRID_CAPACITY];
+  // Times each pair was reported, indexed by a * GRID_CAPACITY + b
+  unsigned char *pair_counts;
+  bool ok;
+} bench_grid_t;
+
+static bool B_Overlap(bench_grid_t *ref, unsigned a, vec3 center,
+                      float radius) {
+  float reach = ref->radii[a] + radius;
+  return glm_vec3_distance2(ref->positions[a], center) <= reach * reach;
+}
+
+static void B_CountPair(void *data, unsigned a, unsigned b) {
+  bench_grid_t *ref = data;
+  if (a >= b || b >= GRID_CAPACITY || !ref->present[a] || !ref->present[b]) {
+    printf("Spatial grid reported the invalid pair (%u, %u).\n", a, b);
+    ref->ok = false;
+    return;
+  }
+  ref->pair_counts[a * GRID_CAPACITY + b]++;
+}
+
+static void B_RandomEntry(bench_grid_t *ref, unsigned id, unsigned *seed) {
+  // Around the origin, so that cells of negative coordinates are exercised
+  ref->positions[id][0] = (B_Random(seed) - 0.5f) * 60.0f;
+  ref->positions[id][1] = (B_Random(seed) - 0.5f) * 8.0f;
+  ref->positions[id][2] = (B_Random(seed) - 0.5f) * 60.0f;
+  ref->radii[id] = 0.1f + B_Random(seed) * B_Random(seed) * 2.5f;
+}
+
+/// @brief Random inserts, moves and removals of the spatial grid, with its
+/// queries and pairs checked against testing every entry.
+static bool B_CheckSpatialGrid() {
+  // Small cells, so that ranges span many of them, and cells sharing a bucket
+  // are visited by the same query
+  spatial_grid_t *grid = G_CreateSpatialGrid(0.5f, GRID_CAPACITY);
+  bench_grid_t *ref = calloc(1, sizeof(bench_grid_t));
+  ref->pair_counts = malloc(GRID_CAPACITY * GRID_CAPACITY);
+  ref->ok = true;
+
+  unsigned seed = 0x5EED;
+  unsigned ids[GRID_CAPACITY];
+  bool found[GRID_CAPACITY];
+  for (unsigned step = 0; step < GRID_STEP_COUNT && ref->ok; step++) {
+    unsigned id = (unsigned)(B_Random(&seed) * (GRID_CAPACITY - 1));
+    float op = B_Random(&seed);
+
+    if (op < 0.35f) {
+      // Insert, or teleport
+      B_RandomEntry(ref, id, &seed);
+      ref->present[id] = true;
+      G_UpdateSpatialEntry(grid, id, ref->positions[id], ref->radii[id]);
+    } else if (op < 0.65f) {
+      // Small move, often staying in the same cell
+      if (ref->present[id]) {
+        ref->positions[id][0] += (B_Random(&seed) - 0.5f) * 0.5f;
+        ref->positions[id][2] += (B_Random(&seed) - 0.5f) * 0.5f;
+        ref->radii[id] = 0.1f + B_Random(&seed) * 0.5f;
+        G_UpdateSpatialEntry(grid, id, ref->positions[id], ref->radii[id]);
+      }
+    } else if (op < 0.75f) {
+      ref->present[id] = false;
+      G_RemoveSpatialEntry(grid, id);
+    } else {
+      vec3 center = {(B_Random(&seed) - 0.5f) * 70.0f,
+                     (B_Random(&seed) - 0.5f) * 10.0f,
+                     (B_Random(&seed) - 0.5f) * 70.0f};
+      // Sometimes large enough to walk every bucket
+      float radius = op < 0.97f ? B_Random(&seed) * 8.0f
+                                : 20.0f + B_Random(&seed) * 40.0f;
+
+      unsigned count =
+          G_QuerySpatialGrid(grid, center, radius, ids, GRID_CAPACITY);
+      memset(found, 0, sizeof(found));
+      for (unsigned i = 0; i < count; i++) {
+        if (ids[i] >= GRID_CAPACITY || found[ids[i]] ||
+            !ref->present[ids[i]] || !B_Overlap(ref, ids[i], center, radius)) {
+          printf("Spatial query reported a wrong or duplicate entry.\n");
+          ref->ok = false;
+          break;
+        }
+        found[ids[i]] = true;
+      }
+      for (unsigned e = 0; e < GRID_CAPACITY && ref->ok; e++) {
+        if (ref->present[e] && !found[e] &&
+            B_Overlap(ref, e, center, radius)) {
+          printf("Spatial query missed entry %u.\n", e);
+          ref->ok = false;
+        }
+      }
+
+      // A full output stops the search, without writing past it
+      unsigned expected = count < 3 ? count : 3;
+      if (G_QuerySpatialGrid(grid, center, radius, ids, 3) != expected) {
+        printf("Spatial query didn't stop at its output size.\n");
+        ref->ok = false;
+      }
+    }
+
+    if (step % 1000 == 999) {
+      memset(ref->pair_counts, 0, GRID_CAPACITY * GRID_CAPACITY);
+      G_ForEachSpatialPair(grid, B_CountPair, ref);
+
+      for (unsigned a = 0; a < GRID_CAPACITY && ref->ok; a++) {
+        for (unsigned b = a + 1; b < GRID_CAPACITY; b++) {
+          bool overlap = ref->present[a] && ref->present[b] &&
+                         B_Overlap(ref, a, ref->positions[b], ref->radii[b]);
+          if (ref->pair_counts[a * GRID_CAPACITY + b] != (overlap ? 1 : 0)) {
+            printf("Spatial pair (%u, %u) reported %u times.\n", a, b,
+                   ref->pair_counts[a * GRID_CAPACITY + b]);
+            ref->ok = false;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  bool ok = ref->ok;
+  free(ref->pair_counts);
+  free(ref);
+  G_DestroySpatialGrid(grid);
+
+  return ok;
+}
+
+static const char *kernel_names[COLLISION_KERNEL_COUNT] = {
+    [COLLISION_KERNEL_SCALAR] = "scalar",
+    [COLLISION_KERNEL_SSE] = "sse",
+    [COLLISION_KERNEL_AVX2] = "avx2",
+};
+
+int main(int argc, char **argv) {
+  unsigned quad_counts[] = {16, 64, 128, 256, 512, 1024};
+  unsigned bench_count = sizeof(quad_counts) / sizeof(quad_counts[0]);
+
+  collision_kernel_t best_kernel = G_GetCollisionKernel();
+  printf("Default kernel: %s\n", kernel_names[best_kernel]);
+
+  // Loading, with a single thread and with all of them, then from the cache
+  bool cache_ok = true;
+  unsigned thread_count = G_GetJobThreadCount();
+  printf("%10s %14s %14s %9s %14s\n", "triangles", "load x1 (ms)",
+         "load (ms)", "speedup", "cached (ms)");
+  for (unsigned b = 0; b < bench_count; b++) {
+    primitive_t terrain = B_CreateTerrain(quad_counts[b]);
+
+    G_SetJobThreadCount(1);
+    double start = B_Now();
+    collision_mesh_t *mesh = G_LoadCollisionMap(&terrain, 1);
+    double single_time = B_Now() - start;
+    G_DestroyCollisionMap(mesh);
+
+    G_SetJobThreadCount(0);
+    start = B_Now();
+    mesh = G_LoadCollisionMap(&terrain, 1);
+    double parallel_time = B_Now() - start;
+
+    // Round trip through the cache, which must give the exact same hits
+    double cache_time = -1.0;
+    if (G_SaveCollisionCache(mesh, CACHE_PATH, b)) {
+      start = B_Now();
+      collision_mesh_t *cached = G_LoadCollisionCache(CACHE_PATH, b);
+      cache_time = B_Now() - start;
+
+      if (!cached || !B_SameHits(mesh, cached)) {
+        printf("Cached collision mesh differs from the built one.\n");
+        cache_ok = false;
+      }
+      if (cached) {
+        G_DestroyCollisionMap(cached);
+      }
+      remove(CACHE_PATH);
+    } else {
+      cache_ok = false;
+    }
+    G_DestroyCollisionMap(mesh);
+
+    printf("%10u %14.2f %14.2f %8.1fx %14.2f\n",
+           (unsigned)terrain.index_count / 3, single_time * 1e3,
+           parallel_time * 1e3, single_time / parallel_time, cache_time * 1e3);
+
+    free(terrain.vertices);
+    free(terrain.indices);
+  }
+  printf("Threads: %u\n\n", thread_count);
+
+  printf("%10s %10s %12s %12s %8s %12s %9s %9s\n", "triangles", "rays",
+         "build (ms)", "brute (ns)", "kernel", "bvh (ns)", "speedup",
+         "mismatch");
+
+  bool all_ok = true;
+  for (unsigned b = 0; b < bench_count; b++) {
+    primitive_t terrain = B_CreateTerrain(quad_counts[b]);
+    unsigned triangle_count = terrain.index_count / 3;
+
+    double start = B_Now();
+    collision_mesh_t *mesh = G_LoadCollisionMap(&terrain, 1);
+    double build_time = B_Now() - start;
+
+    // Keep the brute force path under a second or so
+    unsigned ray_count = 20000000 / triangle_count;
+    if (ray_count > 20000) {
+      ray_count = 20000;
+    } else if (ray_count < 16) {
+      ray_count = 16;
+    }
+
+    bench_ray_t *rays = malloc(sizeof(bench_ray_t) * ray_count);
+    B_CreateRays(rays, ray_count);
+
+    bool *brute_hits = malloc(sizeof(bool) * ray_count);
+    float *brute_ts = malloc(sizeof(float) * ray_count);
+
+    start = B_Now();
+    for (unsigned r = 0; r < ray_count; r++) {
+      brute_hits[r] = G_CollisionRayQueryBruteForce(
+          mesh, rays[r].orig, rays[r].dir, rays[r].distance, false,
+          &brute_ts[r]);
+    }
+    double brute_time = B_Now() - start;
+
+    for (collision_kernel_t k = 0; k < COLLISION_KERNEL_COUNT; k++) {
+      if (!G_SetCollisionKernel(k)) {
+        continue;
+      }
+
+      unsigned mismatches = 0;
+      start = B_Now();
+      for (unsigned r = 0; r < ray_count; r++) {
+        float t;
+        bool hit = G_CollisionRayQuery(mesh, rays[r].orig, rays[r].dir,
+                                       rays[r].distance, false, &t);
+        if (hit != brute_hits[r] || (hit && t != brute_ts[r])) {
+          mismatches++;
+        }
+      }
+      double bvh_time = B_Now() - start;
+
+      printf("%10u %10u %12.2f %12.1f %8s %12.1f %8.1fx %9u\n",
+             triangle_count, ray_count, build_time * 1e3,
+             brute_time * 1e9 / ray_count, kernel_names[k],
+             bvh_time * 1e9 / ray_count, brute_time / bvh_time, mismatches);
+
+      all_ok = all_ok && mismatches == 0;
+    }
+    G_SetCollisionKernel(best_kernel);
+
+    // Same rays, only asking whether they hit
+    {
+      unsigned mismatches = 0;
+      start = B_Now();
+      for (unsigned r = 0; r < ray_count; r++) {
+        bool hit = G_CollisionRayOccluded(mesh, rays[r].orig, rays[r].dir,
+                                          rays[r].distance);
+        if (hit != brute_hits[r]) {
+          mismatches++;
+        }
+      }
+      double any_time = B_Now() - start;
+
+      printf("%10u %10u %12.2f %12.1f %8s %12.1f %8.1fx %9u\n",
+             triangle_count, ray_count, build_time * 1e3,
+             brute_time * 1e9 / ray_count, "any-hit",
+             any_time * 1e9 / ray_count, brute_time / any_time, mismatches);
+
+      all_ok = all_ok && mismatches == 0;
+    }
+
+    // Same rays, all at once
+    collision_ray_t *batch = malloc(sizeof(collision_ray_t) * ray_count);
+    collision_hit_t *batch_hits = malloc(sizeof(collision_hit_t) * ray_count);
+    for (unsigned r = 0; r < ray_count; r++) {
+      glm_vec3_copy(rays[r].orig, batch[r].orig);
+      glm_vec3_copy(rays[r].dir, batch[r].dir);
+      batch[r].distance = rays[r].distance;
+      batch[r].flags = 0;
+    }
+
+    start = B_Now();
+    G_CollisionRayQueryBatch(mesh, batch, batch_hits, ray_count);
+    double batch_time = B_Now() - start;
+
+    unsigned mismatches = 0;
+    for (unsigned r = 0; r < ray_count; r++) {
+      if (batch_hits[r].hit != brute_hits[r] ||
+          (brute_hits[r] && batch_hits[r].t != brute_ts[r])) {
+        mismatches++;
+      }
+    }
+
+    printf("%10u %10u %12.2f %12.1f %8s %12.1f %8.1fx %9u\n", triangle_count,
+           ray_count, build_time * 1e3, brute_time * 1e9 / ray_count, "batch",
+           batch_time * 1e9 / ray_count, brute_time / batch_time, mismatches);
+
+    all_ok = all_ok && mismatches == 0;
+
+    free(batch);
+    free(batch_hits);
+
+    // Spheres moving along the same rays, some of them already touching the
+    // ground. Ties between triangles may give another normal, not another
+    // time of impact
+    {
+      float *radii = malloc(sizeof(float) * ray_count);
+      unsigned seed = 0xBA11;
+      for (unsigned r = 0; r < ray_count; r++) {
+        radii[r] = 0.1f + B_Random(&seed) * 0.5f;
+      }
+
+      start = B_Now();
+      for (unsigned r = 0; r < ray_count; r++) {
+        vec3 n;
+        brute_hits[r] = G_CollisionSphereSweepBruteForce(
+            mesh, rays[r].orig, radii[r], rays[r].dir, rays[r].distance,
+            &brute_ts[r], n);
+      }
+      double brute_sweep_time = B_Now() - start;
+
+      unsigned mismatches = 0;
+      start = B_Now();
+      for (unsigned r = 0; r < ray_count; r++) {
+        float t;
+        vec3 n;
+        bool hit = G_CollisionSphereSweep(mesh, rays[r].orig, radii[r],
+                                          rays[r].dir, rays[r].distance, &t,
+                                          n);
+        if (hit != brute_hits[r] || (hit && t != brute_ts[r])) {
+          mismatches++;
+        }
+      }
+      double sweep_time = B_Now() - start;
+
+      printf("%10u %10u %12.2f %12.1f %8s %12.1f %8.1fx %9u\n",
+             triangle_count, ray_count, build_time * 1e3,
+             brute_sweep_time * 1e9 / ray_count, "sweep",
+             sweep_time * 1e9 / ray_count, brute_sweep_time / sweep_time,
+             mismatches);
+
+      all_ok = all_ok && mismatches == 0;
+      free(radii);
+    }
+
+    free(brute_hits);
+    free(brute_ts);
+    free(rays);
+    G_DestroyCollisionMap(mesh);
+    free(terrain.vertices);
+    free(terrain.indices);
+  }
+
+  bool contacts_ok = B_CheckSweepContacts();
+  printf("\nSweep contacts: %s\n", contacts_ok ? "ok" : "wrong");
+  bool grid_ok = B_CheckSpatialGrid();
+  printf("Spatial grid: %s\n", grid_ok ? "ok" : "wrong");
+
+  return all_ok && cache_ok && contacts_ok && grid_ok ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgltf.h"
+#include "game/g_file.h"
+#include "game/g_mesh.h"
+
+// Offline cooking of glTF models. The vertices and indices of each model are
+// written next to it (`model.glb.mesh`), exactly as they are uploaded to the
+// GPU, so the game only has to map them. Triangles and vertices are
+// reordered for the vertex cache, and clusters of triangles for overdraw
+// unless `--no-overdraw` is given. Vertices are quantized unless the model
+// doesn't allow it, or `--full` is given. Triangles are then cut into
+// meshlets, culled one by one by the game.
+
+typedef struct cook_options_t {
+  bool full;
+  bool no_overdraw;
+} cook_options_t;
+
+static bool C_CookModel(const char *path, cook_options_t *options) {
+  mapped_file_t file;
+  if (!G_MapFile(path, &file)) {
+    printf("Couldn't open model `%s`.\n", path);
+    return false;
+  }
+
+  // Same hash as the game computes on the whole file
+  uint64_t hash = G_HashBytes(file.data, file.size, HASH_SEED);
+
+  cgltf_options gltf_options = {0};
+  cgltf_data *data = NULL;
+  if (cgltf_parse(&gltf_options, file.data, file.size, &data) !=
+          cgltf_result_success ||
+      cgltf_load_buffers(&gltf_options, data, path) != cgltf_result_success) {
+    printf("Couldn't parse model `%s`.\n", path);
+    cgltf_free(data);
+    G_UnmapFile(&file);
+    return false;
+  }
+
+  mesh_t mesh;
+  bool cooked = G_ExtractGLTFMesh(data, &mesh);
+  cgltf_free(data);
+  G_UnmapFile(&file);
+
+  if (!cooked) {
+    printf("Couldn't extract the primitives of `%s`.\n", path);
+    return false;
+  }
+
+  float acmr_before = G_ComputeACMR(&mesh, MESH_VERTEX_CACHE_SIZE);
+  G_OptimizeMesh(&mesh, !options->no_overdraw);
+  float acmr_after = G_ComputeACMR(&mesh, MESH_VERTEX_CACHE_SIZE);
+
+  bool packed = !options->full && G_PackMesh(&mesh);
+  G_BuildMeshlets(&mesh);
+
+  size_t cooked_path_len = strlen(path) + 6;
+  char *cooked_path = malloc(cooked_path_len);
+  snprintf(cooked_path, cooked_path_len, "%s.mesh", path);
+
+  size_t vertex_count = 0;
+  size_t index_count = 0;
+  size_t meshlet_count = 0;
+  for (unsigned p = 0; p < mesh.primitive_count; p++) {
+    vertex_count += mesh.primitives[p].vertex_count;
+    index_count += mesh.primitives[p].index_count;
+    meshlet_count += mesh.primitives[p].meshlet_count;
+  }
+
+  cooked = G_SaveCookedMesh(&mesh, cooked_path, hash);
+  if (cooked) {
+    printf("%s: %u primitives, %zu %s vertices, %zu indices, %zu meshlets, "
+           "ACMR %.3f -> %.3f.\n",
+           cooked_path, mesh.primitive_count, vertex_count,
+           packed ? "packed" : "full", index_count, meshlet_count, acmr_before,
+           acmr_after);
+  }
+
+  free(cooked_path);
+  G_DestroyMesh(&mesh);
+
+  return cooked;
+}
+
+int main(int argc, char **argv) {
+  cook_options_t options = {0};
+
+  int first = 1;
+  for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+    if (strcmp(argv[first], "--full") == 0) {
+      options.full = true;
+    } else if (strcmp(argv[first], "--no-overdraw") == 0) {
+      options.no_overdraw = true;
+    } else {
+      printf("Unknown option `%s`.\n", argv[first]);
+      return 1;
+    }
+  }
+
+  if (argc <= first) {
+    printf("Usage: %s [--full] [--no-overdraw] model.glb...\n", argv[0]);
+    return 1;
+  }
+
+  bool all_cooked = true;
+  for (int i = first; i < argc; i++) {
+    all_cooked = C_CookModel(argv[i], &options) && all_cooked;
+  }
+
+  return all_cooked ? 0 : 1;
+}
@@ -0,0 +1,562 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vk/vk.h"
+#include "vk/vk_private.h"
+
+// Randomized test of the staging ring, run without a GPU. The few Vulkan and
+// VMA entry points used by the uploads are stubbed: submissions are queued,
+// and the timeline catches up with them at a random pace, as a transfer queue
+// lagging behind would. The GPU "reads" the staged bytes when a batch is
+// over, and they must still be the ones written, i.e. no later allocation
+// reused them before. Only a few bytes of each range are written, so that the
+// ring can be filled many times over quickly.
+//
+// Uploads larger than the ring are checked too. The copies recorded from the
+// ring are done by the fake transfer queue once their batch is over, and
+// what lands in the buffer or the image must be the data uploaded.
+
+#define STEP_COUNT 100000
+// Staged bytes written and read back, one per page and the last one
+#define PROBE_STRIDE 4096
+#define MAX_LIVE 65536
+
+typedef struct live_range_t {
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  // Timeline value of the batch reading it, 0 while it's recorded
+  uint64_t value;
+  unsigned char pattern;
+} live_range_t;
+
+// Destinations of the oversized uploads
+#define T_BUFFER ((VkBuffer)(uintptr_t)2)
+#define T_IMAGE ((VkImage)(uintptr_t)3)
+
+/// @brief Copy from the ring recorded in a batch, done once it's over.
+typedef struct gpu_copy_t {
+  VkDeviceSize src;
+  char *dst;
+  VkDeviceSize size;
+  uint64_t value;
+} gpu_copy_t;
+
+static struct {
+  unsigned seed;
+  char *ring;
+  // Last value submitted, and last value the fake transfer queue is over with
+  uint64_t submitted;
+  uint64_t completed;
+
+  live_range_t live[MAX_LIVE];
+  unsigned live_count;
+
+  gpu_copy_t *copies;
+  unsigned copy_count;
+  unsigned copy_capacity;
+  unsigned image_barriers;
+
+  char *buffer;
+  VkDeviceSize buffer_size;
+  // Levels follow each other, as in `texture_t`
+  char *image;
+  VkExtent3D image_extent;
+  unsigned image_mip_count;
+
+  unsigned errors;
+} test;
+
+static unsigned T_Random(void) {
+  test.seed ^= test.seed << 13;
+  test.seed ^= test.seed >> 17;
+  test.seed ^= test.seed << 5;
+  return test.seed;
+}
+
+static void T_Error(const char *what) {
+  if (test.errors++ < 10) {
+    printf("FAIL: %s.\n", what);
+  }
+}
+
+static void T_Fail(const char *what, const live_range_t *range) {
+  if (test.errors++ < 10) {
+    printf("FAIL: %s, [%llu, %llu) of batch %llu.\n", what,
+           (unsigned long long)range->offset,
+           (unsigned long long)(range->offset + range->size),
+           (unsigned long long)range->value);
+  }
+}
+
+/// @brief Move the fake timeline to `value`, reading every range of the
+/// batches over on the way.
+static void T_Complete(uint64_t value) {
+  if (value > test.submitted) {
+    printf("FAIL: waiting for %llu, only %llu were submitted.\n",
+           (unsigned long long)value, (unsigned long long)test.submitted);
+    test.errors++;
+    value = test.submitted;
+  }
+  if (value <= test.completed) {
+    return;
+  }
+  test.completed = value;
+
+  // The batches over copy what they staged, in order
+  unsigned pending = 0;
+  for (unsigned c = 0; c < test.copy_count; c++) {
+    gpu_copy_t *copy = &test.copies[c];
+    if (copy->value == 0 || copy->value > value) {
+      test.copies[pending++] = *copy;
+      continue;
+    }
+    memcpy(copy->dst, test.ring + copy->src, copy->size);
+  }
+  test.copy_count = pending;
+
+  unsigned kept = 0;
+  for (unsigned r = 0; r < test.live_count; r++) {
+    live_range_t *range = &test.live[r];
+    if (range->value == 0 || range->value > value) {
+      test.live[kept++] = *range;
+      continue;
+    }
+
+    const unsigned char *bytes =
+        (const unsigned char *)test.ring + range->offset;
+    for (VkDeviceSize b = 0; b < range->size; b += PROBE_STRIDE) {
+      if (bytes[b] != range->pattern) {
+        T_Fail("staged bytes overwritten before the copy", range);
+        break;
+      }
+    }
+    if (bytes[range->size - 1] != range->pattern) {
+      T_Fail("staged bytes overwritten before the copy", range);
+    }
+  }
+  test.live_count = kept;
+}
+
+static void T_PushCopy(VkDeviceSize src, char *dst, VkDeviceSize size) {
+  if (src + size > VK_STAGING_RING_SIZE) {
+    T_Error("copy from past the end of the ring");
+    return;
+  }
+  if (test.copy_count == test.copy_capacity) {
+    test.copy_capacity = test.copy_capacity ? test.copy_capacity * 2 : 64;
+    test.copies =
+        realloc(test.copies, sizeof(gpu_copy_t) * test.copy_capacity);
+  }
+  test.copies[test.copy_count++] = (gpu_copy_t){
+      .src = src,
+      .dst = dst,
+      .size = size,
+  };
+}
+
+// Stubs of what vk_upload.c calls
+
+VKAPI_ATTR VkResult VKAPI_CALL vkAllocateCommandBuffers(
+    VkDevice device, const VkCommandBufferAllocateInfo *pAllocateInfo,
+    VkCommandBuffer *pCommandBuffers) {
+  for (uint32_t c = 0; c < pAllocateInfo->commandBufferCount; c++) {
+    pCommandBuffers[c] = (VkCommandBuffer)(uintptr_t)(c + 1);
+  }
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkBeginCommandBuffer(
+    VkCommandBuffer commandBuffer, const VkCommandBufferBeginInfo *pBeginInfo) {
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkEndCommandBuffer(
+    VkCommandBuffer commandBuffer) {
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdCopyBuffer(VkCommandBuffer commandBuffer,
+                                           VkBuffer srcBuffer,
+                                           VkBuffer dstBuffer,
+                                           uint32_t regionCount,
+                                           const VkBufferCopy *pRegions) {
+  for (uint32_t r = 0; r < regionCount; r++) {
+    const VkBufferCopy *region = &pRegions[r];
+    if (dstBuffer != T_BUFFER ||
+        region->dstOffset + region->size > test.buffer_size) {
+      T_Error("copy past the end of the buffer");
+      continue;
+    }
+    T_PushCopy(region->srcOffset, test.buffer + region->dstOffset,
+               region->size);
+  }
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdCopyBufferToImage(
+    VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkImage dstImage,
+    VkImageLayout dstImageLayout, uint32_t regionCount,
+    const VkBufferImageCopy *pRegions) {
+  for (uint32_t r = 0; r < regionCount; r++) {
+    const VkBufferImageCopy *region = &pRegions[r];
+    unsigned level = region->imageSubresource.mipLevel;
+    if (dstImage != T_IMAGE || level >= test.image_mip_count) {
+      T_Error("copy to a level that doesn't exist");
+      continue;
+    }
+
+    // Find the level, rows are packed
+    char *level_data = test.image;
+    unsigned width = test.image_extent.width;
+    unsigned height = test.image_extent.height;
+    for (unsigned l = 0; l < level; l++) {
+      level_data += (size_t)width * height * 4;
+      width = width > 1 ? width / 2 : 1;
+      height = height > 1 ? height / 2 : 1;
+    }
+
+    if (region->bufferOffset % 4 != 0 || region->bufferRowLength != 0 ||
+        region->imageOffset.x != 0 || region->imageOffset.z != 0 ||
+        region->imageExtent.width != width ||
+        region->imageExtent.depth != 1 ||
+        region->imageOffset.y + region->imageExtent.height > height) {
+      T_Error("copy outside of its level");
+      continue;
+    }
+    T_PushCopy(region->bufferOffset,
+               level_data + (size_t)region->imageOffset.y * width * 4,
+               (VkDeviceSize)width * region->imageExtent.height * 4);
+  }
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdPipelineBarrier(
+    VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStageMask,
+    VkPipelineStageFlags dstStageMask, VkDependencyFlags dependencyFlags,
+    uint32_t memoryBarrierCount, const VkMemoryBarrier *pMemoryBarriers,
+    uint32_t bufferMemoryBarrierCount,
+    const VkBufferMemoryBarrier *pBufferMemoryBarriers,
+    uint32_t imageMemoryBarrierCount,
+    const VkImageMemoryBarrier *pImageMemoryBarriers) {
+  test.image_barriers += imageMemoryBarrierCount;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vkCreateSemaphore(VkDevice device, const VkSemaphoreCreateInfo *pCreateInfo,
+                  const VkAllocationCallbacks *pAllocator,
+                  VkSemaphore *pSemaphore) {
+  *pSemaphore = (VkSemaphore)(uintptr_t)1;
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroySemaphore(
+    VkDevice device, VkSemaphore semaphore,
+    const VkAllocationCallbacks *pAllocator) {}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkQueueSubmit(VkQueue queue,
+                                             uint32_t submitCount,
+                                             const VkSubmitInfo *pSubmits,
+                                             VkFence fence) {
+  const VkTimelineSemaphoreSubmitInfo *timeline = pSubmits->pNext;
+  uint64_t value = timeline->pSignalSemaphoreValues[0];
+  if (value != test.submitted + 1) {
+    printf("FAIL: batch %llu submitted after %llu.\n",
+           (unsigned long long)value, (unsigned long long)test.submitted);
+    test.errors++;
+  }
+  test.submitted = value;
+
+  // Everything recorded so far is read by this batch
+  for (unsigned r = 0; r < test.live_count; r++) {
+    if (test.live[r].value == 0) {
+      test.live[r].value = value;
+    }
+  }
+  for (unsigned c = 0; c < test.copy_count; c++) {
+    if (test.copies[c].value == 0) {
+      test.copies[c].value = value;
+    }
+  }
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkGetSemaphoreCounterValue(
+    VkDevice device, VkSemaphore semaphore, uint64_t *pValue) {
+  // The transfer queue makes some progress, or none
+  if (test.completed < test.submitted && T_Random() % 3 == 0) {
+    uint64_t value = test.completed + 1 + T_Random() % 2;
+    T_Complete(value < test.submitted ? value : test.submitted);
+  }
+  *pValue = test.completed;
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkWaitSemaphores(
+    VkDevice device, const VkSemaphoreWaitInfo *pWaitInfo, uint64_t timeout) {
+  T_Complete(pWaitInfo->pValues[0]);
+  return VK_SUCCESS;
+}
+
+VkResult vmaCreateBuffer(VmaAllocator allocator,
+                         const VkBufferCreateInfo *pBufferCreateInfo,
+                         const VmaAllocationCreateInfo *pAllocationCreateInfo,
+                         VkBuffer *pBuffer, VmaAllocation *pAllocation,
+                         VmaAllocationInfo *pAllocationInfo) {
+  test.ring = malloc(pBufferCreateInfo->size);
+  *pBuffer = (VkBuffer)(uintptr_t)1;
+  *pAllocation = (VmaAllocation)(uintptr_t)1;
+  return test.ring ? VK_SUCCESS : VK_ERROR_OUT_OF_HOST_MEMORY;
+}
+
+void vmaDestroyBuffer(VmaAllocator allocator, VkBuffer buffer,
+                      VmaAllocation allocation) {
+  free(test.ring);
+  test.ring = NULL;
+}
+
+VkResult vmaMapMemory(VmaAllocator allocator, VmaAllocation allocation,
+                      void **ppData) {
+  *ppData = test.ring;
+  return VK_SUCCESS;
+}
+
+void vmaUnmapMemory(VmaAllocator allocator, VmaAllocation allocation) {}
+
+VkResult vmaFlushAllocation(VmaAllocator allocator, VmaAllocation allocation,
+                            VkDeviceSize offset, VkDeviceSize size) {
+  return VK_SUCCESS;
+}
+
+/// @brief Size of an upload, mostly small ones as vertices and meshlets of a
+/// primitive, sometimes a texture, sometimes most of the ring.
+static VkDeviceSize T_RandomSize(void) {
+  unsigned kind = T_Random() % 100;
+  if (kind < 90) {
+    return 1 + T_Random() % (64 * 1024);
+  } else if (kind < 99) {
+    return 1 + T_Random() % (4 * 1024 * 1024);
+  } else {
+    return VK_STAGING_RING_SIZE / 2 + T_Random() % (VK_STAGING_RING_SIZE / 2);
+  }
+}
+
+/// @brief Check a new range against the ring bounds, and against every range
+/// the GPU hasn't read yet.
+static void T_CheckNewRange(const live_range_t *range) {
+  if (range->offset % 16 != 0) {
+    T_Fail("misaligned range", range);
+  }
+  if (range->offset + range->size > VK_STAGING_RING_SIZE) {
+    T_Fail("range past the end of the ring", range);
+  }
+
+  for (unsigned r = 0; r < test.live_count; r++) {
+    const live_range_t *other = &test.live[r];
+    if (range->offset < other->offset + other->size &&
+        other->offset < range->offset + range->size) {
+      T_Fail("range overlapping one not copied yet", range);
+      break;
+    }
+  }
+}
+
+static void T_CheckAccounting(vk_rend_t *rend) {
+  vk_uploads_t *uploads = rend->uploads;
+  VkDeviceSize batch_bytes = 0;
+  for (unsigned b = 0; b < VK_UPLOAD_BATCH_COUNT; b++) {
+    batch_bytes += uploads->batches[b].ring_bytes;
+  }
+
+  if (batch_bytes != uploads->ring_used ||
+      uploads->ring_used > VK_STAGING_RING_SIZE) {
+    if (test.errors++ < 10) {
+      printf("FAIL: %llu bytes used, the batches account for %llu.\n",
+             (unsigned long long)uploads->ring_used,
+             (unsigned long long)batch_bytes);
+    }
+  }
+}
+
+static vk_rend_t *T_CreateRend(bool transfer_ownership) {
+  vk_rend_t *rend = calloc(1, sizeof(vk_rend_t));
+  rend->queue_family_graphics_index = 0;
+  rend->queue_family_transfer_index = transfer_ownership ? 1 : 0;
+
+  if (!VK_InitUploads(rend)) {
+    test.errors++;
+    free(rend);
+    return NULL;
+  }
+  return rend;
+}
+
+static void T_FillRandom(char *data, size_t size) {
+  for (size_t b = 0; b < size; b += sizeof(unsigned)) {
+    unsigned value = T_Random();
+    memcpy(data + b, &value,
+           size - b < sizeof(unsigned) ? size - b : sizeof(unsigned));
+  }
+}
+
+/// @brief Stage and submit at random, like frames uploading models would.
+static void T_Run(bool transfer_ownership) {
+  vk_rend_t *rend = T_CreateRend(transfer_ownership);
+  if (!rend) {
+    return;
+  }
+
+  unsigned allocations = 0;
+  unsigned long long staged_bytes = 0;
+  for (unsigned step = 0; step < STEP_COUNT; step++) {
+    unsigned op = T_Random() % 100;
+
+    if (op < 85 && test.live_count < MAX_LIVE) {
+      live_range_t range = {
+          .size = T_RandomSize(),
+          .pattern = (unsigned char)(allocations * 131 + 17),
+      };
+
+      void *staging = VK_AllocateStaging(rend, range.size, &range.offset);
+      if (!staging ||
+          (char *)staging != test.ring + (size_t)range.offset) {
+        T_Fail("staging pointer not matching its offset", &range);
+        continue;
+      }
+
+      T_CheckNewRange(&range);
+      unsigned char *bytes = staging;
+      for (VkDeviceSize b = 0; b < range.size; b += PROBE_STRIDE) {
+        bytes[b] = range.pattern;
+      }
+      bytes[range.size - 1] = range.pattern;
+      test.live[test.live_count++] = range;
+
+      allocations++;
+      staged_bytes += range.size;
+    } else if (op < 95) {
+      // End of a frame
+      VK_FlushUploads(rend);
+      VK_ReleaseUploads(rend, false);
+      VK_AcquireUploads(rend, VK_NULL_HANDLE);
+    } else {
+      VK_ReleaseUploads(rend, true);
+    }
+
+    T_CheckAccounting(rend);
+  }
+
+  // Everything staged is read before the ring goes away
+  VK_DestroyUploads(rend);
+  if (test.live_count != 0) {
+    printf("FAIL: %u ranges never copied.\n", test.live_count);
+    test.errors++;
+  }
+
+  printf("%s: %u allocations, %.1f MiB staged, %llu batches\n",
+         transfer_ownership ? "transfer queue" : "graphics queue",
+         allocations, (double)staged_bytes / (1024.0 * 1024.0),
+         (unsigned long long)test.submitted);
+
+  free(rend);
+}
+
+/// @brief Upload a buffer and a whole mip chain larger than the ring, as a
+/// large map would, and one whose rows can't go through the ring at all.
+static void T_RunOversized(bool transfer_ownership) {
+  vk_rend_t *rend = T_CreateRend(transfer_ownership);
+  if (!rend) {
+    return;
+  }
+
+  // The buffer goes at an odd offset, after a small upload sharing it
+  VkDeviceSize buffer_size = VK_STAGING_RING_SIZE * 5 / 2 + 13;
+  test.buffer_size = buffer_size + 64;
+  test.buffer = calloc(1, test.buffer_size);
+  char *buffer = malloc(test.buffer_size);
+  T_FillRandom(buffer, test.buffer_size);
+
+  if (!VK_UploadBuffer(rend, T_BUFFER, buffer_size + 16, buffer + 16, 40) ||
+      !VK_UploadBuffer(rend, T_BUFFER, 3, buffer + 3, buffer_size)) {
+    T_Error("buffer larger than the ring not staged");
+  }
+
+  // 4096x4096 with every level, more than twice the ring
+  test.image_extent = (VkExtent3D){4096, 4096, 1};
+  test.image_mip_count = 13;
+  size_t image_size = 0;
+  for (unsigned l = 0; l < test.image_mip_count; l++) {
+    size_t side = 4096 >> l;
+    image_size += side * side * 4;
+  }
+  test.image = calloc(1, image_size);
+  char *texels = malloc(image_size);
+  T_FillRandom(texels, image_size);
+
+  if (!VK_UploadImage(rend, T_IMAGE, test.image_extent,
+                      test.image_mip_count, texels)) {
+    T_Error("image larger than the ring not staged");
+  }
+  // Its transition, and its release
+  if (test.image_barriers != 2) {
+    T_Error("image not transitioned and released once");
+  }
+
+  // Nothing is recorded for an image that can't be copied
+  unsigned copy_count = test.copy_count;
+  if (VK_UploadImage(rend, T_IMAGE,
+                     (VkExtent3D){VK_STAGING_RING_SIZE, 1, 1}, 1, NULL) ||
+      test.image_barriers != 2 || test.copy_count != copy_count) {
+    T_Error("image with rows larger than the ring recorded");
+  }
+
+  VK_DestroyUploads(rend);
+  if (test.copy_count != 0) {
+    T_Error("copies never done");
+  }
+
+  if (memcmp(test.buffer + 3, buffer + 3, buffer_size) != 0 ||
+      memcmp(test.buffer + buffer_size + 16, buffer + 16, 40) != 0) {
+    T_Error("buffer larger than the ring not copied back");
+  }
+  if (memcmp(test.image, texels, image_size) != 0) {
+    T_Error("image larger than the ring not copied back");
+  }
+
+  printf("%s: %.1f MiB buffer and %.1f MiB image in %llu batches\n",
+         transfer_ownership ? "transfer queue" : "graphics queue",
+         (double)buffer_size / (1024.0 * 1024.0),
+         (double)image_size / (1024.0 * 1024.0),
+         (unsigned long long)test.submitted);
+
+  free(buffer);
+  free(texels);
+  free(test.buffer);
+  free(test.image);
+  free(test.copies);
+  free(rend);
+}
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 0x2545F491;
+  // xorshift never leaves 0
+  seed = seed ? seed : 1;
+  printf("Seed 0x%x\n", seed);
+
+  for (unsigned pass = 0; pass < 4; pass++) {
+    memset(&test, 0, sizeof(test));
+    test.seed = seed + pass;
+    if (pass < 2) {
+      T_Run(pass == 1);
+    } else {
+      T_RunOversized(pass == 3);
+    }
+
+    if (test.errors > 0) {
+      printf("%u errors.\n", test.errors);
+      return 1;
+    }
+  }
+
+  printf("OK\n");
+  return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "cglm/cglm.h"
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -156,7 +157,42 @@ VkShaderModule VK_LoadShaderModule(vk_rend_t *rend, const char *path) {
   return module;
 }
 
-vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
+VkCommandBuffer VK_BeginImmediateCommands(vk_rend_t *rend) {
+  VkCommandBufferAllocateInfo allocate_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = rend->graphics_command_pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = 1,
+  };
+
+  VkCommandBuffer cmd;
+  vkAllocateCommandBuffers(rend->device, &allocate_info, &cmd);
+
+  VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  vkBeginCommandBuffer(cmd, &begin_info);
+
+  return cmd;
+}
+
+void VK_SubmitImmediateCommands(vk_rend_t *rend, VkCommandBuffer cmd) {
+  vkEndCommandBuffer(cmd);
+
+  VkSubmitInfo submit_info = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &cmd,
+  };
+  vkQueueSubmit(rend->graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
+  vkQueueWaitIdle(rend->graphics_queue);
+
+  vkFreeCommandBuffers(rend->device, rend->graphics_command_pool, 1, &cmd);
+}
+
+vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height,
+                         bool cpu_culling) {
   vk_rend_t *rend = calloc(1, sizeof(vk_rend_t));
 
   rend->width = width;
@@ -344,33 +380,40 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
         rend->physical_device, &queue_family_count, queue_families);
 
     unsigned queue_family_graphics_index = 0;
-    // unsigned queue_family_transfer_index = 0;
     bool queue_family_graphics_found = false;
-    // bool queue_family_transfer_found = false;
     for (unsigned i = 0; i < queue_family_count; i++) {
       if (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT &&
           queue_families[i].queueFlags & VK_QUEUE_COMPUTE_BIT) {
         queue_family_graphics_found = true;
         queue_family_graphics_index = i;
       }
-      // else if (queue_families[i].queueFlags & VK_QUEUE_TRANSFER_BIT &&
-      //            !(queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
-      //   queue_family_transfer_found = true;
-      //   queue_family_transfer_index = i;
-      // }
     }
 
     if (!queue_family_graphics_found) {
       VK_PUSH_ERROR("Didn't not find a queue that fits the requirement. "
                     "(graphics & compute).");
     }
-    // if (!queue_family_transfer_found) {
-    //   VK_PUSH_ERROR("Didn't not find a queue that fits the requirement. "
-    //                 "(transfer).");
-    // }
+
+    // Uploads prefer a family with nothing but transfers, usually backed by
+    // the copy engines, then an async compute one. Without either, they share
+    // the graphics queue
+    unsigned queue_family_transfer_index = queue_family_graphics_index;
+    unsigned queue_family_transfer_score = 0;
+    for (unsigned i = 0; i < queue_family_count; i++) {
+      VkQueueFlags flags = queue_families[i].queueFlags;
+      if (!(flags & VK_QUEUE_TRANSFER_BIT) || flags & VK_QUEUE_GRAPHICS_BIT) {
+        continue;
+      }
+
+      unsigned score = flags & VK_QUEUE_COMPUTE_BIT ? 1 : 2;
+      if (score > queue_family_transfer_score) {
+        queue_family_transfer_score = score;
+        queue_family_transfer_index = i;
+      }
+    }
 
     rend->queue_family_graphics_index = queue_family_graphics_index;
-    // rend->queue_family_transfer_index = queue_family_transfer_index;
+    rend->queue_family_transfer_index = queue_family_transfer_index;
 
     float queue_priority = 1.0f;
     VkDeviceQueueCreateInfo queue_graphics_info = {
@@ -379,15 +422,37 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
         .pQueuePriorities = &queue_priority,
         .queueCount = 1,
     };
-    // VkDeviceQueueCreateInfo queue_transfer_info = {
-    //     .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-    //     .queueFamilyIndex = queue_family_transfer_index,
-    //     .pQueuePriorities = &queue_priority,
-    //     .queueCount = 1,
-    // };
+    VkDeviceQueueCreateInfo queue_transfer_info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = queue_family_transfer_index,
+        .pQueuePriorities = &queue_priority,
+        .queueCount = 1,
+    };
 
-    // VkDeviceQueueCreateInfo queue_infos[] = {queue_graphics_info,
-    //                                          queue_transfer_info};
+    VkDeviceQueueCreateInfo queue_infos[] = {queue_graphics_info,
+                                             queue_transfer_info};
+    unsigned queue_info_count =
+        queue_family_transfer_index != queue_family_graphics_index ? 2 : 1;
+
+    // Anisotropic filtering is optional, textures are only trilinear without.
+    // So are indirect counts, draws are culled on the CPU without
+    VkPhysicalDeviceVulkan12Features supported_12 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 supported_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &supported_12,
+    };
+    vkGetPhysicalDeviceFeatures2(rend->physical_device, &supported_features);
+
+    rend->gpu_culling = supported_12.drawIndirectCount && !cpu_culling;
+    printf("Culling draws on the %s.\n", rend->gpu_culling ? "GPU" : "CPU");
+
+    // gl_DrawID, to find the record of each indirect draw
+    VkPhysicalDeviceVulkan11Features vulkan_11 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
+        .shaderDrawParameters = VK_TRUE,
+    };
 
     VkPhysicalDeviceVulkan12Features vulkan_12 = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
@@ -397,6 +462,9 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
         .runtimeDescriptorArray = VK_TRUE,
         .descriptorIndexing = VK_TRUE,
         .bufferDeviceAddress = VK_TRUE,
+        .timelineSemaphore = VK_TRUE,
+        .drawIndirectCount = supported_12.drawIndirectCount,
+        .pNext = &vulkan_11,
     };
 
     VkPhysicalDeviceVulkan13Features vulkan_13 = {
@@ -404,10 +472,15 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
         .dynamicRendering = VK_TRUE,
         .pNext = &vulkan_12};
 
+    VkPhysicalDeviceFeatures features = {
+        .samplerAnisotropy = supported_features.features.samplerAnisotropy,
+    };
+
     VkDeviceCreateInfo device_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pQueueCreateInfos = &queue_graphics_info,
-        .queueCreateInfoCount = 1,
+        .pEnabledFeatures = &features,
+        .pQueueCreateInfos = &queue_infos[0],
+        .queueCreateInfoCount = queue_info_count,
         .pNext = &vulkan_13,
         .enabledExtensionCount = vk_device_extension_count,
         .ppEnabledExtensionNames = vk_device_extensions,
@@ -418,8 +491,8 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
 
     vkGetDeviceQueue(rend->device, queue_family_graphics_index, 0,
                      &rend->graphics_queue);
-    // vkGetDeviceQueue(rend->device, queue_family_transfer_index, 0,
-    //                  &rend->transfer_queue);
+    vkGetDeviceQueue(rend->device, queue_family_transfer_index, 0,
+                     &rend->transfer_queue);
 
     free(queue_families);
   }
@@ -511,25 +584,17 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
                              &rend->graphics_command_buffer[0]);
   }
 
-  // Same operations, but only one command buffer for the transfer pool
-  // {
-  //   VkCommandPoolCreateInfo pool_info = {
-  //       .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-  //       .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-  //       .queueFamilyIndex = rend->queue_family_transfer_index,
-  //   };
-  //   VK_CHECK_R(vkCreateCommandPool(rend->device, &pool_info, NULL,
-  //                                  &rend->transfer_command_pool));
-  VkCommandBufferAllocateInfo allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-      .commandPool = rend->graphics_command_pool,
-      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-      .commandBufferCount = 1,
-  };
-
-  vkAllocateCommandBuffers(rend->device, &allocate_info,
-                           &rend->transfer_command_buffer);
-  // }
+  // Same operations for the transfer pool, its command buffers belong to the
+  // upload batches
+  {
+    VkCommandPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = rend->queue_family_transfer_index,
+    };
+    VK_CHECK_R(vkCreateCommandPool(rend->device, &pool_info, NULL,
+                                   &rend->transfer_command_pool));
+  }
 
   // Create default samplers
   {
@@ -550,6 +615,27 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
 
     vkCreateSampler(rend->device, &nearest_sampler_info, NULL,
                     &rend->linear_sampler);
+
+    // Model textures blend between their mip levels, and as many samples as
+    // the device allows along surfaces seen at grazing angles
+    VkPhysicalDeviceFeatures features;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceFeatures(rend->physical_device, &features);
+    vkGetPhysicalDeviceProperties(rend->physical_device, &properties);
+
+    float max_anisotropy = properties.limits.maxSamplerAnisotropy;
+    if (max_anisotropy > VK_MAX_ANISOTROPY) {
+      max_anisotropy = VK_MAX_ANISOTROPY;
+    }
+
+    nearest_sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    nearest_sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+    nearest_sampler_info.anisotropyEnable = features.samplerAnisotropy;
+    nearest_sampler_info.maxAnisotropy =
+        features.samplerAnisotropy ? max_anisotropy : 1.0f;
+
+    vkCreateSampler(rend->device, &nearest_sampler_info, NULL,
+                    &rend->anisotropic_sampler);
   }
 
   // Create semaphores
@@ -570,10 +656,6 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
 
       vkCreateFence(rend->device, &fence_info, NULL, &rend->rend_fence[i]);
     }
-    // The transfer queue is by default free to be used
-    // So create the fence with a SIGNALED state
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-    vkCreateFence(rend->device, &fence_info, NULL, &rend->transfer_fence);
   }
 
   // Create descriptor pool
@@ -583,6 +665,9 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
         {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 50},
         {VK_DESCRIPTOR_TYPE_SAMPLER, 50},
         {VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 50},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 50},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 50},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 50},
     };
 
     // We allocate 50 uniforms buffers
@@ -591,7 +676,7 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
     VkDescriptorPoolCreateInfo desc_pool_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
         .maxSets = 200,
-        .poolSizeCount = 3,
+        .poolSizeCount = 6,
         .pPoolSizes = &pool_sizes[0],
     };
 
@@ -607,20 +692,59 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
 
   vmaCreateAllocator(&allocator_info, &rend->allocator);
 
+  // Vertices and indices of every model live in the same two buffers, bound
+  // once per pass. So do their meshlets, read by culling
+  if (!VK_CreateArena(rend, &rend->vertex_arena, VK_VERTEX_ARENA_SIZE,
+                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) ||
+      !VK_CreateArena(rend, &rend->index_arena, VK_INDEX_ARENA_SIZE,
+                      VK_BUFFER_USAGE_INDEX_BUFFER_BIT) ||
+      !VK_CreateArena(rend, &rend->meshlet_arena,
+                      sizeof(vk_meshlet_t) * VK_MAX_MESHLETS,
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)) {
+    VK_PUSH_ERROR("Couldn't allocate the vertex, index and meshlet arenas.");
+  }
+  rend->meshlets = malloc(sizeof(vk_meshlet_t) * VK_MAX_MESHLETS);
+
+  if (!VK_InitUploads(rend)) {
+    VK_PUSH_ERROR("Couldn't create the staging ring.");
+  }
+
   // Create global descriptor set layout and descriptor set
   // Create global ubo too
   {
-    VkDescriptorSetLayoutBinding global_ubo_binding = {
-        .binding = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+    VkDescriptorSetLayoutBinding global_bindings[] = {
+        {
+            .binding = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .stageFlags =
+                VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 1,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .stageFlags =
+                VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 2,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+        {
+            .binding = 3,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
     };
 
     VkDescriptorSetLayoutCreateInfo desc_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = 1,
-        .pBindings = &global_ubo_binding,
+        .bindingCount = 4,
+        .pBindings = &global_bindings[0],
     };
 
     vkCreateDescriptorSetLayout(rend->device, &desc_info, NULL,
@@ -655,23 +779,99 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
         .pBufferInfo = &global_desc_buffer_info,
     };
 
+    // Instance transforms, rewritten every frame like the UBO
+    VkBufferCreateInfo instance_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = sizeof(vk_instance_t) * VK_MAX_INSTANCES,
+        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    };
+
+    VkDescriptorBufferInfo instance_desc_buffer_info = {
+        .range = sizeof(vk_instance_t) * VK_MAX_INSTANCES,
+    };
+
+    VkWriteDescriptorSet instance_desc_write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstBinding = 1,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &instance_desc_buffer_info,
+    };
+
+    // Indirect commands, their records and the instance ids of the draws, the
+    // latter two read by the vertex shader. All are written by the culling
+    // pass, and only leave the GPU when it's done by the CPU
+    VkBufferCreateInfo draw_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = VK_DRAW_BUFFER_SIZE,
+        .usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    };
+
+    VmaAllocationCreateInfo draw_alloc_info = {
+        .usage = rend->gpu_culling ? VMA_MEMORY_USAGE_GPU_ONLY
+                                   : VMA_MEMORY_USAGE_CPU_TO_GPU,
+    };
+
+    VkDescriptorBufferInfo draw_desc_buffer_info = {
+        .offset = VK_DRAW_RECORDS_OFFSET,
+        .range = sizeof(vk_draw_t) * VK_MAX_DRAWS,
+    };
+
+    VkWriteDescriptorSet draw_desc_write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstBinding = 2,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &draw_desc_buffer_info,
+    };
+
+    VkDescriptorBufferInfo id_desc_buffer_info = {
+        .offset = VK_DRAW_IDS_OFFSET,
+        .range = sizeof(uint32_t) * VK_MAX_DRAWS,
+    };
+
+    VkWriteDescriptorSet id_desc_write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstBinding = 3,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &id_desc_buffer_info,
+    };
+
+    rend->instances = malloc(sizeof(vk_instance_t) * VK_MAX_INSTANCES);
+
     for (int i = 0; i < 3; i++) {
       vmaCreateBuffer(rend->allocator, &global_buffer_info, &global_alloc_info,
                       &rend->global_buffers[i], &rend->global_allocs[i], NULL);
+      vmaCreateBuffer(rend->allocator, &instance_buffer_info,
+                      &global_alloc_info, &rend->instance_buffers[i],
+                      &rend->instance_allocs[i], NULL);
+      vmaCreateBuffer(rend->allocator, &draw_buffer_info, &draw_alloc_info,
+                      &rend->draw_buffers[i], &rend->draw_allocs[i], NULL);
 
       vkAllocateDescriptorSets(rend->device, &global_desc_set_info,
                                &rend->global_ubo_desc_set[i]);
 
       global_desc_buffer_info.buffer = rend->global_buffers[i];
       global_desc_write.dstSet = rend->global_ubo_desc_set[i];
-
-      vkUpdateDescriptorSets(rend->device, 1, &global_desc_write, 0, NULL);
+      instance_desc_buffer_info.buffer = rend->instance_buffers[i];
+      instance_desc_write.dstSet = rend->global_ubo_desc_set[i];
+      draw_desc_buffer_info.buffer = rend->draw_buffers[i];
+      draw_desc_write.dstSet = rend->global_ubo_desc_set[i];
+      id_desc_buffer_info.buffer = rend->draw_buffers[i];
+      id_desc_write.dstSet = rend->global_ubo_desc_set[i];
+
+      VkWriteDescriptorSet writes[] = {global_desc_write, instance_desc_write,
+                                       draw_desc_write, id_desc_write};
+      vkUpdateDescriptorSets(rend->device, 4, &writes[0], 0, NULL);
     }
   }
 
   // Create the descriptor set holding all freaking textures
   {
-    unsigned max_bindless_resources = 16;
+    unsigned max_bindless_resources = VK_MAX_BINDLESS_TEXTURES;
     // Create bindless descriptor pool
     VkDescriptorPoolSize pool_sizes_bindless[] = {
         {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, max_bindless_resources},
@@ -755,6 +955,10 @@ vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height) {
     VK_PUSH_ERROR("Couldn't create a specific pipeline: Shadow.");
   }
 
+  if (!VK_InitCulling(rend)) {
+    VK_PUSH_ERROR("Couldn't create a specific pipeline: Culling.");
+  }
+
   return rend;
 }
 
@@ -774,6 +978,11 @@ void VK_Present(vk_rend_t *rend, unsigned image_index) {
 }
 
 void VK_Draw(vk_rend_t *rend, game_state_t *game) {
+  // Uploads of the last frame start on the transfer queue, the ones over are
+  // taken by this frame. Models still in flight are drawn by a later one
+  VK_FlushUploads(rend);
+  VK_ReleaseUploads(rend, false);
+
   vkWaitForFences(rend->device, 1, &rend->rend_fence[rend->current_frame % 3],
                   true, 1000000000);
   vkResetFences(rend->device, 1, &rend->rend_fence[rend->current_frame % 3]);
@@ -809,10 +1018,14 @@ void VK_Draw(vk_rend_t *rend, game_state_t *game) {
 
   vkBeginCommandBuffer(cmd, &begin_info);
 
+  uint64_t upload_value = VK_AcquireUploads(rend, cmd);
+
   VK_DrawGBuffer(rend, game);
 
   VK_DrawShading(rend, game);
 
+  VK_BuildDepthPyramid(rend);
+
   // Before rendering, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR ->
   // VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL.
   VkImageMemoryBarrier image_memory_barrier_1 = {
@@ -874,15 +1087,32 @@ void VK_Draw(vk_rend_t *rend, game_state_t *game) {
 
   vkEndCommandBuffer(cmd);
 
-  VkPipelineStageFlags wait_stage =
-      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  // The swapchain image, and the uploads acquired by the frame. The upload
+  // wait must cover the source stage of the acquire barrier, and the uploads
+  // are read by the culling compute pass before any vertex is fetched.
+  VkPipelineStageFlags wait_stages[2] = {
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+  };
+  VkSemaphore wait_semaphores[2] = {
+      rend->swapchain_present_semaphore[rend->current_frame % 3],
+      rend->uploads->timeline,
+  };
+  // Binary semaphores ignore their value
+  uint64_t wait_values[2] = {0, upload_value};
+
+  VkTimelineSemaphoreSubmitInfo timeline_info = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .waitSemaphoreValueCount = 2,
+      .pWaitSemaphoreValues = &wait_values[0],
+  };
 
   VkSubmitInfo submit_info = {
       .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .pWaitDstStageMask = &wait_stage,
-      .waitSemaphoreCount = 1,
-      .pWaitSemaphores =
-          &rend->swapchain_present_semaphore[rend->current_frame % 3],
+      .pNext = &timeline_info,
+      .pWaitDstStageMask = &wait_stages[0],
+      .waitSemaphoreCount = 2,
+      .pWaitSemaphores = &wait_semaphores[0],
       .signalSemaphoreCount = 1,
       .pSignalSemaphores =
           &rend->swapchain_render_semaphore[rend->current_frame % 3],
@@ -897,68 +1127,54 @@ void VK_Draw(vk_rend_t *rend, game_state_t *game) {
   VK_Present(rend, image_index);
 }
 
-void VK_DestroyCurrentMap(vk_rend_t *rend) {
-  for (unsigned p = 0; p < rend->map.primitive_count; p++) {
-    if (rend->map.vertex_staging_allocs[p] != VK_NULL_HANDLE) {
-      vmaDestroyBuffer(rend->allocator, rend->map.vertex_staging_buffers[p],
-                       rend->map.vertex_staging_allocs[p]);
-    }
-    if (rend->map.index_staging_allocs[p] != VK_NULL_HANDLE) {
-      vmaDestroyBuffer(rend->allocator, rend->map.index_staging_buffers[p],
-                       rend->map.index_staging_allocs[p]);
-    }
-
-    vmaDestroyBuffer(rend->allocator, rend->map.vertex_buffers[p],
-                     rend->map.vertex_allocs[p]);
-    vmaDestroyBuffer(rend->allocator, rend->map.index_buffers[p],
-                     rend->map.index_allocs[p]);
-  }
+void VK_DestroyModel(vk_rend_t *rend, vk_model_t *model) {
+  memset(model, 0, sizeof(vk_model_t));
+}
 
-  for (unsigned p = 0; p < rend->map.texture_count; p++) {
-    if (rend->map.textures_staging[p] != VK_NULL_HANDLE) {
-      vmaDestroyBuffer(rend->allocator, rend->map.textures_staging[p],
-                       rend->map.textures_staging_allocs[p]);
-    }
+void VK_DestroyCurrentMap(vk_rend_t *rend) {
+  VK_DestroyModel(rend, &rend->map);
+}
 
-    vkDestroyImageView(rend->device, rend->map.texture_views[p], NULL);
+void VK_DestroyTextures(vk_rend_t *rend) {
+  for (unsigned t = 0; t < rend->texture_count; t++) {
+    vkDestroyImageView(rend->device, rend->texture_views[t], NULL);
 
-    vmaDestroyImage(rend->allocator, rend->map.textures[p],
-                    rend->map.textures_allocs[p]);
+    vmaDestroyImage(rend->allocator, rend->textures[t],
+                    rend->textures_allocs[t]);
   }
-
-  free(rend->map.vertex_staging_buffers);
-  free(rend->map.vertex_staging_allocs);
-  free(rend->map.index_staging_buffers);
-  free(rend->map.index_staging_allocs);
-
-  free(rend->map.textures_staging);
-  free(rend->map.textures_staging_allocs);
-  free(rend->map.textures);
-  free(rend->map.textures_allocs);
-  free(rend->map.texture_views);
-
-  free(rend->map.vertex_buffers);
-  free(rend->map.vertex_allocs);
-  free(rend->map.index_buffers);
-  free(rend->map.index_allocs);
-
-  free(rend->map.index_counts);
+  rend->texture_count = 0;
 }
 
 void VK_DestroyRend(vk_rend_t *rend) {
   vkDeviceWaitIdle(rend->device);
 
+  VK_DestroyUploads(rend);
   VK_DestroyCurrentMap(rend);
+  for (unsigned m = 0; m < rend->model_count; m++) {
+    VK_DestroyModel(rend, &rend->models[m]);
+  }
+  VK_DestroyArena(rend, &rend->vertex_arena);
+  VK_DestroyArena(rend, &rend->index_arena);
+  VK_DestroyArena(rend, &rend->meshlet_arena);
+  free(rend->meshlets);
+  VK_DestroyTextures(rend);
+  VK_DestroyCulling(rend);
   VK_DestroyShading(rend);
   VK_DestroyGBuffer(rend);
 
+  free(rend->instances);
   for (int i = 0; i < 3; i++) {
     vmaDestroyBuffer(rend->allocator, rend->global_buffers[i],
                      rend->global_allocs[i]);
+    vmaDestroyBuffer(rend->allocator, rend->instance_buffers[i],
+                     rend->instance_allocs[i]);
+    vmaDestroyBuffer(rend->allocator, rend->draw_buffers[i],
+                     rend->draw_allocs[i]);
   }
 
   vkDestroySampler(rend->device, rend->nearest_sampler, NULL);
   vkDestroySampler(rend->device, rend->linear_sampler, NULL);
+  vkDestroySampler(rend->device, rend->anisotropic_sampler, NULL);
 
   vkDestroyDescriptorSetLayout(rend->device, rend->global_ubo_desc_set_layout,
                                NULL);
@@ -970,8 +1186,6 @@ void VK_DestroyRend(vk_rend_t *rend) {
 
   vmaDestroyAllocator(rend->allocator);
 
-  vkDestroyFence(rend->device, rend->transfer_fence, NULL);
-
   for (int i = 0; i < 3; i++) {
     vkDestroyFence(rend->device, rend->rend_fence[i], NULL);
 
@@ -980,7 +1194,7 @@ void VK_DestroyRend(vk_rend_t *rend) {
     vkDestroySemaphore(rend->device, rend->swapchain_render_semaphore[i], NULL);
   }
   vkDestroyCommandPool(rend->device, rend->graphics_command_pool, NULL);
-  // vkDestroyCommandPool(rend->device, rend->transfer_command_pool, NULL);
+  vkDestroyCommandPool(rend->device, rend->transfer_command_pool, NULL);
   for (unsigned i = 0; i < rend->swapchain_image_count; i++) {
     vkDestroyImageView(rend->device, rend->swapchain_image_views[i], NULL);
   }
@@ -994,221 +1208,176 @@ void VK_DestroyRend(vk_rend_t *rend) {
   free(rend->swapchain_image_views);
 
   free(rend->gbuffer);
+  free(rend->culling);
   free(rend);
 }
 
 const char *VK_GetError() { return (const char *)vk_error; }
 
-void VK_CreateTexturesDescriptor(vk_rend_t *rend) {
+void VK_CreateTexturesDescriptor(vk_rend_t *rend, unsigned first,
+                                 unsigned count) {
   // Should be "UpdateTexturesDescriptor", but how god vulkan is complicated
-  // Add dynamically too
+  // Only the textures just uploaded are written, the others don't move
+  if (count == 0) {
+    return;
+  }
+
   VkWriteDescriptorSet *writes =
-      calloc(1, sizeof(VkWriteDescriptorSet) * rend->map.texture_count);
+      calloc(1, sizeof(VkWriteDescriptorSet) * count);
   VkDescriptorImageInfo *image_infos =
-      calloc(1, sizeof(VkDescriptorImageInfo) * rend->map.texture_count);
-
-  for (unsigned t = 0; t < rend->map.texture_count; t++) {
-    VkImageView texture = rend->map.texture_views[t];
-
-    image_infos[t].sampler = rend->linear_sampler;
-    image_infos[t].imageView = texture;
-    image_infos[t].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    writes[t].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[t].descriptorCount = 1;
-    writes[t].dstArrayElement = t; // should be something else
-    writes[t].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    writes[t].dstSet = rend->global_textures_desc_set;
-    writes[t].dstBinding = 0;
-    writes[t].pImageInfo = &image_infos[t];
+      calloc(1, sizeof(VkDescriptorImageInfo) * count);
+
+  // Textures that weren't uploaded have no view, their slots stay empty
+  unsigned write_count = 0;
+  for (unsigned i = 0; i < count; i++) {
+    unsigned t = first + i;
+    VkImageView texture = rend->texture_views[t];
+    if (texture == VK_NULL_HANDLE) {
+      continue;
+    }
+
+    unsigned w = write_count++;
+    image_infos[w].sampler = rend->anisotropic_sampler;
+    image_infos[w].imageView = texture;
+    image_infos[w].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    writes[w].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[w].descriptorCount = 1;
+    writes[w].dstArrayElement = t;
+    writes[w].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writes[w].dstSet = rend->global_textures_desc_set;
+    writes[w].dstBinding = 0;
+    writes[w].pImageInfo = &image_infos[w];
   }
 
-  vkUpdateDescriptorSets(rend->device, rend->map.texture_count, writes, 0,
-                         NULL);
+  vkUpdateDescriptorSets(rend->device, write_count, writes, 0, NULL);
 
   free(writes);
   free(image_infos);
 }
 
-void VK_RemoveMeshFromGpu(vk_rend_t *rend, vk_model_t *model) {}
-
-void VK_UploadMeshToGpu(vk_rend_t *rend, vk_model_t *model,
-                        primitive_t *primitives, size_t primitive_count,
-                        texture_t *textures, size_t texture_count) {
-  vkWaitForFences(rend->device, 1, &rend->transfer_fence, true, UINT64_MAX);
-
-  vkResetFences(rend->device, 1, &rend->transfer_fence);
-
-  VkCommandBuffer cmd = rend->transfer_command_buffer;
-  VkCommandBufferBeginInfo begin_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+bool VK_CreateArena(vk_rend_t *rend, vk_arena_t *arena, VkDeviceSize size,
+                    VkBufferUsageFlags usage) {
+  VkBufferCreateInfo buffer_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = size,
+      .usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+  };
+  VmaAllocationCreateInfo alloc_info = {
+      .usage = VMA_MEMORY_USAGE_GPU_ONLY,
   };
 
-  vkBeginCommandBuffer(cmd, &begin_info);
-
-  // Work with all vertex and index buffers here
-  {
-    VkBuffer *vertex_staging_buffers =
-        malloc(sizeof(VkBuffer) * primitive_count);
-    VmaAllocation *vertex_staging_allocs =
-        malloc(sizeof(VmaAllocation) * primitive_count);
-    VkBuffer *index_staging_buffers =
-        malloc(sizeof(VkBuffer) * primitive_count);
-    VmaAllocation *index_staging_allocs =
-        malloc(sizeof(VmaAllocation) * primitive_count);
-
-    VkBuffer *vertex_buffers = malloc(sizeof(VkBuffer) * primitive_count);
-    VmaAllocation *vertex_allocs =
-        malloc(sizeof(VmaAllocation) * primitive_count);
-    VkBuffer *index_buffers = malloc(sizeof(VkBuffer) * primitive_count);
-    VmaAllocation *index_allocs =
-        malloc(sizeof(VmaAllocation) * primitive_count);
-
-    unsigned *index_counts = malloc(sizeof(unsigned) * primitive_count);
-
-    for (size_t p = 0; p < primitive_count; p++) {
-      VkBuffer vertex_staging_buffer;
-      VmaAllocation vertex_staging_alloc;
-      VkBuffer index_staging_buffer;
-      VmaAllocation index_staging_alloc;
-
-      VkBuffer vertex_buffer;
-      VmaAllocation vertex_alloc;
-      VkBuffer index_buffer;
-      VmaAllocation index_alloc;
-
-      primitive_t *primitive = &primitives[p];
-
-      // Push Vertex buffer
-      {
-        VkBufferCreateInfo buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = primitive->vertex_count * sizeof(vertex_t),
-            .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        };
-
-        VmaAllocationCreateInfo alloc_info = {
-            .usage = VMA_MEMORY_USAGE_CPU_TO_GPU,
-        };
-
-        vmaCreateBuffer(rend->allocator, &buffer_info, &alloc_info,
-                        &vertex_staging_buffer, &vertex_staging_alloc, NULL);
-
-        void *mapped_data;
-        vmaMapMemory(rend->allocator, vertex_staging_alloc, &mapped_data);
-
-        memcpy(mapped_data, primitive->vertices,
-               primitive->vertex_count * sizeof(vertex_t));
-
-        vmaUnmapMemory(rend->allocator, vertex_staging_alloc);
-      }
-
-      // Create vertex GPU buffer and initiate copy
-      {
-        VkBufferCreateInfo buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = primitive->vertex_count * sizeof(vertex_t),
-            .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        };
-        VmaAllocationCreateInfo alloc_info = {
-            .usage = VMA_MEMORY_USAGE_GPU_ONLY,
-        };
-
-        vmaCreateBuffer(rend->allocator, &buffer_info, &alloc_info,
-                        &vertex_buffer, &vertex_alloc, NULL);
-        VkBufferCopy region = {
-            .dstOffset = 0,
-            .srcOffset = 0,
-            .size = primitive->vertex_count * sizeof(vertex_t),
-        };
-        vkCmdCopyBuffer(cmd, vertex_staging_buffer, vertex_buffer, 1, &region);
-      }
+  arena->size = size;
+  arena->used = 0;
+  if (vmaCreateBuffer(rend->allocator, &buffer_info, &alloc_info,
+                      &arena->buffer, &arena->alloc, NULL) != VK_SUCCESS) {
+    printf("Couldn't allocate an arena of %llu bytes.\n",
+           (unsigned long long)size);
+    arena->alloc = VK_NULL_HANDLE;
+    return false;
+  }
 
-      // Push index buffer
-      {
-        VkBufferCreateInfo buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = primitive->index_count * sizeof(unsigned),
-            .usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        };
-        VmaAllocationCreateInfo alloc_info = {
-            .usage = VMA_MEMORY_USAGE_CPU_TO_GPU,
-        };
+  return true;
+}
 
-        vmaCreateBuffer(rend->allocator, &buffer_info, &alloc_info,
-                        &index_staging_buffer, &index_staging_alloc, NULL);
+bool VK_AllocateArena(vk_arena_t *arena, VkDeviceSize size,
+                      VkDeviceSize alignment, VkDeviceSize *offset) {
+  VkDeviceSize start = (arena->used + alignment - 1) / alignment * alignment;
+  if (start + size > arena->size) {
+    return false;
+  }
 
-        void *mapped_data;
-        vmaMapMemory(rend->allocator, index_staging_alloc, &mapped_data);
+  *offset = start;
+  arena->used = start + size;
+  return true;
+}
 
-        memcpy(mapped_data, primitive->indices,
-               primitive->index_count * sizeof(unsigned));
+void VK_DestroyArena(vk_rend_t *rend, vk_arena_t *arena) {
+  if (arena->alloc != VK_NULL_HANDLE) {
+    vmaDestroyBuffer(rend->allocator, arena->buffer, arena->alloc);
+  }
+  memset(arena, 0, sizeof(vk_arena_t));
+}
 
-        vmaUnmapMemory(rend->allocator, index_staging_alloc);
-      }
+void VK_RemoveMeshFromGpu(vk_rend_t *rend, vk_model_t *model) {}
 
-      // Create index GPU buffer and initiate copy
-      {
-        VkBufferCreateInfo buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = primitive->index_count * sizeof(unsigned),
-            .usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        };
-        VmaAllocationCreateInfo alloc_info = {
-            .usage = VMA_MEMORY_USAGE_GPU_ONLY,
-        };
+/// @brief Single meshlet covering a whole primitive, for the ones cooked or
+/// extracted without meshlets. Its bounds are the box of the vertices and the
+/// sphere around them, its cone never faces away.
+static void VK_ComputePrimitiveMeshlet(const primitive_t *primitive,
+                                       meshlet_t *meshlet) {
+  memset(meshlet, 0, sizeof(meshlet_t));
+  meshlet->first_index = 0;
+  meshlet->index_count = primitive->index_count;
+  meshlet->vertex_count = primitive->vertex_count;
+  meshlet->cone_cutoff = 1.0f;
+
+  vec3 min = {0.0f, 0.0f, 0.0f};
+  vec3 max = {0.0f, 0.0f, 0.0f};
+  if (primitive->vertex_count != 0) {
+    glm_vec3_copy((float *)VK_GetVertexPosition(primitive, 0), min);
+    glm_vec3_copy(min, max);
+  }
+  for (size_t v = 1; v < primitive->vertex_count; v++) {
+    float *pos = (float *)VK_GetVertexPosition(primitive, v);
+    glm_vec3_minv(min, pos, min);
+    glm_vec3_maxv(max, pos, max);
+  }
 
-        vmaCreateBuffer(rend->allocator, &buffer_info, &alloc_info,
-                        &index_buffer, &index_alloc, NULL);
-        VkBufferCopy region = {
-            .dstOffset = 0,
-            .srcOffset = 0,
-            .size = primitive->index_count * sizeof(unsigned),
-        };
-        vkCmdCopyBuffer(cmd, index_staging_buffer, index_buffer, 1, &region);
-      }
+  glm_vec3_center(min, max, meshlet->center);
+  glm_vec3_sub(max, meshlet->center, meshlet->extents);
 
-      vertex_staging_buffers[p] = vertex_staging_buffer;
-      vertex_staging_allocs[p] = vertex_staging_alloc;
-      index_staging_buffers[p] = index_staging_buffer;
-      index_staging_allocs[p] = index_staging_alloc;
+  float radius2 = 0.0f;
+  for (size_t v = 0; v < primitive->vertex_count; v++) {
+    float *pos = (float *)VK_GetVertexPosition(primitive, v);
+    radius2 = glm_max(radius2, glm_vec3_distance2(meshlet->center, pos));
+  }
+  meshlet->radius = sqrtf(radius2);
+}
 
-      vertex_buffers[p] = vertex_buffer;
-      vertex_allocs[p] = vertex_alloc;
-      index_buffers[p] = index_buffer;
-      index_allocs[p] = index_alloc;
+void VK_UploadMeshToGpu(vk_rend_t *rend, vk_model_t *model,
+                        primitive_t *primitives, size_t primitive_count,
+                        texture_t *textures, size_t texture_count) {
+  // Work with all vertex, index and meshlet buffers here. They're
+  // sub-allocated from the arenas, and copied with the other uploads of the
+  // frame
+  model->first_meshlet = 0;
+  model->meshlet_count = 0;
+
+  size_t max_meshlet_count = 0;
+  for (size_t p = 0; p < primitive_count; p++) {
+    max_meshlet_count +=
+        primitives[p].meshlet_count != 0 ? primitives[p].meshlet_count : 1;
+  }
 
-      index_counts[p] = primitive->index_count;
-    }
+  VkDeviceSize meshlets_offset;
+  if (!VK_AllocateArena(&rend->meshlet_arena,
+                        sizeof(vk_meshlet_t) * max_meshlet_count,
+                        sizeof(vk_meshlet_t), &meshlets_offset)) {
+    printf("Meshlet arena is full, the model won't be drawn.\n");
+    primitive_count = 0;
+    meshlets_offset = 0;
+  }
 
-    model->vertex_staging_buffers = vertex_staging_buffers;
-    model->vertex_staging_allocs = vertex_staging_allocs;
-    model->index_staging_buffers = index_staging_buffers;
-    model->index_staging_allocs = index_staging_allocs;
-    model->vertex_buffers = vertex_buffers;
-    model->vertex_allocs = vertex_allocs;
-    model->index_buffers = index_buffers;
-    model->index_allocs = index_allocs;
-    model->index_counts = index_counts;
-    model->primitive_count = primitive_count;
+  // Textures past the bindless array are dropped, and the primitives using
+  // them fall back to the first one instead of reading an unwritten slot
+  unsigned first_texture = rend->texture_count;
+  if (first_texture + texture_count > VK_MAX_BINDLESS_TEXTURES) {
+    printf("Only %d textures fit in the bindless array, dropping %zu.\n",
+           VK_MAX_BINDLESS_TEXTURES,
+           first_texture + texture_count - VK_MAX_BINDLESS_TEXTURES);
+    texture_count = VK_MAX_BINDLESS_TEXTURES - first_texture;
   }
+  unsigned texture_end = first_texture + (unsigned)texture_count;
 
-  // Work with all textures and the related global descriptor
+  // Work with all textures and the related global descriptor. They're
+  // appended to the ones already uploaded, before the primitives so that
+  // they know which ones made it
   {
-    VkImage *vk_textures = malloc(sizeof(VkImage) * texture_count);
-    VmaAllocation *texture_allocs =
-        malloc(sizeof(VmaAllocation) * texture_count);
+    VkImage *vk_textures = &rend->textures[first_texture];
+    VmaAllocation *texture_allocs = &rend->textures_allocs[first_texture];
 
-    VkImageView *texture_views = malloc(sizeof(VkImageView) * texture_count);
-
-    VkBuffer *stagings = malloc(sizeof(VkBuffer) * texture_count);
-    VmaAllocation *staging_allocs =
-        malloc(sizeof(VmaAllocation) * texture_count);
+    VkImageView *texture_views = &rend->texture_views[first_texture];
 
     for (size_t t = 0; t < texture_count; t++) {
       texture_t *texture = &textures[t];
@@ -1222,7 +1391,7 @@ void VK_UploadMeshToGpu(vk_rend_t *rend, vk_model_t *model,
           .imageType = VK_IMAGE_TYPE_2D,
           .format = VK_FORMAT_R8G8B8A8_SRGB,
           .extent = extent,
-          .mipLevels = 1,
+          .mipLevels = texture->mip_count,
           .arrayLayers = 1,
           .samples = VK_SAMPLE_COUNT_1_BIT,
           .tiling = VK_IMAGE_TILING_OPTIMAL,
@@ -1231,74 +1400,27 @@ void VK_UploadMeshToGpu(vk_rend_t *rend, vk_model_t *model,
       VmaAllocationCreateInfo tex_alloc_info = {.usage =
                                                     VMA_MEMORY_USAGE_GPU_ONLY};
 
-      vmaCreateImage(rend->allocator, &tex_info, &tex_alloc_info,
-                     &vk_textures[t], &texture_allocs[t], NULL);
-
-      // Change layout of this image
-      VkImageSubresourceRange range;
-      range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      range.baseMipLevel = 0;
-      range.levelCount = 1;
-      range.baseArrayLayer = 0;
-      range.layerCount = 1;
-
-      VkImageMemoryBarrier image_barrier_1 = {
-          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-          .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-          .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          .image = vk_textures[t],
-          .subresourceRange = range,
-          .srcAccessMask = 0,
-          .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-      };
-
-      vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                           VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
-                           1, &image_barrier_1);
-
-      // CREATE, MAP
-      VkBufferCreateInfo staging_info = {
-          .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-          .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-          .size = texture->width * texture->height * 4,
-      };
-
-      VmaAllocationCreateInfo staging_alloc_info = {
-          .usage = VMA_MEMORY_USAGE_CPU_TO_GPU,
-      };
-
-      vmaCreateBuffer(rend->allocator, &staging_info, &staging_alloc_info,
-                      &stagings[t], &staging_allocs[t], NULL);
-
-      void *data;
-      vmaMapMemory(rend->allocator, staging_allocs[t], &data);
-      memcpy(data, texture->data, texture->width * texture->height * 4);
-      vmaUnmapMemory(rend->allocator, staging_allocs[t]);
-
-      // COPY
-      VkBufferImageCopy copy_region = {
-          .bufferOffset = 0,
-          .bufferRowLength = 0,
-          .bufferImageHeight = 0,
-          .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-          .imageSubresource.mipLevel = 0,
-          .imageSubresource.baseArrayLayer = 0,
-          .imageSubresource.layerCount = 1,
-          .imageExtent = extent,
-      };
-
-      vkCmdCopyBufferToImage(cmd, stagings[t], vk_textures[t],
-                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                             &copy_region);
-
-      image_barrier_1.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-      image_barrier_1.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-      image_barrier_1.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-      image_barrier_1.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      // A texture that isn't uploaded keeps an empty slot, whose descriptor
+      // is never written
+      texture_views[t] = VK_NULL_HANDLE;
+      if (vmaCreateImage(rend->allocator, &tex_info, &tex_alloc_info,
+                         &vk_textures[t], &texture_allocs[t],
+                         NULL) != VK_SUCCESS) {
+        printf("Texture %zu couldn't be allocated, it won't be drawn.\n", t);
+        vk_textures[t] = VK_NULL_HANDLE;
+        texture_allocs[t] = VK_NULL_HANDLE;
+        continue;
+      }
 
-      vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0,
-                           NULL, 1, &image_barrier_1);
+      // Levels follow each other in `data`, staged a band at a time
+      if (!VK_UploadImage(rend, vk_textures[t], extent, texture->mip_count,
+                          texture->data)) {
+        printf("Texture %zu couldn't be staged, it won't be drawn.\n", t);
+        vmaDestroyImage(rend->allocator, vk_textures[t], texture_allocs[t]);
+        vk_textures[t] = VK_NULL_HANDLE;
+        texture_allocs[t] = VK_NULL_HANDLE;
+        continue;
+      }
 
       // Create image view and sampler
       // Almost there
@@ -1317,7 +1439,7 @@ void VK_UploadMeshToGpu(vk_rend_t *rend, vk_model_t *model,
               {
                   .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                   .baseMipLevel = 0,
-                  .levelCount = 1,
+                  .levelCount = texture->mip_count,
                   .baseArrayLayer = 0,
                   .layerCount = 1,
               },
@@ -1338,24 +1460,93 @@ void VK_UploadMeshToGpu(vk_rend_t *rend, vk_model_t *model,
         vkSetDebugUtilsObjectName(rend->device, &image_view_name);
       }
     }
-    model->textures = vk_textures;
-    model->textures_allocs = texture_allocs;
-    model->textures_staging = stagings;
-    model->textures_staging_allocs = staging_allocs;
-    model->texture_count = texture_count;
-    model->texture_views = texture_views;
+    rend->texture_count += texture_count;
   }
-  vkEndCommandBuffer(cmd);
 
-  VkSubmitInfo submit_info = {
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &rend->transfer_command_buffer,
-  };
+  VK_CreateTexturesDescriptor(rend, first_texture, texture_count);
+
+  // The meshlets of every primitive follow each other, and are kept on the
+  // CPU as well
+  model->first_meshlet = (unsigned)(meshlets_offset / sizeof(vk_meshlet_t));
+  vk_meshlet_t *meshlets = &rend->meshlets[model->first_meshlet];
+
+  for (size_t p = 0; p < primitive_count; p++) {
+    primitive_t *primitive = &primitives[p];
+    size_t vertex_size = VK_GetVertexSize(primitive->vertex_format);
+    size_t vertices_size = primitive->vertex_count * vertex_size;
+    size_t indices_size = primitive->index_count * primitive->index_size;
+
+    if (vertices_size == 0 || indices_size == 0) {
+      continue;
+    }
+
+    // Draws address vertices and indices by their position in the whole
+    // arena, so the ranges have to be aligned on their own sizes
+    VkDeviceSize vertex_offset, index_offset;
+    if (!VK_AllocateArena(&rend->vertex_arena, vertices_size, vertex_size,
+                          &vertex_offset) ||
+        !VK_AllocateArena(&rend->index_arena, indices_size,
+                          primitive->index_size, &index_offset)) {
+      printf("Arenas are full, primitive %zu won't be drawn.\n", p);
+      continue;
+    }
+
+    if (!VK_UploadBuffer(rend, rend->vertex_arena.buffer, vertex_offset,
+                         primitive->vertices, vertices_size) ||
+        !VK_UploadBuffer(rend, rend->index_arena.buffer, index_offset,
+                         primitive->indices, indices_size)) {
+      printf("Primitive %zu couldn't be staged, it won't be drawn.\n", p);
+      continue;
+    }
+
+    meshlet_t whole;
+    const meshlet_t *primitive_meshlets = primitive->meshlets;
+    size_t meshlet_count = primitive->meshlet_count;
+    if (meshlet_count == 0) {
+      VK_ComputePrimitiveMeshlet(primitive, &whole);
+      primitive_meshlets = &whole;
+      meshlet_count = 1;
+    }
+
+    // Draws sharing a pipeline and an index type go out in the same indirect
+    // call
+    unsigned bucket = primitive->vertex_format * 2 +
+                      (primitive->index_size == sizeof(uint32_t) ? 1 : 0);
+
+    // Textures dropped or not uploaded fall back to the first one
+    unsigned texture_id = primitive->texture;
+    if (texture_id >= texture_end ||
+        rend->texture_views[texture_id] == VK_NULL_HANDLE) {
+      texture_id = 0;
+    }
 
-  vkQueueSubmit(rend->graphics_queue, 1, &submit_info, rend->transfer_fence);
+    for (size_t m = 0; m < meshlet_count; m++) {
+      const meshlet_t *meshlet = &primitive_meshlets[m];
+      vk_meshlet_t *vk_meshlet = &meshlets[model->meshlet_count++];
+
+      glm_vec4((float *)meshlet->center, meshlet->radius, vk_meshlet->sphere);
+      glm_vec4((float *)meshlet->cone_axis, meshlet->cone_cutoff,
+               vk_meshlet->cone);
+      glm_vec3_copy((float *)meshlet->extents, vk_meshlet->extents);
+      vk_meshlet->bucket = bucket;
+      vk_meshlet->index_count = meshlet->index_count;
+      vk_meshlet->first_index =
+          (uint32_t)(index_offset / primitive->index_size) +
+          meshlet->first_index;
+      vk_meshlet->vertex_offset = (int32_t)(vertex_offset / vertex_size);
+      vk_meshlet->texture_id = texture_id;
+    }
+  }
 
-  VK_CreateTexturesDescriptor(rend);
+  if (!VK_UploadBuffer(rend, rend->meshlet_arena.buffer, meshlets_offset,
+                       meshlets,
+                       sizeof(vk_meshlet_t) * model->meshlet_count)) {
+    printf("Meshlets couldn't be staged, the model won't be drawn.\n");
+    model->meshlet_count = 0;
+  }
+
+  // Nothing is drawn before the batches holding the model are over
+  model->upload_value = VK_GetUploadValue(rend);
 }
 
 unsigned VK_PushModel(vk_rend_t *rend, primitive_t *primitives,
@@ -1372,6 +1563,13 @@ unsigned VK_PushModel(vk_rend_t *rend, primitive_t *primitives,
 void VK_PushMap(vk_rend_t *rend, primitive_t *primitives,
                 size_t primitive_count, texture_t *textures,
                 size_t texture_count) {
+  // Its ranges couldn't be reclaimed, the models pushed after it follow them
+  if (rend->has_map) {
+    printf("A map is already uploaded, only one fits in the arenas.\n");
+    return;
+  }
+
   VK_UploadMeshToGpu(rend, &rend->map, primitives, primitive_count, textures,
                      texture_count);
+  rend->has_map = true;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct game_state_t game_state_t;
 typedef struct client_t client_t;
@@ -13,34 +15,136 @@ typedef struct vertex_t {
   int joint[4];
 } vertex_t;
 
+/// @brief Quantized vertex, 20 bytes instead of the 52 of `vertex_t`. The
+/// normal is octahedral encoded on two snorm16, UVs are half floats. Joints
+/// are left out, nothing is skinned yet.
+typedef struct packed_vertex_t {
+  float pos[3];
+  int16_t norm[2];
+  uint16_t uv[2];
+} packed_vertex_t;
+
+typedef enum vertex_format_t {
+  VERTEX_FORMAT_FULL,
+  VERTEX_FORMAT_PACKED,
+  VERTEX_FORMAT_COUNT,
+} vertex_format_t;
+
+/// @brief Cluster of neighbouring triangles of a primitive, culled on its own.
+/// Its triangles are a range of the indices of the primitive, so it can be
+/// drawn like any primitive.
+typedef struct meshlet_t {
+  // Bounding box of its vertices, and the sphere around them centered on it
+  float center[3];
+  float radius;
+  float extents[3];
+  // Normals of its triangles are within an angle of the axis whose sine is
+  // `cone_cutoff`. At 1, the cone is too wide to ever face away
+  float cone_cutoff;
+  float cone_axis[3];
+  // Range of the indices of the primitive
+  uint32_t first_index;
+  uint32_t index_count;
+  uint32_t vertex_count;
+  uint32_t padding[2];
+} meshlet_t;
+
 typedef struct primitive_t {
-  vertex_t *vertices;
+  // Either vertex_t or packed_vertex_t, depending on `vertex_format`. Both
+  // start with the position
+  void *vertices;
   size_t vertex_count;
-  unsigned *indices;
+  vertex_format_t vertex_format;
+  // Either uint16_t or uint32_t, depending on `index_size`. Uploaded and bound
+  // as they are
+  void *indices;
   size_t index_count;
+  unsigned index_size;
+
+  // Clusters of its triangles, following each other in its indices. Empty
+  // until they're built
+  meshlet_t *meshlets;
+  size_t meshlet_count;
+  // Seen from both sides, its meshlets never face away from the camera
+  bool double_sided;
 
+  // Bindless index of the base color texture
+  unsigned texture;
 } primitive_t;
 
+static inline size_t VK_GetVertexSize(vertex_format_t format) {
+  return format == VERTEX_FORMAT_PACKED ? sizeof(packed_vertex_t)
+                                        : sizeof(vertex_t);
+}
+
+/// @brief Position of a vertex of a primitive, whatever its format.
+static inline const float *VK_GetVertexPosition(const primitive_t *primitive,
+                                                size_t i) {
+  const char *vertices = primitive->vertices;
+  return (const float *)(vertices +
+                         i * VK_GetVertexSize(primitive->vertex_format));
+}
+
+/// @brief Read an index of a primitive, whatever its size.
+static inline unsigned VK_GetIndex(const primitive_t *primitive, size_t i) {
+  if (primitive->index_size == sizeof(uint16_t)) {
+    return ((const uint16_t *)primitive->indices)[i];
+  }
+  return ((const uint32_t *)primitive->indices)[i];
+}
+
+/// @brief Decoded RGBA texture. `data` holds its `mip_count` levels one after
+/// the other, each one half the size of the previous, down to 1x1.
 typedef struct texture_t {
   int width, height, c;
+  unsigned mip_count;
   unsigned char *data;
   char *label;
 } texture_t;
 
 typedef struct vk_model_t vk_model_t;
 
-vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height);
+/// @brief What the renderer went through for a frame.
+typedef struct vk_frame_stats_t {
+  // Meshlets of every drawn instance, and the ones surviving culling
+  unsigned draw_count;
+  unsigned visible_draw_count;
+  // Culled by a compute pass, else by the CPU
+  bool gpu_culling;
+} vk_frame_stats_t;
+
+/// @brief Create the renderer of a client's window.
+/// @param cpu_culling Cull draws on the CPU, even if the device can do it.
+/// It's the only way without `drawIndirectCount`.
+vk_rend_t *VK_CreateRend(client_t *client, unsigned width, unsigned height,
+                         bool cpu_culling);
 
+/// @brief Upload the map. Like models, it's appended to the arenas and to the
+/// bindless array, which only grow, so there's one map per renderer. Pushing
+/// another one fails.
+/// @param textures Textures not uploaded yet. They're appended to the bindless
+/// array, in order, so they get the indices following the ones of the
+/// textures pushed before. Primitives can point to any of them.
 void VK_PushMap(vk_rend_t *rend, primitive_t *primitives,
                 size_t primitive_count, texture_t *textures,
                 size_t texture_count);
 
+/// @brief Same as `VK_PushMap`, for an actor.
+/// @return Id of the model.
 unsigned VK_PushModel(vk_rend_t *rend, primitive_t *primitives,
                       size_t primitive_count, texture_t *textures,
                       size_t texture_count);
 
 void VK_Draw(vk_rend_t *ren, game_state_t *game);
 
+/// @brief Bytes of staging memory held right now. Staging buffers are
+/// released as soon as the transfer that reads them is over.
+size_t VK_GetStagingBytes(vk_rend_t *rend);
+
+/// @brief Stats of the last frame whose numbers are known. Culled on the GPU,
+/// that's the one drawn three frames ago, as they're read back.
+vk_frame_stats_t VK_GetFrameStats(vk_rend_t *rend);
+
 void VK_DestroyRend(vk_rend_t *rend);
 
 const char *VK_GetError();
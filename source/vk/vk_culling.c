@@ -0,0 +1,887 @@
+#include "vk.h"
+#include "vk_private.h"
+
+#include "cglm/cglm.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CULLING_X86
+#include <immintrin.h>
+#endif
+
+/// @brief Push constants of the culling compute shader.
+typedef struct vk_cull_constants_t {
+  mat4 pyramid_view_proj;
+  vec2 depth_size;
+  uint32_t candidate_count;
+  // Whether the pyramid holds a frame at all
+  uint32_t occlusion;
+  uint32_t firsts[VK_DRAW_BUCKET_COUNT];
+} vk_cull_constants_t;
+
+/// @brief Planes of the frustum, normals pointing in. Boxes are tested
+/// against all of them at once, so they're kept as `nx, ny, nz, w` and the
+/// absolute value of the normal.
+typedef struct vk_frustum_t {
+  float planes[6][4];
+  float abs_normals[6][3];
+} vk_frustum_t;
+
+/// @brief Test boxes `[first, count[` against the frustum, a few at a time.
+typedef void (*vk_box_test_t)(const vk_frustum_t *frustum,
+                              float *const centers[3],
+                              float *const extents[3], unsigned first,
+                              unsigned count, bool *visible);
+
+/// @brief Extract the planes of the Vulkan clip volume, -w <= x, y <= w and
+/// 0 <= z <= w, from the rows of `view_proj`.
+static void VK_ExtractFrustum(mat4 view_proj, vk_frustum_t *frustum) {
+  vec4 rows[4];
+  for (unsigned r = 0; r < 4; r++) {
+    glm_vec4(
+        (vec3){view_proj[0][r], view_proj[1][r], view_proj[2][r]},
+        view_proj[3][r], rows[r]);
+  }
+
+  glm_vec4_add(rows[3], rows[0], frustum->planes[0]);
+  glm_vec4_sub(rows[3], rows[0], frustum->planes[1]);
+  glm_vec4_add(rows[3], rows[1], frustum->planes[2]);
+  glm_vec4_sub(rows[3], rows[1], frustum->planes[3]);
+  glm_vec4_copy(rows[2], frustum->planes[4]);
+  glm_vec4_sub(rows[3], rows[2], frustum->planes[5]);
+
+  for (unsigned p = 0; p < 6; p++) {
+    for (unsigned i = 0; i < 3; i++) {
+      frustum->abs_normals[p][i] = fabsf(frustum->planes[p][i]);
+    }
+  }
+}
+
+// A box is outside of a plane when its center is farther behind it than the
+// projection of its extents on the normal. The SIMD versions do the same
+// operations in the same order, so all of them agree
+static void VK_TestBoxesScalar(const vk_frustum_t *frustum,
+                               float *const centers[3],
+                               float *const extents[3], unsigned first,
+                               unsigned count, bool *visible) {
+  for (unsigned b = first; b < count; b++) {
+    bool inside = true;
+    for (unsigned p = 0; p < 6; p++) {
+      const float *plane = frustum->planes[p];
+      const float *abs_normal = frustum->abs_normals[p];
+      float d = plane[0] * centers[0][b] + plane[1] * centers[1][b] +
+                plane[2] * centers[2][b] + plane[3];
+      float r = abs_normal[0] * extents[0][b] +
+                abs_normal[1] * extents[1][b] +
+                abs_normal[2] * extents[2][b];
+      inside = inside && d + r >= 0.0f;
+    }
+    visible[b] = inside;
+  }
+}
+
+#ifdef CULLING_X86
+static void VK_TestBoxesSSE(const vk_frustum_t *frustum,
+                            float *const centers[3], float *const extents[3],
+                            unsigned first, unsigned count, bool *visible) {
+  __m128 zero = _mm_setzero_ps();
+
+  unsigned b = first;
+  for (; b + 4 <= count; b += 4) {
+    __m128 cx = _mm_load_ps(&centers[0][b]);
+    __m128 cy = _mm_load_ps(&centers[1][b]);
+    __m128 cz = _mm_load_ps(&centers[2][b]);
+    __m128 ex = _mm_load_ps(&extents[0][b]);
+    __m128 ey = _mm_load_ps(&extents[1][b]);
+    __m128 ez = _mm_load_ps(&extents[2][b]);
+
+    __m128 inside = _mm_cmpeq_ps(zero, zero);
+    for (unsigned p = 0; p < 6; p++) {
+      const float *plane = frustum->planes[p];
+      const float *abs_normal = frustum->abs_normals[p];
+
+      __m128 d = _mm_add_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[0]), cx),
+                                _mm_mul_ps(_mm_set1_ps(plane[1]), cy)),
+                     _mm_mul_ps(_mm_set1_ps(plane[2]), cz)),
+          _mm_set1_ps(plane[3]));
+      __m128 r = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_set1_ps(abs_normal[0]), ex),
+                     _mm_mul_ps(_mm_set1_ps(abs_normal[1]), ey)),
+          _mm_mul_ps(_mm_set1_ps(abs_normal[2]), ez));
+
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+    }
+
+    int bits = _mm_movemask_ps(inside);
+    for (unsigned lane = 0; lane < 4; lane++) {
+      visible[b + lane] = (bits >> lane) & 1;
+    }
+  }
+
+  VK_TestBoxesScalar(frustum, centers, extents, b, count, visible);
+}
+
+__attribute__((target("avx"))) static void
+VK_TestBoxesAVX(const vk_frustum_t *frustum, float *const centers[3],
+                float *const extents[3], unsigned first, unsigned count,
+                bool *visible) {
+  __m256 zero = _mm256_setzero_ps();
+
+  unsigned b = first;
+  for (; b + 8 <= count; b += 8) {
+    __m256 cx = _mm256_load_ps(&centers[0][b]);
+    __m256 cy = _mm256_load_ps(&centers[1][b]);
+    __m256 cz = _mm256_load_ps(&centers[2][b]);
+    __m256 ex = _mm256_load_ps(&extents[0][b]);
+    __m256 ey = _mm256_load_ps(&extents[1][b]);
+    __m256 ez = _mm256_load_ps(&extents[2][b]);
+
+    __m256 inside = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+    for (unsigned p = 0; p < 6; p++) {
+      const float *plane = frustum->planes[p];
+      const float *abs_normal = frustum->abs_normals[p];
+
+      __m256 d = _mm256_add_ps(
+          _mm256_add_ps(
+              _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[0]), cx),
+                            _mm256_mul_ps(_mm256_set1_ps(plane[1]), cy)),
+              _mm256_mul_ps(_mm256_set1_ps(plane[2]), cz)),
+          _mm256_set1_ps(plane[3]));
+      __m256 r = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(abs_normal[0]), ex),
+                        _mm256_mul_ps(_mm256_set1_ps(abs_normal[1]), ey)),
+          _mm256_mul_ps(_mm256_set1_ps(abs_normal[2]), ez));
+
+      inside = _mm256_and_ps(
+          inside, _mm256_cmp_ps(_mm256_add_ps(d, r), zero, _CMP_GE_OQ));
+    }
+
+    int bits = _mm256_movemask_ps(inside);
+    for (unsigned lane = 0; lane < 8; lane++) {
+      visible[b + lane] = (bits >> lane) & 1;
+    }
+  }
+
+  VK_TestBoxesScalar(frustum, centers, extents, b, count, visible);
+}
+#endif
+
+// Picked once the CPU is known
+static vk_box_test_t box_test = VK_TestBoxesScalar;
+
+/// @brief Create a compute pipeline from a single shader.
+/// @return false if the shader couldn't be loaded.
+static bool VK_CreateCullingPipeline(vk_rend_t *rend, const char *path,
+                                     VkPipelineLayout layout,
+                                     VkPipeline *pipeline) {
+  VkShaderModule comp_shader = VK_LoadShaderModule(rend, path);
+  if (!comp_shader) {
+    printf("Couldn't create compute shader module from `%s`.\n", path);
+    return false;
+  }
+
+  VkComputePipelineCreateInfo pipeline_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = VK_PipelineShaderStageCreateInfo(VK_SHADER_STAGE_COMPUTE_BIT,
+                                                comp_shader),
+      .layout = layout,
+  };
+
+  vkCreateComputePipelines(rend->device, VK_NULL_HANDLE, 1, &pipeline_info,
+                           NULL, pipeline);
+
+  vkDestroyShaderModule(rend->device, comp_shader, NULL);
+
+  return true;
+}
+
+bool VK_InitCulling(vk_rend_t *rend) {
+  if (rend->culling) {
+    printf("Culling seems to be already initialized.\n");
+    return false;
+  }
+
+  rend->culling = calloc(1, sizeof(vk_culling_t));
+  vk_culling_t *culling = rend->culling;
+
+  // Candidates are gathered in cached memory either way, and boxes are
+  // aligned for the widest kernel
+  culling->candidates = malloc(sizeof(vk_draw_candidate_t) * VK_MAX_DRAWS);
+  for (unsigned i = 0; i < 3; i++) {
+    culling->box_centers[i] = aligned_alloc(32, sizeof(float) * VK_MAX_DRAWS);
+    culling->box_extents[i] = aligned_alloc(32, sizeof(float) * VK_MAX_DRAWS);
+  }
+  culling->visible = malloc(sizeof(bool) * VK_MAX_DRAWS);
+
+#ifdef CULLING_X86
+  if (__builtin_cpu_supports("avx")) {
+    box_test = VK_TestBoxesAVX;
+  } else if (__builtin_cpu_supports("sse2")) {
+    box_test = VK_TestBoxesSSE;
+  }
+#endif
+
+  // Without indirect counts, the GPU doesn't cull and needs none of the
+  // buffers and passes below
+  if (!rend->gpu_culling) {
+    return true;
+  }
+
+  // Surviving instances of each frame are copied here for the stats, and
+  // read back when the frame comes around again
+  {
+    VkBufferCreateInfo stats_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = sizeof(uint32_t),
+        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    };
+
+    VmaAllocationCreateInfo stats_alloc_info = {
+        .usage = VMA_MEMORY_USAGE_GPU_TO_CPU,
+    };
+
+    for (int i = 0; i < 3; i++) {
+      vmaCreateBuffer(rend->allocator, &stats_buffer_info, &stats_alloc_info,
+                      &culling->stats_buffers[i], &culling->stats_allocs[i],
+                      NULL);
+    }
+  }
+
+
+  // Create the depth pyramid, with a view on the whole chain for culling, and
+  // one per level to reduce them one after the other
+  {
+    VkExtent3D extent = {
+        .depth = 1,
+        .width = rend->width > 1 ? rend->width / 2 : 1,
+        .height = rend->height > 1 ? rend->height / 2 : 1,
+    };
+
+    unsigned levels = 1;
+    while (levels < VK_MAX_PYRAMID_LEVELS &&
+           ((extent.width >> levels) > 0 || (extent.height >> levels) > 0)) {
+      levels++;
+    }
+    culling->pyramid_levels = levels;
+
+    VkImageCreateInfo pyramid_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = VK_FORMAT_R32_SFLOAT,
+        .extent = extent,
+        .mipLevels = levels,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+    };
+
+    VmaAllocationCreateInfo pyramid_alloc_info = {
+        .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    };
+
+    vmaCreateImage(rend->allocator, &pyramid_info, &pyramid_alloc_info,
+                   &culling->pyramid, &culling->pyramid_alloc, NULL);
+
+    VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .image = culling->pyramid,
+        .format = VK_FORMAT_R32_SFLOAT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = levels,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+    };
+
+    vkCreateImageView(rend->device, &view_info, NULL, &culling->pyramid_view);
+
+    view_info.subresourceRange.levelCount = 1;
+    for (unsigned l = 0; l < levels; l++) {
+      view_info.subresourceRange.baseMipLevel = l;
+      vkCreateImageView(rend->device, &view_info, NULL,
+                        &culling->pyramid_level_views[l]);
+    }
+
+    // It's written and read in the same layout, forever
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = culling->pyramid,
+        .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = levels,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+    };
+
+    VkCommandBuffer cmd = VK_BeginImmediateCommands(rend);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+    VK_SubmitImmediateCommands(rend, cmd);
+  }
+
+  // Create the descriptor sets reducing each level of the pyramid: the level
+  // above, or the depth target, is sampled and the level is stored
+  {
+    VkDescriptorSetLayoutBinding bindings[] = {
+        {
+            .binding = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 1,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+    };
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 2,
+        .pBindings = &bindings[0],
+    };
+
+    vkCreateDescriptorSetLayout(rend->device, &layout_info, NULL,
+                                &culling->pyramid_layout);
+
+    VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = rend->descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &culling->pyramid_layout,
+    };
+
+    for (unsigned l = 0; l < culling->pyramid_levels; l++) {
+      vkAllocateDescriptorSets(rend->device, &set_info,
+                               &culling->pyramid_sets[l]);
+
+      VkDescriptorImageInfo src_info = {
+          .sampler = rend->nearest_sampler,
+          .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          .imageView = rend->gbuffer->depth_target.image_view,
+      };
+      if (l > 0) {
+        src_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        src_info.imageView = culling->pyramid_level_views[l - 1];
+      }
+
+      VkDescriptorImageInfo dst_info = {
+          .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+          .imageView = culling->pyramid_level_views[l],
+      };
+
+      VkWriteDescriptorSet writes[2] = {
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = culling->pyramid_sets[l],
+              .dstBinding = 0,
+              .descriptorCount = 1,
+              .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+              .pImageInfo = &src_info,
+          },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = culling->pyramid_sets[l],
+              .dstBinding = 1,
+              .descriptorCount = 1,
+              .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+              .pImageInfo = &dst_info,
+          },
+      };
+      vkUpdateDescriptorSets(rend->device, 2, &writes[0], 0, NULL);
+    }
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &culling->pyramid_layout,
+    };
+
+    vkCreatePipelineLayout(rend->device, &pipeline_layout_info, NULL,
+                           &culling->pyramid_pipeline_layout);
+
+    if (!VK_CreateCullingPipeline(rend, "depth_pyramid.comp.spv",
+                                  culling->pyramid_pipeline_layout,
+                                  &culling->pyramid_pipeline)) {
+      return false;
+    }
+  }
+
+  // Create the descriptor sets of the culling pass: the candidates of the
+  // frame, the sections of its draw buffer, the meshlet arena and the pyramid
+  {
+    VkDescriptorSetLayoutBinding bindings[7];
+    for (unsigned b = 0; b < 7; b++) {
+      bindings[b] = (VkDescriptorSetLayoutBinding){
+          .binding = b,
+          .descriptorCount = 1,
+          .descriptorType = b < 6 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+                                  : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      };
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 7,
+        .pBindings = &bindings[0],
+    };
+
+    vkCreateDescriptorSetLayout(rend->device, &layout_info, NULL,
+                                &culling->cull_layout);
+
+    VkBufferCreateInfo candidate_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = sizeof(vk_draw_candidate_t) * VK_MAX_DRAWS,
+        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    };
+
+    VmaAllocationCreateInfo candidate_alloc_info = {
+        .usage = VMA_MEMORY_USAGE_CPU_TO_GPU,
+    };
+
+    VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = rend->descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &culling->cull_layout,
+    };
+
+    VkDescriptorImageInfo pyramid_info = {
+        .sampler = rend->nearest_sampler,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .imageView = culling->pyramid_view,
+    };
+
+    for (int i = 0; i < 3; i++) {
+      vmaCreateBuffer(rend->allocator, &candidate_buffer_info,
+                      &candidate_alloc_info, &culling->candidate_buffers[i],
+                      &culling->candidate_allocs[i], NULL);
+
+      vkAllocateDescriptorSets(rend->device, &set_info, &culling->cull_sets[i]);
+
+      VkDescriptorBufferInfo buffer_infos[6] = {
+          {
+              .buffer = culling->candidate_buffers[i],
+              .offset = 0,
+              .range = sizeof(vk_draw_candidate_t) * VK_MAX_DRAWS,
+          },
+          {
+              .buffer = rend->draw_buffers[i],
+              .offset = VK_DRAW_COMMANDS_OFFSET,
+              .range = sizeof(VkDrawIndexedIndirectCommand) * VK_MAX_DRAWS,
+          },
+          {
+              .buffer = rend->draw_buffers[i],
+              .offset = VK_DRAW_RECORDS_OFFSET,
+              .range = sizeof(vk_draw_t) * VK_MAX_DRAWS,
+          },
+          {
+              .buffer = rend->draw_buffers[i],
+              .offset = VK_DRAW_IDS_OFFSET,
+              .range = sizeof(uint32_t) * VK_MAX_DRAWS,
+          },
+          {
+              .buffer = rend->draw_buffers[i],
+              .offset = VK_DRAW_COUNTS_OFFSET,
+              .range = VK_DRAW_BUFFER_SIZE - VK_DRAW_COUNTS_OFFSET,
+          },
+          {
+              .buffer = rend->meshlet_arena.buffer,
+              .offset = 0,
+              .range = VK_WHOLE_SIZE,
+          },
+      };
+
+      VkWriteDescriptorSet writes[7];
+      for (unsigned b = 0; b < 7; b++) {
+        writes[b] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = culling->cull_sets[i],
+            .dstBinding = b,
+            .descriptorCount = 1,
+            .descriptorType = bindings[b].descriptorType,
+        };
+        if (b < 6) {
+          writes[b].pBufferInfo = &buffer_infos[b];
+        } else {
+          writes[b].pImageInfo = &pyramid_info;
+        }
+      }
+      vkUpdateDescriptorSets(rend->device, 7, &writes[0], 0, NULL);
+    }
+
+    VkPushConstantRange push_constant_info = {
+        .offset = 0,
+        .size = sizeof(vk_cull_constants_t),
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+
+    // Instances are read from the global set, along with the view
+    VkDescriptorSetLayout layouts[] = {
+        rend->global_ubo_desc_set_layout,
+        culling->cull_layout,
+    };
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .pPushConstantRanges = &push_constant_info,
+        .pushConstantRangeCount = 1,
+        .setLayoutCount = 2,
+        .pSetLayouts = &layouts[0],
+    };
+
+    vkCreatePipelineLayout(rend->device, &pipeline_layout_info, NULL,
+                           &culling->cull_pipeline_layout);
+
+    if (!VK_CreateCullingPipeline(rend, "cull.comp.spv",
+                                  culling->cull_pipeline_layout,
+                                  &culling->cull_pipeline)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/// @brief Whether every triangle of a meshlet faces away from the eye, from
+/// its normal cone and its bounding sphere in world space.
+static bool VK_IsBackfacing(const vk_meshlet_t *meshlet,
+                            const vk_instance_t *instance, vec3 center,
+                            float radius, vec3 eye) {
+  if (meshlet->cone[3] >= 1.0f) {
+    return false;
+  }
+
+  // Normals go through the inverse transpose, and mirroring flips windings
+  mat4 normal_matrix;
+  glm_mat4_transpose_to((vec4 *)instance->inv_model, normal_matrix);
+  vec3 axis;
+  glm_mat4_mulv3(normal_matrix, (float *)meshlet->cone, 0.0f, axis);
+  glm_vec3_normalize(axis);
+
+  mat3 model;
+  glm_mat4_pick3((vec4 *)instance->model, model);
+  if (glm_mat3_det(model) < 0.0f) {
+    glm_vec3_negate(axis);
+  }
+
+  vec3 view;
+  glm_vec3_sub(center, eye, view);
+  return glm_vec3_dot(view, axis) >=
+         meshlet->cone[3] * glm_vec3_norm(view) + radius;
+}
+
+/// @brief Cull the instances of the candidates against the frustum and their
+/// normal cones on the CPU, and write the draws of the candidates with
+/// survivors at the start of their bucket in the draw buffer.
+static void VK_CullDrawsOnCpu(vk_rend_t *rend, unsigned candidate_count,
+                              unsigned id_count, const unsigned *firsts,
+                              unsigned *counts) {
+  vk_culling_t *culling = rend->culling;
+
+  // Boxes of the meshlets of every instance, moved to world space. The
+  // extents of a transformed box are the absolute transform of its extents
+  for (unsigned c = 0; c < candidate_count; c++) {
+    vk_draw_candidate_t *candidate = &culling->candidates[c];
+    vk_meshlet_t *meshlet = &rend->meshlets[candidate->meshlet];
+
+    for (unsigned n = 0; n < candidate->instance_count; n++) {
+      unsigned id = candidate->first_id + n;
+      vec4 *model = rend->instances[candidate->first_instance + n].model;
+
+      vec3 center;
+      glm_mat4_mulv3(model, meshlet->sphere, 1.0f, center);
+      for (unsigned i = 0; i < 3; i++) {
+        culling->box_centers[i][id] = center[i];
+        culling->box_extents[i][id] =
+            fabsf(model[0][i]) * meshlet->extents[0] +
+            fabsf(model[1][i]) * meshlet->extents[1] +
+            fabsf(model[2][i]) * meshlet->extents[2];
+      }
+    }
+  }
+
+  vk_frustum_t frustum;
+  VK_ExtractFrustum(rend->global_ubo.view_proj, &frustum);
+  box_test(&frustum, culling->box_centers, culling->box_extents, 0, id_count,
+           culling->visible);
+
+  mat4 inv_view;
+  glm_mat4_inv(rend->global_ubo.view, inv_view);
+
+  // Survivors are listed at the start of the ids of their candidate, and
+  // candidates with any are packed at the start of their bucket
+  void *data;
+  vmaMapMemory(rend->allocator, rend->draw_allocs[rend->current_frame % 3],
+               &data);
+  VkDrawIndexedIndirectCommand *commands =
+      (void *)((char *)data + VK_DRAW_COMMANDS_OFFSET);
+  vk_draw_t *draws = (void *)((char *)data + VK_DRAW_RECORDS_OFFSET);
+  uint32_t *ids = (void *)((char *)data + VK_DRAW_IDS_OFFSET);
+
+  memset(counts, 0, sizeof(unsigned) * VK_DRAW_BUCKET_COUNT);
+  unsigned visible_count = 0;
+  for (unsigned c = 0; c < candidate_count; c++) {
+    vk_draw_candidate_t *candidate = &culling->candidates[c];
+    vk_meshlet_t *meshlet = &rend->meshlets[candidate->meshlet];
+
+    unsigned survivor_count = 0;
+    for (unsigned n = 0; n < candidate->instance_count; n++) {
+      unsigned id = candidate->first_id + n;
+      if (!culling->visible[id]) {
+        continue;
+      }
+
+      unsigned i = candidate->first_instance + n;
+      vk_instance_t *instance = &rend->instances[i];
+
+      // Scaling makes the sphere grow with the longest axis
+      vec3 center = {culling->box_centers[0][id], culling->box_centers[1][id],
+                     culling->box_centers[2][id]};
+      float scale = glm_max(glm_max(glm_vec3_norm(instance->model[0]),
+                                    glm_vec3_norm(instance->model[1])),
+                            glm_vec3_norm(instance->model[2]));
+      if (VK_IsBackfacing(meshlet, instance, center,
+                          meshlet->sphere[3] * scale, inv_view[3])) {
+        continue;
+      }
+
+      ids[candidate->first_id + survivor_count++] = i;
+    }
+
+    if (survivor_count == 0) {
+      continue;
+    }
+
+    unsigned d = firsts[meshlet->bucket] + counts[meshlet->bucket]++;
+    commands[d] = (VkDrawIndexedIndirectCommand){
+        .indexCount = meshlet->index_count,
+        .instanceCount = survivor_count,
+        .firstIndex = meshlet->first_index,
+        .vertexOffset = meshlet->vertex_offset,
+        .firstInstance = candidate->first_id,
+    };
+    draws[d].texture_id = meshlet->texture_id;
+    visible_count += survivor_count;
+  }
+
+  vmaUnmapMemory(rend->allocator, rend->draw_allocs[rend->current_frame % 3]);
+
+  rend->stats.draw_count = id_count;
+  rend->stats.visible_draw_count = visible_count;
+}
+
+void VK_CullDraws(vk_rend_t *rend, unsigned candidate_count,
+                  unsigned id_count, const unsigned *firsts,
+                  unsigned *counts) {
+  if (!rend->gpu_culling) {
+    VK_CullDrawsOnCpu(rend, candidate_count, id_count, firsts, counts);
+    return;
+  }
+
+  VkCommandBuffer cmd = rend->graphics_command_buffer[rend->current_frame % 3];
+  vk_culling_t *culling = rend->culling;
+  unsigned slot = rend->current_frame % 3;
+
+  // The frame that used this slot is over, its survivors can be counted
+  if (rend->current_frame >= 3) {
+    uint32_t *visible_count;
+    vmaInvalidateAllocation(rend->allocator, culling->stats_allocs[slot], 0,
+                            VK_WHOLE_SIZE);
+    vmaMapMemory(rend->allocator, culling->stats_allocs[slot],
+                 (void **)&visible_count);
+
+    rend->stats.draw_count = culling->id_counts[slot];
+    rend->stats.visible_draw_count = *visible_count;
+
+    vmaUnmapMemory(rend->allocator, culling->stats_allocs[slot]);
+  }
+  culling->id_counts[slot] = id_count;
+
+  void *data;
+  vmaMapMemory(rend->allocator, culling->candidate_allocs[slot], &data);
+  memcpy(data, culling->candidates,
+         sizeof(vk_draw_candidate_t) * candidate_count);
+  vmaUnmapMemory(rend->allocator, culling->candidate_allocs[slot]);
+
+  // Survivors are counted from zero in each bucket, and in total
+  vkCmdFillBuffer(cmd, rend->draw_buffers[slot], VK_DRAW_COUNTS_OFFSET,
+                  VK_DRAW_BUFFER_SIZE - VK_DRAW_COUNTS_OFFSET, 0);
+
+  // Wait for the counts to be cleared, and the pyramid of the last frame to
+  // be written
+  VkMemoryBarrier before = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask =
+          VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+  };
+
+  vkCmdPipelineBarrier(cmd,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &before, 0,
+                       NULL, 0, NULL);
+
+  if (candidate_count != 0) {
+    vk_cull_constants_t constants = {
+        .depth_size = {rend->width, rend->height},
+        .candidate_count = candidate_count,
+        .occlusion = culling->pyramid_ready,
+    };
+    glm_mat4_copy(culling->pyramid_view_proj, constants.pyramid_view_proj);
+    memcpy(constants.firsts, firsts, sizeof(constants.firsts));
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      culling->cull_pipeline);
+
+    vkCmdBindDescriptorSets(
+        cmd, VK_PIPELINE_BIND_POINT_COMPUTE, culling->cull_pipeline_layout, 0,
+        1, &rend->global_ubo_desc_set[slot], 0, NULL);
+
+    vkCmdBindDescriptorSets(
+        cmd, VK_PIPELINE_BIND_POINT_COMPUTE, culling->cull_pipeline_layout, 1,
+        1, &culling->cull_sets[slot], 0, NULL);
+
+    vkCmdPushConstants(cmd, culling->cull_pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(vk_cull_constants_t), &constants);
+
+    vkCmdDispatch(cmd, (candidate_count + 63) / 64, 1, 1);
+  }
+
+  // Draws are read by the indirect calls, their records and instance ids by
+  // the vertex shader, and the surviving instances are copied for the stats
+  VkMemoryBarrier after = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                       VK_ACCESS_SHADER_READ_BIT |
+                       VK_ACCESS_TRANSFER_READ_BIT,
+  };
+
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 1, &after, 0, NULL, 0, NULL);
+
+  VkBufferCopy copy = {
+      .srcOffset = VK_DRAW_VISIBLE_OFFSET,
+      .dstOffset = 0,
+      .size = sizeof(uint32_t),
+  };
+  vkCmdCopyBuffer(cmd, rend->draw_buffers[slot], culling->stats_buffers[slot],
+                  1, &copy);
+
+  VkMemoryBarrier readback = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+  };
+
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &readback, 0, NULL,
+                       0, NULL);
+}
+
+
+void VK_BuildDepthPyramid(vk_rend_t *rend) {
+  // Occlusion is only tested by the culling pass
+  if (!rend->gpu_culling) {
+    return;
+  }
+
+  VkCommandBuffer cmd = rend->graphics_command_buffer[rend->current_frame % 3];
+  vk_culling_t *culling = rend->culling;
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    culling->pyramid_pipeline);
+
+  unsigned width = rend->width > 1 ? rend->width / 2 : 1;
+  unsigned height = rend->height > 1 ? rend->height / 2 : 1;
+  for (unsigned l = 0; l < culling->pyramid_levels; l++) {
+    // The culling of this frame is done reading the pyramid, and the level
+    // above is written
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier,
+                         0, NULL, 0, NULL);
+
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            culling->pyramid_pipeline_layout, 0, 1,
+                            &culling->pyramid_sets[l], 0, NULL);
+
+    unsigned level_width = width >> l > 0 ? width >> l : 1;
+    unsigned level_height = height >> l > 0 ? height >> l : 1;
+    vkCmdDispatch(cmd, (level_width + 7) / 8, (level_height + 7) / 8, 1);
+  }
+
+  // The next frame tests its candidates against this one
+  glm_mat4_copy(rend->global_ubo.view_proj, culling->pyramid_view_proj);
+  culling->pyramid_ready = true;
+}
+
+vk_frame_stats_t VK_GetFrameStats(vk_rend_t *rend) {
+  vk_frame_stats_t stats = rend->stats;
+  stats.gpu_culling = rend->gpu_culling;
+  return stats;
+}
+
+void VK_DestroyCulling(vk_rend_t *rend) {
+  vk_culling_t *culling = rend->culling;
+
+  free(culling->candidates);
+  for (unsigned i = 0; i < 3; i++) {
+    free(culling->box_centers[i]);
+    free(culling->box_extents[i]);
+  }
+  free(culling->visible);
+
+  for (int i = 0; i < 3; i++) {
+    vmaDestroyBuffer(rend->allocator, culling->candidate_buffers[i],
+                     culling->candidate_allocs[i]);
+    vmaDestroyBuffer(rend->allocator, culling->stats_buffers[i],
+                     culling->stats_allocs[i]);
+  }
+
+  for (unsigned l = 0; l < culling->pyramid_levels; l++) {
+    vkDestroyImageView(rend->device, culling->pyramid_level_views[l], NULL);
+  }
+  vkDestroyImageView(rend->device, culling->pyramid_view, NULL);
+  vmaDestroyImage(rend->allocator, culling->pyramid, culling->pyramid_alloc);
+
+  vkDestroyPipeline(rend->device, culling->cull_pipeline, NULL);
+  vkDestroyPipeline(rend->device, culling->pyramid_pipeline, NULL);
+  vkDestroyPipelineLayout(rend->device, culling->cull_pipeline_layout, NULL);
+  vkDestroyPipelineLayout(rend->device, culling->pyramid_pipeline_layout,
+                          NULL);
+  vkDestroyDescriptorSetLayout(rend->device, culling->cull_layout, NULL);
+  vkDestroyDescriptorSetLayout(rend->device, culling->pyramid_layout, NULL);
+}
@@ -1,9 +1,12 @@
 #include "vk.h"
 #include "vk_private.h"
 
+#include "cglm/cglm.h"
 #include "game/g_game.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -137,9 +140,6 @@ bool VK_InitGBuffer(vk_rend_t *rend) {
 
   // Prepare render targets by setting optimal tiling
   {
-    vkWaitForFences(rend->device, 1, &rend->transfer_fence, true, UINT64_MAX);
-    vkResetFences(rend->device, 1, &rend->transfer_fence);
-
     VkImageMemoryBarrier image_memory_barrier_position = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
         // .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
@@ -200,12 +200,9 @@ bool VK_InitGBuffer(vk_rend_t *rend) {
             .layerCount = 1,
         }};
 
-    VkCommandBufferBeginInfo begin_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    };
-
-    vkBeginCommandBuffer(rend->transfer_command_buffer, &begin_info);
+    // Transfer queues can't wait on attachment stages, so it's a one-off
+    // submission on the graphics queue
+    VkCommandBuffer cmd = VK_BeginImmediateCommands(rend);
 
     VkImageMemoryBarrier barriers[4] = {
         image_memory_barrier_albedo,
@@ -213,59 +210,95 @@ bool VK_InitGBuffer(vk_rend_t *rend) {
         image_memory_barrier_position,
         image_memory_barrier_depth,
     };
-    vkCmdPipelineBarrier(rend->transfer_command_buffer,
-                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
                          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0,
                          NULL, 0, NULL, 3, &barriers[0]);
 
-    vkCmdPipelineBarrier(rend->transfer_command_buffer,
-                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
                          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 0, 0, NULL,
                          0, NULL, 1, &barriers[3]);
 
-    vkEndCommandBuffer(rend->transfer_command_buffer);
-
-    VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &rend->transfer_command_buffer,
-    };
-
-    vkQueueSubmit(rend->graphics_queue, 1, &submit_info, rend->transfer_fence);
+    VK_SubmitImmediateCommands(rend, cmd);
   }
 
   {
-    VkVertexInputBindingDescription main_binding = {
-        .binding = 0,
-        .stride = sizeof(vertex_t),
-        .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-    };
-
-    VkVertexInputAttributeDescription pos_attribute = {
-        .binding = 0,
-        .location = 0,
-        .format = VK_FORMAT_R32G32B32_SFLOAT,
-        .offset = 0,
+    // One pipeline per vertex format. The vertex shader decodes octahedral
+    // normals when its specialization constant says so
+    VkVertexInputBindingDescription bindings[VERTEX_FORMAT_COUNT] = {
+        [VERTEX_FORMAT_FULL] =
+            {
+                .binding = 0,
+                .stride = sizeof(vertex_t),
+                .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+            },
+        [VERTEX_FORMAT_PACKED] =
+            {
+                .binding = 0,
+                .stride = sizeof(packed_vertex_t),
+                .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+            },
     };
 
-    VkVertexInputAttributeDescription norm_attribute = {
-        .binding = 0,
-        .location = 1,
-        .format = VK_FORMAT_R32G32B32_SFLOAT,
-        .offset = sizeof(float) * 3,
+    VkVertexInputAttributeDescription attributes[VERTEX_FORMAT_COUNT][3] = {
+        [VERTEX_FORMAT_FULL] =
+            {
+                [0] =
+                    {
+                        .binding = 0,
+                        .location = 0,
+                        .format = VK_FORMAT_R32G32B32_SFLOAT,
+                        .offset = offsetof(vertex_t, pos),
+                    },
+                [1] =
+                    {
+                        .binding = 0,
+                        .location = 1,
+                        .format = VK_FORMAT_R32G32B32_SFLOAT,
+                        .offset = offsetof(vertex_t, norm),
+                    },
+                [2] =
+                    {
+                        .binding = 0,
+                        .location = 2,
+                        .format = VK_FORMAT_R32G32_SFLOAT,
+                        .offset = offsetof(vertex_t, uv),
+                    },
+            },
+        [VERTEX_FORMAT_PACKED] =
+            {
+                [0] =
+                    {
+                        .binding = 0,
+                        .location = 0,
+                        .format = VK_FORMAT_R32G32B32_SFLOAT,
+                        .offset = offsetof(packed_vertex_t, pos),
+                    },
+                [1] =
+                    {
+                        .binding = 0,
+                        .location = 1,
+                        .format = VK_FORMAT_R16G16_SNORM,
+                        .offset = offsetof(packed_vertex_t, norm),
+                    },
+                [2] =
+                    {
+                        .binding = 0,
+                        .location = 2,
+                        .format = VK_FORMAT_R16G16_SFLOAT,
+                        .offset = offsetof(packed_vertex_t, uv),
+                    },
+            },
     };
 
-    VkVertexInputAttributeDescription uv_attribute = {
-        .binding = 0,
-        .location = 2,
-        .format = VK_FORMAT_R32G32_SFLOAT,
-        .offset = sizeof(float) * 3 * 2,
+    VkBool32 octahedral_normals[VERTEX_FORMAT_COUNT] = {
+        [VERTEX_FORMAT_FULL] = VK_FALSE,
+        [VERTEX_FORMAT_PACKED] = VK_TRUE,
     };
 
-    VkVertexInputAttributeDescription attributes[3] = {
-        [0] = pos_attribute,
-        [1] = norm_attribute,
-        [2] = uv_attribute,
+    VkSpecializationMapEntry octahedral_normal_entry = {
+        .constantID = 0,
+        .offset = 0,
+        .size = sizeof(VkBool32),
     };
 
     VkShaderModule vertex_shader =
@@ -331,9 +364,7 @@ bool VK_InitGBuffer(vk_rend_t *rend) {
     VkPipelineVertexInputStateCreateInfo input_state_info =
         VK_PipelineVertexInputStateCreateInfo();
 
-    input_state_info.pVertexAttributeDescriptions = &attributes[0];
     input_state_info.vertexAttributeDescriptionCount = 3;
-    input_state_info.pVertexBindingDescriptions = &main_binding;
     input_state_info.vertexBindingDescriptionCount = 1;
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly_info =
@@ -420,8 +451,22 @@ bool VK_InitGBuffer(vk_rend_t *rend) {
         .pDepthStencilState = &depth_state_info,
     };
 
-    vkCreateGraphicsPipelines(rend->device, VK_NULL_HANDLE, 1, &pipeline_info,
-                              NULL, &rend->gbuffer->pipeline);
+    for (vertex_format_t f = 0; f < VERTEX_FORMAT_COUNT; f++) {
+      VkSpecializationInfo specialization_info = {
+          .mapEntryCount = 1,
+          .pMapEntries = &octahedral_normal_entry,
+          .dataSize = sizeof(VkBool32),
+          .pData = &octahedral_normals[f],
+      };
+      stages[0].pSpecializationInfo = &specialization_info;
+
+      input_state_info.pVertexAttributeDescriptions = &attributes[f][0];
+      input_state_info.pVertexBindingDescriptions = &bindings[f];
+
+      vkCreateGraphicsPipelines(rend->device, VK_NULL_HANDLE, 1,
+                                &pipeline_info, NULL,
+                                &rend->gbuffer->pipelines[f]);
+    }
 
     vkDestroyShaderModule(rend->device, vertex_shader, NULL);
     vkDestroyShaderModule(rend->device, fragment_shader, NULL);
@@ -430,10 +475,143 @@ bool VK_InitGBuffer(vk_rend_t *rend) {
   return true;
 }
 
+/// @brief Write the transforms of the frame in its instance buffer: the
+/// identity of the map first, then the actors grouped by model, so that each
+/// model has a range of them. They're kept in `rend->instances` too.
+static void VK_UpdateInstances(vk_rend_t *rend, game_state_t *game) {
+  for (unsigned m = 0; m < rend->model_count; m++) {
+    rend->models[m].instance_count = 0;
+  }
+
+  unsigned actor_count = game->actor_count;
+  if (actor_count > VK_MAX_INSTANCES - 1) {
+    actor_count = VK_MAX_INSTANCES - 1;
+  }
+  for (unsigned a = 0; a < actor_count; a++) {
+    if (game->actors[a].model_id < rend->model_count) {
+      rend->models[game->actors[a].model_id].instance_count++;
+    }
+  }
+
+  unsigned first_instance = 1;
+  for (unsigned m = 0; m < rend->model_count; m++) {
+    rend->models[m].first_instance = first_instance;
+    first_instance += rend->models[m].instance_count;
+    rend->models[m].instance_count = 0;
+  }
+
+  vk_instance_t *instances = rend->instances;
+  glm_mat4_identity(instances[0].model);
+  glm_mat4_identity(instances[0].inv_model);
+
+  for (unsigned a = 0; a < actor_count; a++) {
+    if (game->actors[a].model_id >= rend->model_count) {
+      continue;
+    }
+
+    vk_model_t *model = &rend->models[game->actors[a].model_id];
+    vk_instance_t *instance =
+        &instances[model->first_instance + model->instance_count++];
+    glm_mat4_copy(game->actors[a].model, instance->model);
+    glm_mat4_copy(game->actors[a].inv_model, instance->inv_model);
+  }
+
+  void *data;
+  vmaMapMemory(rend->allocator, rend->instance_allocs[rend->current_frame % 3],
+               &data);
+  memcpy(data, instances, sizeof(vk_instance_t) * first_instance);
+  vmaUnmapMemory(rend->allocator,
+                 rend->instance_allocs[rend->current_frame % 3]);
+}
+
+/// @brief Append a draw candidate for every meshlet of a model, with all of
+/// its instances, and reserve their instance ids.
+/// @param id_count Incremented with the instance ids of each candidate.
+/// @param counts Incremented with the candidates of each bucket.
+/// @return false if the instance ids are full.
+static bool VK_PushModelCandidates(vk_rend_t *rend, vk_model_t *model,
+                                   unsigned first_instance,
+                                   unsigned instance_count,
+                                   vk_draw_candidate_t *candidates,
+                                   unsigned *candidate_count,
+                                   unsigned *id_count, unsigned *counts) {
+  // Models may still be streaming through the transfer queue
+  if (instance_count == 0 || !VK_IsModelUploaded(rend, model)) {
+    return true;
+  }
+
+  // There are at least as many ids as candidates, they fit as well
+  for (unsigned i = 0; i < model->meshlet_count; i++) {
+    if (*id_count + instance_count > VK_MAX_DRAWS) {
+      return false;
+    }
+
+    unsigned meshlet = model->first_meshlet + i;
+    candidates[(*candidate_count)++] = (vk_draw_candidate_t){
+        .meshlet = meshlet,
+        .first_instance = first_instance,
+        .instance_count = instance_count,
+        .first_id = *id_count,
+    };
+    *id_count += instance_count;
+    counts[rend->meshlets[meshlet].bucket]++;
+  }
+
+  return true;
+}
+
+/// @brief Gather the draw candidates of the frame in `culling->candidates`:
+/// the map, then every model with actors. Their buckets are laid out one
+/// after the other in the draw buffer, large enough for all of them to
+/// survive culling.
+/// @param id_count Instance ids reserved by the candidates.
+/// @param firsts First draw of each bucket.
+/// @param counts Candidate count of each bucket.
+/// @return Candidate count.
+static unsigned VK_UpdateDraws(vk_rend_t *rend, unsigned *id_count,
+                               unsigned *firsts, unsigned *counts) {
+  memset(counts, 0, sizeof(unsigned) * VK_DRAW_BUCKET_COUNT);
+
+  vk_draw_candidate_t *candidates = rend->culling->candidates;
+
+  // The map is the first instance, with an identity transform
+  unsigned candidate_count = 0;
+  *id_count = 0;
+  bool fits = VK_PushModelCandidates(rend, &rend->map, 0, 1, candidates,
+                                     &candidate_count, id_count, counts);
+  for (unsigned m = 0; m < rend->model_count && fits; m++) {
+    vk_model_t *model = &rend->models[m];
+    fits = VK_PushModelCandidates(rend, model, model->first_instance,
+                                  model->instance_count, candidates,
+                                  &candidate_count, id_count, counts);
+  }
+
+  if (!fits) {
+    printf("Instance ids don't fit in %d, some draws are left out.\n",
+           VK_MAX_DRAWS);
+  }
+
+  unsigned first = 0;
+  for (unsigned b = 0; b < VK_DRAW_BUCKET_COUNT; b++) {
+    firsts[b] = first;
+    first += counts[b];
+  }
+
+  return candidate_count;
+}
+
 void VK_DrawGBuffer(vk_rend_t *rend, game_state_t *game) {
-  vk_gbuffer_t *gbuffer = rend->gbuffer;
   VkCommandBuffer cmd = rend->graphics_command_buffer[rend->current_frame % 3];
 
+  VK_UpdateInstances(rend, game);
+
+  // Culling has to be over before rendering starts
+  unsigned firsts[VK_DRAW_BUCKET_COUNT];
+  unsigned counts[VK_DRAW_BUCKET_COUNT];
+  unsigned id_count;
+  unsigned candidate_count = VK_UpdateDraws(rend, &id_count, firsts, counts);
+  VK_CullDraws(rend, candidate_count, id_count, firsts, counts);
+
   if (rend->current_frame != 0) {
     VK_TransitionColorTexture(cmd, rend->gbuffer->position_target.image,
                               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
@@ -482,8 +660,6 @@ void VK_DrawGBuffer(vk_rend_t *rend, game_state_t *game) {
 
   vkCmdBeginRendering(cmd, &render_info);
 
-  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, gbuffer->pipeline);
-
   vkCmdBindDescriptorSets(
       cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, rend->gbuffer->pipeline_layout, 0,
       1, &rend->global_ubo_desc_set[rend->current_frame % 3], 0, NULL);
@@ -492,25 +668,44 @@ void VK_DrawGBuffer(vk_rend_t *rend, game_state_t *game) {
                           rend->gbuffer->pipeline_layout, 1, 1,
                           &rend->global_textures_desc_set, 0, NULL);
 
-  for (unsigned i = 0; i < rend->map.primitive_count; i++) {
-    VkDeviceSize offset = 0;
-    vkCmdPushConstants(cmd, rend->gbuffer->pipeline_layout,
-                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(unsigned), &i);
-    vkCmdBindVertexBuffers(cmd, 0, 1, &rend->map.vertex_buffers[i], &offset);
-    vkCmdBindIndexBuffer(cmd, rend->map.index_buffers[i], offset,
-                         VK_INDEX_TYPE_UINT32);
+  // Every primitive lives in the arenas: the vertex buffer is bound once,
+  // the index buffer and the pipeline only change with the formats
+  VkDeviceSize offset = 0;
+  vkCmdBindVertexBuffers(cmd, 0, 1, &rend->vertex_arena.buffer, &offset);
+
+  // The whole scene goes out in one indirect call per bucket, with as many
+  // draws as survived culling. Counted on the GPU, they're only known from
+  // the draw buffer. The vertex shader finds the record of its draw at
+  // `first_draw + gl_DrawID`, and its instance in the ids at
+  // `gl_InstanceIndex`
+  VkBuffer draw_buffer = rend->draw_buffers[rend->current_frame % 3];
+  for (unsigned b = 0; b < VK_DRAW_BUCKET_COUNT; b++) {
+    if (counts[b] == 0) {
+      continue;
+    }
 
-    vkCmdDrawIndexed(cmd, rend->map.index_counts[i], 1, 0, 0, 0);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      rend->gbuffer->pipelines[b / 2]);
+    vkCmdBindIndexBuffer(cmd, rend->index_arena.buffer, 0,
+                         b % 2 ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+    vkCmdPushConstants(cmd, rend->gbuffer->pipeline_layout,
+                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(unsigned),
+                       &firsts[b]);
+
+    VkDeviceSize commands_offset =
+        VK_DRAW_COMMANDS_OFFSET +
+        sizeof(VkDrawIndexedIndirectCommand) * firsts[b];
+    if (rend->gpu_culling) {
+      vkCmdDrawIndexedIndirectCount(
+          cmd, draw_buffer, commands_offset, draw_buffer,
+          VK_DRAW_COUNTS_OFFSET + sizeof(uint32_t) * b, counts[b],
+          sizeof(VkDrawIndexedIndirectCommand));
+    } else {
+      vkCmdDrawIndexedIndirect(cmd, draw_buffer, commands_offset, counts[b],
+                               sizeof(VkDrawIndexedIndirectCommand));
+    }
   }
 
-//   for (unsigned i = 0; i < rend->model_count; i++) {
-//     vk_model_t *model = &rend->models[i];
-
-//     for (unsigned j = 0; j < model->primitive_count; j++) {
-//       vkCmdBindVertexBuffers(cmd, mode)
-//     }
-//   }
-
   vkCmdEndRendering(cmd);
 }
 
@@ -535,6 +730,8 @@ void VK_DestroyGBuffer(vk_rend_t *rend) {
   vmaDestroyImage(rend->allocator, rend->gbuffer->normal_target.image,
                   rend->gbuffer->normal_target.alloc);
 
-  vkDestroyPipeline(rend->device, rend->gbuffer->pipeline, NULL);
+  for (vertex_format_t f = 0; f < VERTEX_FORMAT_COUNT; f++) {
+    vkDestroyPipeline(rend->device, rend->gbuffer->pipelines[f], NULL);
+  }
   vkDestroyPipelineLayout(rend->device, rend->gbuffer->pipeline_layout, NULL);
 }
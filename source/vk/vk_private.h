@@ -18,8 +18,31 @@ bool VK_InitShading(vk_rend_t *rend);
 void VK_DrawShading(vk_rend_t *rend, game_state_t *game);
 void VK_DestroyShading(vk_rend_t *rend);
 
+bool VK_InitCulling(vk_rend_t *rend);
+/// @brief Test the draw candidates of the frame against the frustum and their
+/// normal cones, and the depth pyramid of the last one on the GPU, then write
+/// the survivors as indirect draws.
+/// @param candidate_count Candidates in `culling->candidates`.
+/// @param id_count Instance ids reserved by the candidates.
+/// @param firsts First draw of each bucket.
+/// @param counts Candidate count of each bucket. Culled on the CPU, it's
+/// replaced by the draw count, else it's left as the upper bound.
+void VK_CullDraws(vk_rend_t *rend, unsigned candidate_count,
+                  unsigned id_count, const unsigned *firsts,
+                  unsigned *counts);
+/// @brief Reduce the depth target of the frame to the pyramid culling the
+/// next one. Done once shading is over.
+void VK_BuildDepthPyramid(vk_rend_t *rend);
+void VK_DestroyCulling(vk_rend_t *rend);
+
 // VK utils
 VkShaderModule VK_LoadShaderModule(vk_rend_t *rend, const char *path);
+/// @brief Command buffer for one-off work on the graphics queue, outside of
+/// any frame. Meant for initialization only.
+VkCommandBuffer VK_BeginImmediateCommands(vk_rend_t *rend);
+/// @brief Submit a command buffer from `VK_BeginImmediateCommands`, and wait
+/// for the graphics queue to be idle.
+void VK_SubmitImmediateCommands(vk_rend_t *rend, VkCommandBuffer cmd);
 
 void VK_TransitionColorTexture(VkCommandBuffer cmd, VkImage image,
                                VkImageLayout from_layout,
@@ -34,6 +57,64 @@ void VK_TransitionDepthTexture(VkCommandBuffer cmd, VkImage image,
                                VkPipelineStageFlags to_stage,
                                VkAccessFlags access_mask);
 
+typedef struct vk_arena_t vk_arena_t;
+
+bool VK_CreateArena(vk_rend_t *rend, vk_arena_t *arena, VkDeviceSize size,
+                    VkBufferUsageFlags usage);
+/// @brief Reserve a range of an arena.
+/// @param alignment Any value, not only powers of two, so that offsets can be
+/// a multiple of a vertex size.
+/// @return false if the arena is full.
+bool VK_AllocateArena(vk_arena_t *arena, VkDeviceSize size,
+                      VkDeviceSize alignment, VkDeviceSize *offset);
+void VK_DestroyArena(vk_rend_t *rend, vk_arena_t *arena);
+
+bool VK_InitUploads(vk_rend_t *rend);
+void VK_DestroyUploads(vk_rend_t *rend);
+/// @brief Command buffer of the batch of uploads being recorded, to copy from
+/// the staging ring. It runs on the transfer queue, so only transfer commands
+/// and barriers can be recorded. Don't keep it across `VK_AllocateStaging`,
+/// which may submit the batch when the ring is full.
+VkCommandBuffer VK_GetUploadCommandBuffer(vk_rend_t *rend);
+/// @brief Take space from the staging ring, for the batch being recorded.
+/// @param offset Offset of the space in `uploads->ring`.
+/// @return Where to write, or NULL if it's larger than the ring.
+void *VK_AllocateStaging(vk_rend_t *rend, VkDeviceSize size,
+                         VkDeviceSize *offset);
+/// @brief Copy data to a buffer. The copy is only recorded when the batch is
+/// submitted, along with every other copy to the same buffer. Data larger
+/// than the ring is staged in pieces, over several batches.
+/// @return false if the data couldn't be staged.
+bool VK_UploadBuffer(vk_rend_t *rend, VkBuffer dst, VkDeviceSize dst_offset,
+                     const void *data, VkDeviceSize size);
+/// @brief Copy the levels of an RGBA8 image, following each other in `data`,
+/// and release it with `VK_ReleaseUploadedImage`. Levels are staged one band
+/// of rows at a time, over several batches if needed.
+/// @return false, with nothing recorded, if a row is larger than the ring.
+bool VK_UploadImage(vk_rend_t *rend, VkImage image, VkExtent3D extent,
+                    unsigned mip_count, const void *data);
+/// @brief Hand an image filled by the batch being recorded over to the
+/// graphics queue, in `VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL`.
+void VK_ReleaseUploadedImage(vk_rend_t *rend, VkImage image,
+                             VkImageSubresourceRange range);
+/// @brief Submit the batch of uploads being recorded, if any, to the transfer
+/// queue. Done once per frame, before drawing it. Nothing waits for it.
+void VK_FlushUploads(vk_rend_t *rend);
+/// @brief Give the ring space of the batches that are over back, and queue
+/// what they wrote to be acquired by the next frame.
+/// @param wait Wait for every batch in flight.
+void VK_ReleaseUploads(vk_rend_t *rend, bool wait);
+/// @brief Take ownership of everything the batches over so far wrote, in a
+/// frame command buffer.
+/// @return Value of `uploads->timeline` the frame has to wait for.
+uint64_t VK_AcquireUploads(vk_rend_t *rend, VkCommandBuffer cmd);
+/// @brief Value of `uploads->timeline` once everything staged so far is
+/// uploaded.
+uint64_t VK_GetUploadValue(vk_rend_t *rend);
+/// @brief Whether the uploads of a model are visible to the frame being
+/// recorded, i.e. acquired by `VK_AcquireUploads`.
+bool VK_IsModelUploaded(vk_rend_t *rend, vk_model_t *model);
+
 extern VkResult (*vkSetDebugUtilsObjectName)(
     VkDevice device, const VkDebugUtilsObjectNameInfoEXT *pNameInfo);
 
@@ -58,7 +139,8 @@ typedef struct vk_shading_t {
 
 typedef struct vk_gbuffer_t {
   VkPipelineLayout pipeline_layout;
-  VkPipeline pipeline;
+  // One per vertex format, they only differ by their vertex input
+  VkPipeline pipelines[VERTEX_FORMAT_COUNT];
 
   render_target_t depth_target;
   render_target_t position_target;
@@ -66,30 +148,213 @@ typedef struct vk_gbuffer_t {
   render_target_t albedo_target;
 } vk_gbuffer_t;
 
+// Size of the bindless texture array, shared by every model
+#define VK_MAX_BINDLESS_TEXTURES 16
+// Upper bound of the anisotropy of model textures, past which sharpness
+// isn't worth the bandwidth
+#define VK_MAX_ANISOTROPY 16.0f
+// Staging memory shared by every upload, and batches of uploads in flight
+#define VK_STAGING_RING_SIZE (32 * 1024 * 1024)
+#define VK_UPLOAD_BATCH_COUNT 2
+
+// Transforms drawn per frame: the map's identity, then every actor
+#define VK_MAX_INSTANCES (GAME_MAX_ACTORS + 1)
+
+// Instance ids per frame, one per meshlet of each drawn instance. Draw
+// candidates, one per meshlet of each drawn model, are fewer. The ones
+// surviving culling are sorted in buckets sharing a pipeline and an index
+// type
+#define VK_MAX_DRAWS 65536
+#define VK_DRAW_BUCKET_COUNT (VERTEX_FORMAT_COUNT * 2)
+
+// Sizes of the arenas holding the vertices and indices of every model
+#define VK_VERTEX_ARENA_SIZE (64 * 1024 * 1024)
+#define VK_INDEX_ARENA_SIZE (32 * 1024 * 1024)
+// Meshlets of every model, about one for 40 vertices
+#define VK_MAX_MESHLETS (128 * 1024)
+
+/// @brief Sub-allocated GPU buffer, shared by the vertices, the indices or
+/// the meshlets of every model. Allocations are only ever appended, and
+/// released all at once with the renderer.
+typedef struct vk_arena_t {
+  VkBuffer buffer;
+  VmaAllocation alloc;
+  VkDeviceSize size;
+  VkDeviceSize used;
+} vk_arena_t;
+
+typedef struct vk_buffer_copy_t {
+  VkBuffer dst;
+  VkBufferCopy region;
+} vk_buffer_copy_t;
+
+/// @brief Barriers giving the graphics queue ownership of uploaded resources.
+/// They mirror the release barriers recorded on the transfer queue.
+typedef struct vk_acquires_t {
+  VkBufferMemoryBarrier *buffers;
+  unsigned buffer_count;
+  unsigned buffer_capacity;
+
+  VkImageMemoryBarrier *images;
+  unsigned image_count;
+  unsigned image_capacity;
+} vk_acquires_t;
+
+/// @brief Submission of every upload recorded during a frame.
+typedef struct vk_upload_batch_t {
+  VkCommandBuffer cmd;
+  // Value of the timeline once the batch is over
+  uint64_t value;
+  // Ring space read by the batch, including what was skipped to wrap around
+  VkDeviceSize ring_bytes;
+  bool submitted;
+
+  vk_acquires_t acquires;
+} vk_upload_batch_t;
+
+typedef struct vk_uploads_t {
+  // Persistently mapped staging ring
+  VkBuffer ring;
+  VmaAllocation ring_alloc;
+  char *ring_data;
+  // Next byte to allocate, and bytes in use before it, up to the oldest
+  // batch in flight
+  VkDeviceSize ring_head;
+  VkDeviceSize ring_used;
+
+  vk_upload_batch_t batches[VK_UPLOAD_BATCH_COUNT];
+  unsigned current_batch;
+  bool recording;
+
+  // Signaled by the transfer queue with the value of each batch. Batches
+  // over, but not acquired by a frame yet, are between `acquired_value` and
+  // `completed_value`
+  VkSemaphore timeline;
+  uint64_t next_value;
+  uint64_t completed_value;
+  uint64_t acquired_value;
+  vk_acquires_t pending_acquires;
+
+  // Buffer copies of the batch being recorded
+  vk_buffer_copy_t *copies;
+  unsigned copy_count;
+  unsigned copy_capacity;
+} vk_uploads_t;
+
+/// @brief Transform of a drawn instance, as read by the G-buffer vertex shader
+/// through `gl_InstanceIndex`, and by culling.
+typedef struct vk_instance_t {
+  mat4 model;
+  mat4 inv_model;
+} vk_instance_t;
+
+/// @brief What a draw needs besides its command, read by the G-buffer vertex
+/// shader at `first_draw + gl_DrawID`.
+typedef struct vk_draw_t {
+  uint32_t texture_id;
+} vk_draw_t;
+
+/// @brief Meshlet of a model, with everything needed to cull and draw it.
+/// Laid out as the culling compute shader reads it from the meshlet arena.
+typedef struct vk_meshlet_t {
+  // Bounding sphere, in model space
+  vec4 sphere;
+  // Axis of the normal cone, then the sine of its angle, see `meshlet_t`
+  vec4 cone;
+  // Half size of the bounding box, centered on the sphere. Only the CPU
+  // culls boxes
+  vec3 extents;
+  uint32_t bucket;
+  // Where its indices are in the arenas, as `vkCmdDrawIndexed` expects them
+  uint32_t index_count;
+  uint32_t first_index;
+  int32_t vertex_offset;
+  uint32_t texture_id;
+} vk_meshlet_t;
+
+/// @brief Meshlet of a model, drawn once with every instance surviving
+/// culling.
+typedef struct vk_draw_candidate_t {
+  uint32_t meshlet;
+  // Instances of the model in `rend->instances`
+  uint32_t first_instance;
+  uint32_t instance_count;
+  // Where the survivors are listed in the instance ids, as many as there
+  // are instances. It's the `firstInstance` of the draw
+  uint32_t first_id;
+} vk_draw_candidate_t;
+
+// Sections of a frame's draw buffer, written by the culling pass: commands,
+// then the record of each draw, then the instance ids read through
+// `gl_InstanceIndex`, then the draw count of each bucket and the count of
+// surviving instances
+#define VK_DRAW_COMMANDS_OFFSET 0
+#define VK_DRAW_RECORDS_OFFSET                                                 \
+  (sizeof(VkDrawIndexedIndirectCommand) * VK_MAX_DRAWS)
+#define VK_DRAW_IDS_OFFSET                                                     \
+  (VK_DRAW_RECORDS_OFFSET + sizeof(vk_draw_t) * VK_MAX_DRAWS)
+#define VK_DRAW_COUNTS_OFFSET                                                  \
+  (VK_DRAW_IDS_OFFSET + sizeof(uint32_t) * VK_MAX_DRAWS)
+#define VK_DRAW_VISIBLE_OFFSET                                                 \
+  (VK_DRAW_COUNTS_OFFSET + sizeof(uint32_t) * VK_DRAW_BUCKET_COUNT)
+#define VK_DRAW_BUFFER_SIZE (VK_DRAW_VISIBLE_OFFSET + sizeof(uint32_t))
+
+// Enough levels for a depth target 2^16 pixels wide
+#define VK_MAX_PYRAMID_LEVELS 16
+
+typedef struct vk_culling_t {
+  VkDescriptorSetLayout cull_layout;
+  VkPipelineLayout cull_pipeline_layout;
+  VkPipeline cull_pipeline;
+  VkDescriptorSet cull_sets[3];
+
+  // Draw candidates of the frame being recorded, culled here or copied to
+  // the candidates of the frame
+  vk_draw_candidate_t *candidates;
+  VkBuffer candidate_buffers[3];
+  VmaAllocation candidate_allocs[3];
+
+  // Boxes of the meshlets of every instance in world space, one array per
+  // component and indexed like the instance ids, culled a few at a time on
+  // the CPU
+  float *box_centers[3];
+  float *box_extents[3];
+  bool *visible;
+
+  // Surviving instances, read back once the frame is over
+  VkBuffer stats_buffers[3];
+  VmaAllocation stats_allocs[3];
+  unsigned id_counts[3];
+
+  // Farthest depth of the last frame. Level 0 is half the resolution of the
+  // depth target, and odd sizes are folded in the last row and column
+  VkImage pyramid;
+  VmaAllocation pyramid_alloc;
+  VkImageView pyramid_view;
+  VkImageView pyramid_level_views[VK_MAX_PYRAMID_LEVELS];
+  unsigned pyramid_levels;
+
+  VkDescriptorSetLayout pyramid_layout;
+  VkPipelineLayout pyramid_pipeline_layout;
+  VkPipeline pyramid_pipeline;
+  VkDescriptorSet pyramid_sets[VK_MAX_PYRAMID_LEVELS];
+
+  // View-projection the pyramid was rendered with, if it was at all
+  mat4 pyramid_view_proj;
+  bool pyramid_ready;
+} vk_culling_t;
+
 typedef struct vk_model_t {
-  // Only GPU Visible
-  VkBuffer *vertex_buffers;
-  VmaAllocation *vertex_allocs;
-  VkBuffer *index_buffers;
-  VmaAllocation *index_allocs;
-  // Staging buffers
-  VkBuffer *vertex_staging_buffers;
-  VmaAllocation *vertex_staging_allocs;
-  VkBuffer *index_staging_buffers;
-  VmaAllocation *index_staging_allocs;
-  // Only GPU Visible
-  VkImage *textures;
-  VkImageView *texture_views;
-  VmaAllocation *textures_allocs;
-  // Staging textures
-  VkBuffer *textures_staging;
-  VmaAllocation *textures_staging_allocs;
-
-  // How much should be drawn
-  unsigned *index_counts;
-
-  unsigned primitive_count;
-  unsigned texture_count;
+  // Range of the meshlet arena holding the meshlets of every primitive
+  unsigned first_meshlet;
+  unsigned meshlet_count;
+
+  // Value of `uploads->timeline` once every primitive and texture is there
+  uint64_t upload_value;
+
+  // Range of the instance buffer holding its actors, for the current frame
+  unsigned first_instance;
+  unsigned instance_count;
 } vk_model_t;
 
 typedef struct vk_global_ubo_t {
@@ -105,7 +370,9 @@ struct vk_rend_t {
   VkPhysicalDevice physical_device;
   VkDevice device;
   VkQueue graphics_queue;
-  // VkQueue transfer_queue;
+  // Dedicated to uploads when the device has a transfer-only family, else the
+  // graphics queue itself
+  VkQueue transfer_queue;
   VkSurfaceKHR surface;
   VkSwapchainKHR swapchain;
 
@@ -120,13 +387,11 @@ struct vk_rend_t {
   VkSemaphore swapchain_render_semaphore[3];
 
   VkFence rend_fence[3];
-  VkFence transfer_fence;
 
   // Yes only one, because i come from OpenGL...
   VkCommandPool graphics_command_pool;
   VkCommandBuffer graphics_command_buffer[3];
-  // VkCommandPool transfer_command_pool;
-  VkCommandBuffer transfer_command_buffer;
+  VkCommandPool transfer_command_pool;
   VkDescriptorPool descriptor_pool;
   VkDescriptorPool descriptor_bindless_pool;
 
@@ -139,16 +404,44 @@ struct vk_rend_t {
   VkBuffer global_buffers[3];
   VmaAllocation global_allocs[3];
 
+  // Instance transforms of each frame, bound along with the global UBO. The
+  // ones of the frame being recorded are kept around for CPU culling
+  vk_instance_t *instances;
+  VkBuffer instance_buffers[3];
+  VmaAllocation instance_allocs[3];
+  // Indirect draws of each frame, see `VK_DRAW_COMMANDS_OFFSET`. Only
+  // written by the GPU
+  VkBuffer draw_buffers[3];
+  VmaAllocation draw_allocs[3];
+
   VkSampler nearest_sampler;
   VkSampler linear_sampler;
+  // Trilinear, and anisotropic when supported. Used by every model texture
+  VkSampler anisotropic_sampler;
 
   vk_gbuffer_t *gbuffer;
   vk_shading_t *shading;
+  vk_culling_t *culling;
+  vk_uploads_t *uploads;
 
   VmaAllocator allocator;
 
+  // Every texture uploaded so far, in the order of the bindless array. Models
+  // sharing a texture point to the same one
+  VkImage textures[VK_MAX_BINDLESS_TEXTURES];
+  VkImageView texture_views[VK_MAX_BINDLESS_TEXTURES];
+  VmaAllocation textures_allocs[VK_MAX_BINDLESS_TEXTURES];
+  unsigned texture_count;
+
+  vk_arena_t vertex_arena;
+  vk_arena_t index_arena;
+  // Read by the culling pass, and by the CPU from its copy when it culls
+  vk_arena_t meshlet_arena;
+  vk_meshlet_t *meshlets;
+
   // TODO: shouldn't be there, but this is a speedrun
   vk_model_t map;
+  bool has_map;
   vk_model_t models[256];
   unsigned model_count;
 
@@ -156,6 +449,11 @@ struct vk_rend_t {
 
   unsigned current_frame;
 
+  // Whether draws are culled by a compute pass, which needs
+  // `drawIndirectCount`
+  bool gpu_culling;
+  vk_frame_stats_t stats;
+
   unsigned width;
   unsigned height;
 };
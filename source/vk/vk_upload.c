@@ -0,0 +1,560 @@
+#include "vk.h"
+#include "vk_private.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Uploads go through a single, persistently mapped staging ring. Space is
+// taken with a bump pointer, and given back once the batch reading it is
+// over. Batches gather every upload of a frame, and are submitted to the
+// transfer queue right before the frame is drawn, without waiting for them.
+//
+// Each batch signals a timeline semaphore once over. When the transfer queue
+// has its own family, what it wrote is released to the graphics family, and
+// acquired by the first frame recorded after the batch is seen over. That
+// frame waits on the timeline, and only then draws the models of the batch.
+
+// Offsets in the ring suit any texel and any vertex
+#define VK_STAGING_ALIGN 16
+// Uploads larger than this are staged in pieces, so that they don't have to
+// fit in the ring at once, and a piece can be staged while the batches
+// holding the previous ones are copied
+#define VK_STAGING_PIECE_SIZE (VK_STAGING_RING_SIZE / 4)
+
+bool VK_InitUploads(vk_rend_t *rend) {
+  if (rend->uploads) {
+    printf("Uploads seem to be already initialized.\n");
+    return false;
+  }
+
+  rend->uploads = calloc(1, sizeof(vk_uploads_t));
+  vk_uploads_t *uploads = rend->uploads;
+
+  VkBufferCreateInfo ring_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = VK_STAGING_RING_SIZE,
+      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+  };
+  VmaAllocationCreateInfo ring_alloc_info = {
+      .usage = VMA_MEMORY_USAGE_CPU_TO_GPU,
+  };
+
+  if (vmaCreateBuffer(rend->allocator, &ring_info, &ring_alloc_info,
+                      &uploads->ring, &uploads->ring_alloc,
+                      NULL) != VK_SUCCESS) {
+    printf("Couldn't allocate the staging ring.\n");
+    return false;
+  }
+  vmaMapMemory(rend->allocator, uploads->ring_alloc,
+               (void **)&uploads->ring_data);
+
+  VkCommandBuffer cmds[VK_UPLOAD_BATCH_COUNT];
+  VkCommandBufferAllocateInfo allocate_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = rend->transfer_command_pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = VK_UPLOAD_BATCH_COUNT,
+  };
+  vkAllocateCommandBuffers(rend->device, &allocate_info, &cmds[0]);
+
+  for (unsigned b = 0; b < VK_UPLOAD_BATCH_COUNT; b++) {
+    uploads->batches[b].cmd = cmds[b];
+  }
+
+  VkSemaphoreTypeCreateInfo timeline_type = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue = 0,
+  };
+  VkSemaphoreCreateInfo timeline_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &timeline_type,
+  };
+  if (vkCreateSemaphore(rend->device, &timeline_info, NULL,
+                        &uploads->timeline) != VK_SUCCESS) {
+    printf("Couldn't create the upload timeline.\n");
+    return false;
+  }
+  uploads->next_value = 1;
+
+  return true;
+}
+
+/// @brief Whether uploads have to change queue family to be drawn.
+static bool VK_TransferOwnership(vk_rend_t *rend) {
+  return rend->queue_family_transfer_index != rend->queue_family_graphics_index;
+}
+
+static void VK_PushBufferAcquire(vk_acquires_t *acquires,
+                                 VkBufferMemoryBarrier barrier) {
+  if (acquires->buffer_count == acquires->buffer_capacity) {
+    acquires->buffer_capacity =
+        acquires->buffer_capacity ? acquires->buffer_capacity * 2 : 8;
+    acquires->buffers =
+        realloc(acquires->buffers,
+                sizeof(VkBufferMemoryBarrier) * acquires->buffer_capacity);
+  }
+  acquires->buffers[acquires->buffer_count++] = barrier;
+}
+
+static void VK_PushImageAcquire(vk_acquires_t *acquires,
+                                VkImageMemoryBarrier barrier) {
+  if (acquires->image_count == acquires->image_capacity) {
+    acquires->image_capacity =
+        acquires->image_capacity ? acquires->image_capacity * 2 : 8;
+    acquires->images =
+        realloc(acquires->images,
+                sizeof(VkImageMemoryBarrier) * acquires->image_capacity);
+  }
+  acquires->images[acquires->image_count++] = barrier;
+}
+
+/// @brief Append the barriers of `src` to `dst`, and empty `src`.
+static void VK_MoveAcquires(vk_acquires_t *dst, vk_acquires_t *src) {
+  for (unsigned b = 0; b < src->buffer_count; b++) {
+    VK_PushBufferAcquire(dst, src->buffers[b]);
+  }
+  for (unsigned i = 0; i < src->image_count; i++) {
+    VK_PushImageAcquire(dst, src->images[i]);
+  }
+  src->buffer_count = 0;
+  src->image_count = 0;
+}
+
+static void VK_FreeAcquires(vk_acquires_t *acquires) {
+  free(acquires->buffers);
+  free(acquires->images);
+  memset(acquires, 0, sizeof(vk_acquires_t));
+}
+
+/// @brief Give the ring space of the oldest batch in flight back.
+/// @return false if no batch is in flight.
+static bool VK_ReleaseOldestBatch(vk_rend_t *rend, bool wait) {
+  vk_uploads_t *uploads = rend->uploads;
+
+  // Batches are submitted in order, starting with the current one
+  for (unsigned i = 0; i < VK_UPLOAD_BATCH_COUNT; i++) {
+    vk_upload_batch_t *batch =
+        &uploads->batches[(uploads->current_batch + i) % VK_UPLOAD_BATCH_COUNT];
+    if (!batch->submitted) {
+      continue;
+    }
+
+    if (wait) {
+      VkSemaphoreWaitInfo wait_info = {
+          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+          .semaphoreCount = 1,
+          .pSemaphores = &uploads->timeline,
+          .pValues = &batch->value,
+      };
+      vkWaitSemaphores(rend->device, &wait_info, UINT64_MAX);
+    } else {
+      uint64_t value = 0;
+      vkGetSemaphoreCounterValue(rend->device, uploads->timeline, &value);
+      if (value < batch->value) {
+        return false;
+      }
+    }
+
+    uploads->ring_used -= batch->ring_bytes;
+    batch->ring_bytes = 0;
+    batch->submitted = false;
+
+    // The next frame takes ownership of what the batch wrote
+    VK_MoveAcquires(&uploads->pending_acquires, &batch->acquires);
+    uploads->completed_value = batch->value;
+    return true;
+  }
+
+  return false;
+}
+
+void VK_ReleaseUploads(vk_rend_t *rend, bool wait) {
+  while (VK_ReleaseOldestBatch(rend, wait)) {
+  }
+}
+
+VkCommandBuffer VK_GetUploadCommandBuffer(vk_rend_t *rend) {
+  vk_uploads_t *uploads = rend->uploads;
+  vk_upload_batch_t *batch = &uploads->batches[uploads->current_batch];
+
+  if (!uploads->recording) {
+    // The command buffer is still read by its previous submission
+    while (batch->submitted) {
+      VK_ReleaseOldestBatch(rend, true);
+    }
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    vkBeginCommandBuffer(batch->cmd, &begin_info);
+    uploads->recording = true;
+  }
+
+  return batch->cmd;
+}
+
+void *VK_AllocateStaging(vk_rend_t *rend, VkDeviceSize size,
+                         VkDeviceSize *offset) {
+  vk_uploads_t *uploads = rend->uploads;
+  if (size > VK_STAGING_RING_SIZE) {
+    printf("%llu bytes can't go through the staging ring.\n",
+           (unsigned long long)size);
+    return NULL;
+  }
+
+  for (;;) {
+    VK_GetUploadCommandBuffer(rend);
+    vk_upload_batch_t *batch = &uploads->batches[uploads->current_batch];
+    if (uploads->ring_used == 0) {
+      uploads->ring_head = 0;
+    }
+
+    // Wrap around when the end of the ring is too close, wasting the rest
+    VkDeviceSize start = (uploads->ring_head + VK_STAGING_ALIGN - 1) /
+                         VK_STAGING_ALIGN * VK_STAGING_ALIGN;
+    VkDeviceSize consumed = start + size - uploads->ring_head;
+    if (start + size > VK_STAGING_RING_SIZE) {
+      start = 0;
+      consumed = VK_STAGING_RING_SIZE - uploads->ring_head + size;
+    }
+
+    if (uploads->ring_used + consumed <= VK_STAGING_RING_SIZE) {
+      uploads->ring_head = start + size;
+      uploads->ring_used += consumed;
+      batch->ring_bytes += consumed;
+
+      *offset = start;
+      return uploads->ring_data + start;
+    }
+
+    // Full: wait for the oldest batch, or submit this one and wait for it
+    if (!VK_ReleaseOldestBatch(rend, true)) {
+      VK_FlushUploads(rend);
+    }
+  }
+}
+
+bool VK_UploadBuffer(vk_rend_t *rend, VkBuffer dst, VkDeviceSize dst_offset,
+                     const void *data, VkDeviceSize size) {
+  vk_uploads_t *uploads = rend->uploads;
+
+  // Staging a piece may submit the batch holding the previous ones, with
+  // their copies
+  const char *bytes = data;
+  for (VkDeviceSize done = 0; done < size;) {
+    VkDeviceSize piece_size = size - done < VK_STAGING_PIECE_SIZE
+                                  ? size - done
+                                  : VK_STAGING_PIECE_SIZE;
+
+    VkDeviceSize src_offset;
+    void *staging = VK_AllocateStaging(rend, piece_size, &src_offset);
+    if (!staging) {
+      return false;
+    }
+    memcpy(staging, bytes + done, piece_size);
+
+    if (uploads->copy_count == uploads->copy_capacity) {
+      uploads->copy_capacity =
+          uploads->copy_capacity ? uploads->copy_capacity * 2 : 64;
+      uploads->copies = realloc(uploads->copies, sizeof(vk_buffer_copy_t) *
+                                                     uploads->copy_capacity);
+    }
+    uploads->copies[uploads->copy_count++] = (vk_buffer_copy_t){
+        .dst = dst,
+        .region =
+            {
+                .srcOffset = src_offset,
+                .dstOffset = dst_offset + done,
+                .size = piece_size,
+            },
+    };
+
+    done += piece_size;
+  }
+
+  return true;
+}
+
+bool VK_UploadImage(vk_rend_t *rend, VkImage image, VkExtent3D extent,
+                    unsigned mip_count, const void *data) {
+  vk_uploads_t *uploads = rend->uploads;
+
+  // Levels go in bands of rows, so nothing is recorded unless a row fits
+  VkDeviceSize row_size = (VkDeviceSize)extent.width * 4;
+  if (row_size == 0 || extent.height == 0 || mip_count == 0 ||
+      row_size > VK_STAGING_PIECE_SIZE) {
+    printf("A %ux%u image can't go through the staging ring.\n",
+           extent.width, extent.height);
+    return false;
+  }
+
+  VkImageSubresourceRange range = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = 0,
+      .levelCount = mip_count,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+  };
+
+  VkImageMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = 0,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = range,
+  };
+  vkCmdPipelineBarrier(VK_GetUploadCommandBuffer(rend),
+                       VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
+                       &barrier);
+
+  // Staging a band may submit the batch holding the previous ones, the
+  // command buffer is fetched after it. Batches run in order on the transfer
+  // queue, the layout transition comes first
+  const unsigned char *texels = data;
+  unsigned width = extent.width;
+  unsigned height = extent.height;
+  for (unsigned level = 0; level < mip_count; level++) {
+    VkDeviceSize level_row_size = (VkDeviceSize)width * 4;
+    unsigned band_rows = (unsigned)(VK_STAGING_PIECE_SIZE / level_row_size);
+
+    for (unsigned y = 0; y < height; y += band_rows) {
+      unsigned rows = height - y < band_rows ? height - y : band_rows;
+      VkDeviceSize band_size = level_row_size * rows;
+
+      VkDeviceSize offset;
+      void *staging = VK_AllocateStaging(rend, band_size, &offset);
+      memcpy(staging, texels, band_size);
+      texels += band_size;
+
+      VkBufferImageCopy region = {
+          .bufferOffset = offset,
+          .bufferRowLength = 0,
+          .bufferImageHeight = 0,
+          .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+          .imageSubresource.mipLevel = level,
+          .imageSubresource.baseArrayLayer = 0,
+          .imageSubresource.layerCount = 1,
+          .imageOffset = {0, (int32_t)y, 0},
+          .imageExtent = {width, rows, 1},
+      };
+      vkCmdCopyBufferToImage(VK_GetUploadCommandBuffer(rend), uploads->ring,
+                             image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                             &region);
+    }
+
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+
+  // Then to the graphics queue, ready to be sampled
+  VK_ReleaseUploadedImage(rend, image, range);
+  return true;
+}
+
+void VK_ReleaseUploadedImage(vk_rend_t *rend, VkImage image,
+                             VkImageSubresourceRange range) {
+  vk_uploads_t *uploads = rend->uploads;
+  VkCommandBuffer cmd = VK_GetUploadCommandBuffer(rend);
+
+  VkImageMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = range,
+  };
+
+  if (!VK_TransferOwnership(rend)) {
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+    return;
+  }
+
+  // Same layout transition on both sides, the acquire makes it visible
+  barrier.srcQueueFamilyIndex = rend->queue_family_transfer_index;
+  barrier.dstQueueFamilyIndex = rend->queue_family_graphics_index;
+  barrier.dstAccessMask = 0;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0,
+                       NULL, 1, &barrier);
+
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  VK_PushImageAcquire(&uploads->batches[uploads->current_batch].acquires,
+                      barrier);
+}
+
+void VK_FlushUploads(vk_rend_t *rend) {
+  vk_uploads_t *uploads = rend->uploads;
+  if (!uploads->recording) {
+    return;
+  }
+
+  vk_upload_batch_t *batch = &uploads->batches[uploads->current_batch];
+
+  // One copy per destination buffer, whatever the number of uploads
+  if (uploads->copy_count > 0) {
+    VkBufferCopy *regions = malloc(sizeof(VkBufferCopy) * uploads->copy_count);
+    bool *done = calloc(uploads->copy_count, sizeof(bool));
+
+    for (unsigned c = 0; c < uploads->copy_count; c++) {
+      if (done[c]) {
+        continue;
+      }
+
+      VkBuffer dst = uploads->copies[c].dst;
+      VkDeviceSize dst_start = VK_WHOLE_SIZE;
+      VkDeviceSize dst_end = 0;
+      unsigned region_count = 0;
+      for (unsigned o = c; o < uploads->copy_count; o++) {
+        if (!done[o] && uploads->copies[o].dst == dst) {
+          VkBufferCopy *region = &uploads->copies[o].region;
+          regions[region_count++] = *region;
+          done[o] = true;
+
+          if (region->dstOffset < dst_start) {
+            dst_start = region->dstOffset;
+          }
+          if (region->dstOffset + region->size > dst_end) {
+            dst_end = region->dstOffset + region->size;
+          }
+        }
+      }
+      vkCmdCopyBuffer(batch->cmd, uploads->ring, dst, region_count, regions);
+
+      if (VK_TransferOwnership(rend)) {
+        // Only the range written changes hands, the rest of the arena is
+        // read by frames in flight
+        VkBufferMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .srcQueueFamilyIndex = rend->queue_family_transfer_index,
+            .dstQueueFamilyIndex = rend->queue_family_graphics_index,
+            .buffer = dst,
+            .offset = dst_start,
+            .size = dst_end - dst_start,
+        };
+        vkCmdPipelineBarrier(batch->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL,
+                             1, &barrier, 0, NULL);
+
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                VK_ACCESS_INDEX_READ_BIT |
+                                VK_ACCESS_SHADER_READ_BIT;
+        VK_PushBufferAcquire(&batch->acquires, barrier);
+      }
+    }
+
+    free(regions);
+    free(done);
+    uploads->copy_count = 0;
+
+    if (!VK_TransferOwnership(rend)) {
+      VkMemoryBarrier barrier = {
+          .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+          .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                           VK_ACCESS_INDEX_READ_BIT |
+                           VK_ACCESS_SHADER_READ_BIT,
+      };
+      vkCmdPipelineBarrier(batch->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           0, 1, &barrier, 0, NULL, 0, NULL);
+    }
+  }
+
+  vkEndCommandBuffer(batch->cmd);
+  vmaFlushAllocation(rend->allocator, uploads->ring_alloc, 0, VK_WHOLE_SIZE);
+
+  batch->value = uploads->next_value++;
+
+  VkTimelineSemaphoreSubmitInfo timeline_info = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .signalSemaphoreValueCount = 1,
+      .pSignalSemaphoreValues = &batch->value,
+  };
+  VkSubmitInfo submit_info = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = &timeline_info,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &batch->cmd,
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores = &uploads->timeline,
+  };
+
+  vkQueueSubmit(rend->transfer_queue, 1, &submit_info, VK_NULL_HANDLE);
+
+  batch->submitted = true;
+  uploads->recording = false;
+  uploads->current_batch = (uploads->current_batch + 1) % VK_UPLOAD_BATCH_COUNT;
+}
+
+uint64_t VK_AcquireUploads(vk_rend_t *rend, VkCommandBuffer cmd) {
+  vk_uploads_t *uploads = rend->uploads;
+  vk_acquires_t *pending = &uploads->pending_acquires;
+
+  if (pending->buffer_count > 0 || pending->image_count > 0) {
+    // Same stage as the timeline wait of the frame submit, so the acquire is
+    // chained after the semaphore instead of racing it
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0, 0, NULL, pending->buffer_count, pending->buffers,
+                         pending->image_count, pending->images);
+    pending->buffer_count = 0;
+    pending->image_count = 0;
+  }
+
+  uploads->acquired_value = uploads->completed_value;
+  return uploads->acquired_value;
+}
+
+uint64_t VK_GetUploadValue(vk_rend_t *rend) {
+  vk_uploads_t *uploads = rend->uploads;
+  return uploads->recording ? uploads->next_value : uploads->next_value - 1;
+}
+
+bool VK_IsModelUploaded(vk_rend_t *rend, vk_model_t *model) {
+  return model->upload_value <= rend->uploads->acquired_value;
+}
+
+size_t VK_GetStagingBytes(vk_rend_t *rend) {
+  return (size_t)rend->uploads->ring_used;
+}
+
+void VK_DestroyUploads(vk_rend_t *rend) {
+  vk_uploads_t *uploads = rend->uploads;
+
+  VK_FlushUploads(rend);
+  VK_ReleaseUploads(rend, true);
+
+  for (unsigned b = 0; b < VK_UPLOAD_BATCH_COUNT; b++) {
+    VK_FreeAcquires(&uploads->batches[b].acquires);
+  }
+  VK_FreeAcquires(&uploads->pending_acquires);
+  vkDestroySemaphore(rend->device, uploads->timeline, NULL);
+
+  vmaUnmapMemory(rend->allocator, uploads->ring_alloc);
+  vmaDestroyBuffer(rend->allocator, uploads->ring, uploads->ring_alloc);
+
+  free(uploads->copies);
+  free(uploads);
+  rend->uploads = NULL;
+}